@@ -0,0 +1,400 @@
+#include "LoopBlocking.h"
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicsX86.h"
+#include "llvm/IR/PatternMatch.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/TargetParser/Triple.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+using namespace llvm;
+using namespace llvm::PatternMatch;
+
+namespace {
+
+// Reflected CRC-32C (Castagnoli) polynomial, the one the crc32 instruction implements
+const uint32_t CRC32CPoly = 0x82F63B78;
+
+// What the target offers for a CRC update
+struct TargetSupport {
+    bool CRC32 = false;
+    bool PCLMUL = false;
+    bool Is64Bit = false;
+
+    explicit TargetSupport(const Function &F) {
+        Triple T(F.getParent()->getTargetTriple());
+        if (!T.isX86())
+            return;
+        StringRef Features = F.getFnAttribute("target-features").getValueAsString();
+        // Clang enables crc32 along with SSE4.2; it is also available on
+        // its own for general-purpose-register-only code
+        CRC32 = Features.contains("+crc32");
+        PCLMUL = Features.contains("+pclmul");
+        Is64Bit = T.getArch() == Triple::x86_64;
+    }
+};
+
+// One step of a reflected CRC: c = (c >> 1) ^ (c & 1 ? Poly : 0)
+uint32_t crcBitStep(uint32_t C, uint32_t Poly) {
+    return (C >> 1) ^ ((C & 1) ? Poly : 0);
+}
+
+// Returns the reflected polynomial of a byte-at-a-time CRC-32 table, after
+// checking every entry against the table that polynomial generates
+std::optional<uint32_t> tablePolynomial(const GlobalVariable *GV) {
+    if (!GV->isConstant() || !GV->hasDefinitiveInitializer())
+        return std::nullopt;
+    auto *Table = dyn_cast<ConstantDataArray>(GV->getInitializer());
+    if (!Table || Table->getNumElements() != 256 ||
+        !Table->getElementType()->isIntegerTy(32))
+        return std::nullopt;
+    // Entry 0x80 is the polynomial itself: a single bit shifted out last
+    uint32_t Poly = Table->getElementAsInteger(0x80);
+    for (uint32_t I = 0; I < 256; ++I) {
+        uint32_t C = I;
+        for (int K = 0; K < 8; ++K)
+            C = crcBitStep(C, Poly);
+        if (Table->getElementAsInteger(I) != C)
+            return std::nullopt;
+    }
+    return Poly;
+}
+
+// A CRC-32 update by one byte: Crc is the old i32 value, Byte the new i8
+struct ByteUpdate {
+    Value *Crc = nullptr;
+    Value *Byte = nullptr;
+    uint32_t Poly = 0;
+};
+
+// Match crc ^ zext(byte), the value a byte update starts from
+bool matchCrcXorByte(Value *V, ByteUpdate &U) {
+    return match(V, m_c_Xor(m_Value(U.Crc), m_ZExt(m_Value(U.Byte)))) &&
+           U.Crc->getType()->isIntegerTy(32) && U.Byte->getType()->isIntegerTy(8);
+}
+
+// Match table[(crc ^ byte) & 0xff] ^ (crc >> 8)
+bool matchTableUpdate(Instruction &I, ByteUpdate &U) {
+    Value *Entry, *Crc;
+    if (!I.getType()->isIntegerTy(32) ||
+        !match(&I, m_c_Xor(m_Value(Entry), m_LShr(m_Value(Crc), m_SpecificInt(8)))))
+        return false;
+    auto *Load = dyn_cast<LoadInst>(Entry);
+    if (!Load || !Load->isSimple())
+        return false;
+    auto *GEP = dyn_cast<GetElementPtrInst>(Load->getPointerOperand());
+    if (!GEP || GEP->getNumIndices() == 0)
+        return false;
+    auto *GV = dyn_cast<GlobalVariable>(GEP->getPointerOperand());
+    if (!GV)
+        return false;
+    // Either table[idx] on the i32 elements or table[0][idx] on the array
+    for (unsigned K = 1; K < GEP->getNumOperands() - 1; ++K)
+        if (!match(GEP->getOperand(K), m_Zero()))
+            return false;
+    Type *SrcTy = GEP->getSourceElementType();
+    if (!(GEP->getNumIndices() == 1 && SrcTy->isIntegerTy(32)) &&
+        !(GEP->getNumIndices() == 2 && SrcTy->isArrayTy()))
+        return false;
+
+    // The index is (crc ^ zext(byte)) & 0xff, or zext(trunc(crc) ^ byte)
+    // once InstCombine has narrowed it
+    Value *Idx = GEP->getOperand(GEP->getNumOperands() - 1);
+    while (auto *Ext = dyn_cast<ZExtInst>(Idx))
+        Idx = Ext->getOperand(0);
+    Value *Masked;
+    if (match(Idx, m_And(m_Value(Masked), m_SpecificInt(0xff)))) {
+        if (!matchCrcXorByte(Masked, U))
+            return false;
+    } else if (!match(Idx, m_c_Xor(m_Trunc(m_Value(U.Crc)), m_Value(U.Byte))) ||
+               !U.Byte->getType()->isIntegerTy(8)) {
+        return false;
+    }
+    if (U.Crc != Crc)
+        return false;
+
+    std::optional<uint32_t> Poly = tablePolynomial(GV);
+    if (!Poly)
+        return false;
+    U.Poly = *Poly;
+    return true;
+}
+
+// Match a condition that is true exactly when the low bit of C is set
+// (or clear, if Inverted)
+bool matchLowBitTest(Value *Cond, Value *C, bool &Inverted) {
+    ICmpInst::Predicate Pred;
+    if (match(Cond, m_Trunc(m_Specific(C))) && Cond->getType()->isIntegerTy(1)) {
+        Inverted = false;
+        return true;
+    }
+    if (!match(Cond, m_ICmp(Pred, m_And(m_Specific(C), m_One()), m_Zero())) ||
+        !ICmpInst::isEquality(Pred))
+        return false;
+    Inverted = Pred == ICmpInst::ICMP_EQ;
+    return true;
+}
+
+// Match a value that is Poly when the low bit of C is set and 0 otherwise
+bool matchLowBitMask(Value *V, Value *C, uint32_t &Poly) {
+    const APInt *K;
+    Value *Cond, *Mask;
+    bool Inverted;
+    if (match(V, m_Select(m_Value(Cond), m_APInt(K), m_Zero())) &&
+        matchLowBitTest(Cond, C, Inverted) && !Inverted) {
+        Poly = K->getZExtValue();
+        return true;
+    }
+    if (match(V, m_Select(m_Value(Cond), m_Zero(), m_APInt(K))) &&
+        matchLowBitTest(Cond, C, Inverted) && Inverted) {
+        Poly = K->getZExtValue();
+        return true;
+    }
+    // -(c & 1) & Poly, or the same with the sign smeared by shifts
+    if (!match(V, m_c_And(m_Value(Mask), m_APInt(K))))
+        return false;
+    Poly = K->getZExtValue();
+    return match(Mask, m_Neg(m_And(m_Specific(C), m_One()))) ||
+           match(Mask, m_AShr(m_Shl(m_Specific(C), m_SpecificInt(31)), m_SpecificInt(31)));
+}
+
+// Match one bitwise CRC step and return the value it was applied to
+Value *matchBitStep(Value *V, uint32_t &Poly) {
+    Value *C, *Mask, *Cond;
+    const APInt *K;
+    bool Inverted;
+    if (!V->getType()->isIntegerTy(32))
+        return nullptr;
+    if (match(V, m_c_Xor(m_LShr(m_Value(C), m_One()), m_Value(Mask))) &&
+        matchLowBitMask(Mask, C, Poly))
+        return C;
+    // c & 1 ? (c >> 1) ^ Poly : c >> 1
+    if (match(V, m_Select(m_Value(Cond), m_Xor(m_LShr(m_Value(C), m_One()), m_APInt(K)),
+                          m_LShr(m_Deferred(C), m_One()))) &&
+        matchLowBitTest(Cond, C, Inverted) && !Inverted) {
+        Poly = K->getZExtValue();
+        return C;
+    }
+    return nullptr;
+}
+
+// Match eight bitwise steps applied to crc ^ zext(byte)
+bool matchBitwiseUpdate(Instruction &I, ByteUpdate &U) {
+    Value *V = &I;
+    for (int Step = 0; Step < 8; ++Step) {
+        uint32_t Poly;
+        V = matchBitStep(V, Poly);
+        if (!V || (Step > 0 && Poly != U.Poly))
+            return false;
+        U.Poly = Poly;
+    }
+    return matchCrcXorByte(V, U);
+}
+
+bool matchByteUpdate(Instruction &I, ByteUpdate &U) {
+    return matchTableUpdate(I, U) || matchBitwiseUpdate(I, U);
+}
+
+// Carry-less multiplication of two values below 2^32 and 2^33
+Value *emitCLMul(IRBuilder<> &B, Value *X, uint64_t K) {
+    Module *M = B.GetInsertBlock()->getModule();
+    Type *VecTy = FixedVectorType::get(B.getInt64Ty(), 2);
+    Value *VX = B.CreateInsertElement(Constant::getNullValue(VecTy), X, B.getInt64(0));
+    Value *VK = ConstantVector::get({B.getInt64(K), B.getInt64(0)});
+    Function *CLMul = Intrinsic::getDeclaration(M, Intrinsic::x86_pclmulqdq);
+    return B.CreateExtractElement(B.CreateCall(CLMul, {VX, VK, B.getInt8(0)}), B.getInt64(0));
+}
+
+// Barrett reduction constants for a reflected polynomial: the polynomial
+// with its x^32 term, and floor(x^64 / P), both reflected over 33 bits
+std::pair<uint64_t, uint64_t> barrettConstants(uint32_t Poly) {
+    auto Reflect = [](uint64_t V, unsigned Bits) {
+        uint64_t R = 0;
+        for (unsigned I = 0; I < Bits; ++I)
+            if (V >> I & 1)
+                R |= uint64_t(1) << (Bits - 1 - I);
+        return R;
+    };
+    uint64_t P = Reflect(Poly, 32) | (uint64_t(1) << 32);
+    // Long division of x^64 by P, one quotient bit at a time
+    unsigned __int128 Rem = (unsigned __int128)1 << 64;
+    uint64_t Quot = 0;
+    for (int I = 64; I >= 32; --I) {
+        if (Rem >> I & 1) {
+            Rem ^= (unsigned __int128)P << (I - 32);
+            Quot |= uint64_t(1) << (I - 32);
+        }
+    }
+    return {(uint64_t(Poly) << 1) | 1, Reflect(Quot, 33)};
+}
+
+// CRC of V followed by 32 zero bits, i.e. the update of a CRC of 0 by V
+Value *emitBarrett(IRBuilder<> &B, Value *V, uint32_t Poly) {
+    auto [P, Mu] = barrettConstants(Poly);
+    Value *X = B.CreateZExt(V, B.getInt64Ty());
+    Value *T1 = B.CreateAnd(emitCLMul(B, X, Mu), 0xffffffff);
+    Value *T2 = emitCLMul(B, T1, P);
+    return B.CreateTrunc(B.CreateLShr(T2, 32), B.getInt32Ty());
+}
+
+// Emits the update of the i32 CRC by Data (i8, i32 or i64), or returns null
+// if the target has nothing better than the code it replaces
+Value *emitCRCUpdate(IRBuilder<> &B, Value *Crc, Value *Data, uint32_t Poly,
+                     const TargetSupport &TS) {
+    Module *M = B.GetInsertBlock()->getModule();
+    unsigned Bits = Data->getType()->getIntegerBitWidth();
+    if (TS.CRC32 && Poly == CRC32CPoly && (Bits != 64 || TS.Is64Bit)) {
+        if (Bits == 64) {
+            Function *CRC = Intrinsic::getDeclaration(M, Intrinsic::x86_sse42_crc32_64_64);
+            Value *Wide = B.CreateCall(CRC, {B.CreateZExt(Crc, B.getInt64Ty()), Data});
+            return B.CreateTrunc(Wide, B.getInt32Ty());
+        }
+        Function *CRC = Intrinsic::getDeclaration(
+            M, Bits == 8 ? Intrinsic::x86_sse42_crc32_32_8 : Intrinsic::x86_sse42_crc32_32_32);
+        return B.CreateCall(CRC, {Crc, Data});
+    }
+    if (!TS.PCLMUL)
+        return nullptr;
+    switch (Bits) {
+    case 8: {
+        // Only the low byte goes through the reduction, from the top of the word
+        Value *Low = B.CreateAnd(B.CreateXor(Crc, B.CreateZExt(Data, B.getInt32Ty())), 0xff);
+        return B.CreateXor(B.CreateLShr(Crc, 8), emitBarrett(B, B.CreateShl(Low, 24), Poly));
+    }
+    case 32:
+        return emitBarrett(B, B.CreateXor(Crc, Data), Poly);
+    case 64: {
+        Value *Lo = B.CreateTrunc(Data, B.getInt32Ty());
+        Value *Hi = B.CreateTrunc(B.CreateLShr(Data, 32), B.getInt32Ty());
+        return emitBarrett(B, B.CreateXor(emitBarrett(B, B.CreateXor(Crc, Lo), Poly), Hi), Poly);
+    }
+    }
+    return nullptr;
+}
+
+// Turns a byte-at-a-time CRC loop over p[i] into one that consumes eight
+// bytes per iteration, leaving the tail to the original loop, whose update
+// is added to Tails
+bool blockCRCLoop(Loop &L, ScalarEvolution &SE, const TargetSupport &TS,
+                  SmallPtrSetImpl<Instruction *> &Tails) {
+    BlockableLoop BL;
+    if (!analyzeBlockableLoop(L, SE, BL) || !BL.Acc->getType()->isIntegerTy(32))
+        return false;
+    auto *Update = dyn_cast<Instruction>(BL.Acc->getIncomingValueForBlock(L.getLoopLatch()));
+    ByteUpdate U;
+    LoadInst *Load;
+    const SCEV *Base;
+    if (!Update || !matchByteUpdate(*Update, U) || U.Crc != BL.Acc ||
+        !matchUnitStrideLoad(U.Byte, L, SE, Load, Base))
+        return false;
+    // Blocks are 64-bit: crc32 needs x86-64 for them
+    if (!TS.PCLMUL && !(TS.CRC32 && U.Poly == CRC32CPoly && TS.Is64Bit))
+        return false;
+
+    Type *I64 = Type::getInt64Ty(L.getHeader()->getContext());
+    LoopBlockBody LB{
+        8, BL.Acc->getType(), {Base},
+        [](IRBuilder<> &, Value *Init) { return Init; },
+        [&](IRBuilder<> &B, Value *Crc, Value *Idx, ArrayRef<Value *> Bases) {
+            Value *Data = loadBlock(B, I64, Load, Bases[0], Idx);
+            return emitCRCUpdate(B, Crc, Data, U.Poly, TS);
+        },
+        [](IRBuilder<> &, Value *Crc, Value *) { return Crc; }};
+    blockLoop(BL, SE, LB, "crc.block");
+    Tails.insert(Update);
+    return true;
+}
+
+// Recognizes table-driven and bitwise reflected CRC-32 byte updates, with the
+// polynomial checked against the constant table, and rewrites them to the
+// SSE4.2 crc32 instruction for CRC-32C or to a carry-less multiply Barrett
+// reduction for any polynomial. Loops over byte arrays are also blocked to
+// consume eight bytes per update.
+//
+// A table lookup is a load from L1, a shift and a xor, faster than the two
+// dependent pclmulqdq of a Barrett reduction: a single table-driven byte
+// update is only rewritten to crc32, or in the tail of a blocked loop, where
+// the table is no longer kept in cache by the rest of the loop.
+struct CRCRecognition : public PassInfoMixin<CRCRecognition> {
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        TargetSupport TS(F);
+        if (!TS.CRC32 && !TS.PCLMUL)
+            return PreservedAnalyses::all();
+
+        auto &LI = FAM.getResult<LoopAnalysis>(F);
+        auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+        bool CFGChanged = false;
+        SmallPtrSet<Instruction *, 4> Tails;
+        for (Loop *L : LI.getLoopsInPreorder())
+            CFGChanged |= blockCRCLoop(*L, SE, TS, Tails);
+
+        // The byte updates left, including the tails of blocked loops
+        SmallVector<WeakTrackingVH, 8> Dead;
+        for (auto &BB : F) {
+            for (Instruction &I : BB) {
+                ByteUpdate U;
+                if (I.use_empty())
+                    continue;
+                if (matchTableUpdate(I, U)) {
+                    if (!(TS.CRC32 && U.Poly == CRC32CPoly) && !Tails.contains(&I))
+                        continue;
+                } else if (!matchBitwiseUpdate(I, U)) {
+                    continue;
+                }
+                IRBuilder<> Builder(&I);
+                Value *New = emitCRCUpdate(Builder, U.Crc, U.Byte, U.Poly, TS);
+                if (!New)
+                    continue;
+                New->takeName(&I);
+                I.replaceAllUsesWith(New);
+                Dead.push_back(&I);
+            }
+        }
+        RecursivelyDeleteTriviallyDeadInstructions(Dead);
+
+        if (CFGChanged)
+            return PreservedAnalyses::none();
+        if (Dead.empty())
+            return PreservedAnalyses::all();
+        PreservedAnalyses PA;
+        PA.preserveSet<CFGAnalyses>();
+        return PA;
+    }
+};
+}
+
+// Register the pass as a plugin
+PassPluginLibraryInfo getCRCRecognitionPluginInfo() {
+    return {LLVM_PLUGIN_API_VERSION, "CRCRecognition", LLVM_VERSION_STRING,
+            [](PassBuilder &PB) {
+                PB.registerPipelineParsingCallback(
+                    [](StringRef Name, FunctionPassManager &FPM,
+                       ArrayRef<PassBuilder::PipelineElement>) {
+                      if (Name == "crc-recognition") {
+                        FPM.addPass(CRCRecognition());
+                        return true;
+                      }
+                      return false;
+                    });
+                // Full unrolling has turned bitwise inner loops into chains
+                // of eight steps by the time the vectorizers run
+                PB.registerVectorizerStartEPCallback([](FunctionPassManager &FPM,
+                                                        OptimizationLevel Level) {
+                    FPM.addPass(CRCRecognition());
+                });
+            }};
+}
+
+// Entry point for the pass plugin
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+    return getCRCRecognitionPluginInfo();
+}
@@ -0,0 +1,106 @@
+//===- CycleEstimate.h - Static estimate of cycles per call ---------------===//
+//
+// Estimates how many cycles one call of a function spends in its own code,
+// without a profile. Each instruction costs what TargetTransformInfo says,
+// as reciprocal throughput or as latency, and each block is weighted by how
+// often it runs per call according to BlockFrequencyInfo. Where
+// ScalarEvolution knows the trip count of a loop, it replaces the guess the
+// static branch probabilities make for it. Callees are not included.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_CYCLEESTIMATE_H
+#define TUTORIAL_LLVM_PASS_CYCLEESTIMATE_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+// Cost of one execution of I, or 0 where the target cannot tell
+inline double instructionCycles(const Instruction &I, const TargetTransformInfo &TTI,
+                                TargetTransformInfo::TargetCostKind CostKind) {
+    InstructionCost Cost = TTI.getInstructionCost(&I, CostKind);
+    return Cost.isValid() ? double(*Cost.getValue()) : 0.0;
+}
+
+struct CycleEstimate {
+    // Executions of each block per call of the function
+    DenseMap<const BasicBlock *, double> BlockWeight;
+    double CyclesPerCall = 0;
+
+    double weight(const BasicBlock *BB) const { return BlockWeight.lookup(BB); }
+
+    // Estimated cycles one call spends in I
+    double cycles(const Instruction &I, const TargetTransformInfo &TTI,
+                  TargetTransformInfo::TargetCostKind CostKind =
+                      TargetTransformInfo::TCK_RecipThroughput) const {
+        return instructionCycles(I, TTI, CostKind) * weight(I.getParent());
+    }
+};
+
+class CycleEstimateAnalysis : public AnalysisInfoMixin<CycleEstimateAnalysis> {
+    friend AnalysisInfoMixin<CycleEstimateAnalysis>;
+    static inline AnalysisKey Key;
+
+public:
+    using Result = CycleEstimate;
+
+    explicit CycleEstimateAnalysis(
+        TargetTransformInfo::TargetCostKind CostKind = TargetTransformInfo::TCK_RecipThroughput)
+        : CostKind(CostKind) {}
+
+    Result run(Function &F, FunctionAnalysisManager &FAM) {
+        Result R;
+        if (F.isDeclaration())
+            return R;
+        auto &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
+        auto &LI = FAM.getResult<LoopAnalysis>(F);
+        auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+        auto &TTI = FAM.getResult<TargetIRAnalysis>(F);
+
+        // Scale of each loop's iterations from the static guess to the trip
+        // count SCEV computed, compounded with the scales of enclosing loops
+        DenseMap<const Loop *, double> Scale;
+        for (Loop *L : LI.getLoopsInPreorder()) {
+            double Outer = L->getParentLoop() ? Scale.lookup(L->getParentLoop()) : 1.0;
+            double Own = 1.0;
+            BasicBlock *Preheader = L->getLoopPreheader();
+            // Only an exact count: the maximum of a loop up to a variable
+            // bound is about 2^31
+            unsigned TripCount = SE.getSmallConstantTripCount(L);
+            if (Preheader && TripCount) {
+                double Entries = BFI.getBlockFreq(Preheader).getFrequency();
+                double Iterations = BFI.getBlockFreq(L->getHeader()).getFrequency();
+                if (Entries > 0 && Iterations > 0)
+                    Own = TripCount / (Iterations / Entries);
+            }
+            Scale[L] = Outer * Own;
+        }
+
+        double Entry = BFI.getBlockFreq(&F.getEntryBlock()).getFrequency();
+        for (BasicBlock &BB : F) {
+            double Weight = Entry ? BFI.getBlockFreq(&BB).getFrequency() / Entry : 0.0;
+            if (Loop *L = LI.getLoopFor(&BB))
+                Weight *= Scale.lookup(L);
+            R.BlockWeight[&BB] = Weight;
+            double Cycles = 0;
+            for (Instruction &I : BB)
+                Cycles += instructionCycles(I, TTI, CostKind);
+            R.CyclesPerCall += Cycles * Weight;
+        }
+        return R;
+    }
+
+private:
+    TargetTransformInfo::TargetCostKind CostKind;
+};
+
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_CYCLEESTIMATE_H
@@ -0,0 +1,143 @@
+//===- FunctionControls.h - Per-function optimization controls ------------===//
+//
+// Lets the owner of a hot function tune the plugins' passes for it alone,
+// without changing the flags of the whole build. Controls are written as
+// "key:value" strings, either in the source:
+//
+//   __attribute__((annotate("sr:aggressive")))
+//   void hot(...) { ... }
+//
+// or as IR function attributes, "sr"="aggressive" or "sr:aggressive". Several
+// controls may share one string, separated by commas. Known controls:
+//
+//   sr:off | sr:aggressive             strength reduction (MultiplicationShifts)
+//   instrument:none | instrument:latency   runtime instrumentation passes:
+//                                          none, or only the timing of
+//                                          blocking calls (locks, I/O)
+//
+// The controls of a function are parsed once and cached by
+// FunctionControlsAnalysis, which no transformation invalidates. A control
+// that is set overrides the corresponding command-line option.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_FUNCTIONCONTROLS_H
+#define TUTORIAL_LLVM_PASS_FUNCTIONCONTROLS_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace llvm {
+
+enum class ControlLevel { Default, Off, Aggressive };
+enum class InstrumentMode { Default, None, Latency };
+
+struct FunctionControls {
+    ControlLevel StrengthReduction = ControlLevel::Default;
+    InstrumentMode Instrument = InstrumentMode::Default;
+
+    // The level to use, given the one the command line asks for
+    ControlLevel strengthReduction(ControlLevel Option) const {
+        return StrengthReduction == ControlLevel::Default ? Option : StrengthReduction;
+    }
+    InstrumentMode instrument(InstrumentMode Option) const {
+        return Instrument == InstrumentMode::Default ? Option : Instrument;
+    }
+
+    // Whether the function gets the counters and traces of the profiles,
+    // which instrument:latency leaves out of a function too hot for them
+    bool counted() const { return Instrument == InstrumentMode::Default; }
+    // Whether the function gets the timing of its locking and I/O calls
+    bool timed() const { return Instrument != InstrumentMode::None; }
+
+    // Applies one "key:value" control. Keys other passes or tools may use
+    // are ignored; a known key with an unknown value is reported.
+    void parse(StringRef Control, const Function &F) {
+        auto [Key, Value] = Control.trim().split(':');
+        bool Known = true;
+        if (Key == "sr") {
+            if (Value == "off")
+                StrengthReduction = ControlLevel::Off;
+            else if (Value == "aggressive")
+                StrengthReduction = ControlLevel::Aggressive;
+            else
+                Known = Value == "default";
+        } else if (Key == "instrument") {
+            if (Value == "none")
+                Instrument = InstrumentMode::None;
+            else if (Value == "latency")
+                Instrument = InstrumentMode::Latency;
+            else
+                Known = Value == "default";
+        }
+        if (!Known)
+            errs() << "warning: " << F.getName() << ": unknown control \"" << Control.trim()
+                   << "\"\n";
+    }
+
+    void parseList(StringRef Controls, const Function &F) {
+        SmallVector<StringRef, 4> Parts;
+        Controls.split(Parts, ',', -1, /*KeepEmpty=*/false);
+        for (StringRef Control : Parts)
+            parse(Control, F);
+    }
+};
+
+class FunctionControlsAnalysis : public AnalysisInfoMixin<FunctionControlsAnalysis> {
+    friend AnalysisInfoMixin<FunctionControlsAnalysis>;
+    static inline AnalysisKey Key;
+
+public:
+    struct Result : FunctionControls {
+        // Attributes and annotations do not change during optimization
+        bool invalidate(Function &, const PreservedAnalyses &,
+                        FunctionAnalysisManager::Invalidator &) {
+            return false;
+        }
+    };
+
+    Result run(Function &F, FunctionAnalysisManager &) {
+        Result R;
+        for (const Attribute &A : F.getAttributes().getFnAttrs()) {
+            if (!A.isStringAttribute())
+                continue;
+            StringRef Kind = A.getKindAsString(), Value = A.getValueAsString();
+            if (Kind.contains(':') && Value.empty())
+                R.parseList(Kind, F);
+            else if (Kind == "sr" || Kind == "instrument")
+                R.parse((Kind + ":" + Value).str(), F);
+        }
+
+        // Clang lists annotate attributes in llvm.global.annotations, as
+        // { function, string, file, line, arguments } entries
+        const GlobalVariable *Annotations =
+            F.getParent()->getNamedGlobal("llvm.global.annotations");
+        const auto *Entries =
+            Annotations ? dyn_cast_or_null<ConstantArray>(Annotations->getInitializer()) : nullptr;
+        if (!Entries)
+            return R;
+        for (const Use &U : Entries->operands()) {
+            const auto *Entry = dyn_cast<ConstantStruct>(U.get());
+            if (!Entry || Entry->getNumOperands() < 2 ||
+                Entry->getOperand(0)->stripPointerCasts() != &F)
+                continue;
+            const auto *Str = dyn_cast<GlobalVariable>(Entry->getOperand(1)->stripPointerCasts());
+            const auto *Data = Str && Str->hasInitializer()
+                                   ? dyn_cast<ConstantDataSequential>(Str->getInitializer())
+                                   : nullptr;
+            if (Data && Data->isCString())
+                R.parseList(Data->getAsCString(), F);
+        }
+        return R;
+    }
+};
+
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_FUNCTIONCONTROLS_H
@@ -0,0 +1,198 @@
+//===- LoopBlocking.h - Run a reduction loop in blocks of iterations ------===//
+//
+// Shared by the loop idiom passes. A read-only, single-block loop that carries
+// one accumulator is preceded by a loop that handles Block iterations at a
+// time with whatever wide instructions the idiom maps to. The original loop
+// then runs the remaining iterations. At least one iteration is always left
+// to it, so the rotated loop and its exit values need no changes beyond new
+// start values for its header phis.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_LOOPBLOCKING_H
+#define TUTORIAL_LLVM_PASS_LOOPBLOCKING_H
+
+#include "llvm/Analysis/IVDescriptors.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+
+#include <functional>
+
+namespace llvm {
+
+// A loop the blocking transformation applies to
+struct BlockableLoop {
+    Loop *L = nullptr;
+    BasicBlock *Preheader = nullptr;
+    const SCEV *BackedgeTakenCount = nullptr;
+    // The only header phi that is not an induction
+    PHINode *Acc = nullptr;
+    SmallVector<std::pair<PHINode *, InductionDescriptor>, 2> IVs;
+};
+
+// How one iteration of the blocked loop is emitted. Bases are loop-invariant
+// pointers, expanded in the preheader and handed to Step in the same order.
+struct LoopBlockBody {
+    unsigned Block;
+    Type *AccTy;
+    SmallVector<const SCEV *, 2> Bases;
+    // Initial value of the blocked accumulator, from the original one
+    std::function<Value *(IRBuilder<> &, Value *Init)> Start;
+    // Next blocked accumulator for the iterations [Idx, Idx + Block)
+    std::function<Value *(IRBuilder<> &, Value *Acc, Value *Idx,
+                          ArrayRef<Value *> Bases)> Step;
+    // Value of the original accumulator after the blocked loop
+    std::function<Value *(IRBuilder<> &, Value *Acc, Value *Init)> Finish;
+};
+
+// Checks that L is an innermost, single-block, rotated loop with a
+// computable trip count that only reads memory, and finds its accumulator.
+inline bool analyzeBlockableLoop(Loop &L, ScalarEvolution &SE, BlockableLoop &BL) {
+    BasicBlock *Header = L.getHeader();
+    BL.L = &L;
+    BL.Preheader = L.getLoopPreheader();
+    if (!L.isInnermost() || L.getNumBlocks() != 1 || !BL.Preheader ||
+        L.getExitingBlock() != Header)
+        return false;
+    BL.BackedgeTakenCount = SE.getBackedgeTakenCount(&L);
+    if (isa<SCEVCouldNotCompute>(BL.BackedgeTakenCount))
+        return false;
+
+    // Skipping iterations is only valid for loops that do nothing but read
+    for (Instruction &I : *Header)
+        if (I.mayWriteToMemory() || I.mayThrow() ||
+            (isa<LoadInst>(I) && !cast<LoadInst>(I).isSimple()))
+            return false;
+
+    for (PHINode &Phi : Header->phis()) {
+        InductionDescriptor ID;
+        if (InductionDescriptor::isInductionPHI(&Phi, &L, &SE, ID) &&
+            ID.getKind() != InductionDescriptor::IK_FpInduction) {
+            BL.IVs.push_back({&Phi, ID});
+            continue;
+        }
+        if (BL.Acc)
+            return false;
+        BL.Acc = &Phi;
+    }
+    return BL.Acc != nullptr;
+}
+
+// A load from a[i] where a advances by one element per iteration of L
+inline bool matchUnitStrideLoad(Value *V, Loop &L, ScalarEvolution &SE,
+                                LoadInst *&Load, const SCEV *&Base) {
+    Load = dyn_cast<LoadInst>(V);
+    if (!Load || !Load->isSimple() || !L.contains(Load))
+        return false;
+    auto *AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(Load->getPointerOperand()));
+    if (!AR || AR->getLoop() != &L || !AR->isAffine())
+        return false;
+    const DataLayout &DL = Load->getModule()->getDataLayout();
+    auto *Step = dyn_cast<SCEVConstant>(AR->getStepRecurrence(SE));
+    if (!Step || Step->getAPInt() != DL.getTypeStoreSize(Load->getType()))
+        return false;
+    Base = AR->getStart();
+    return SE.isLoopInvariant(Base, &L);
+}
+
+// Loads Ty from element Idx of the array Like reads from, starting at Base
+inline Value *loadBlock(IRBuilder<> &B, Type *Ty, LoadInst *Like, Value *Base, Value *Idx) {
+    const DataLayout &DL = Like->getModule()->getDataLayout();
+    Value *Offset = B.CreateMul(Idx, B.getInt64(DL.getTypeStoreSize(Like->getType())));
+    Value *Ptr = B.CreateGEP(B.getInt8Ty(), Base, Offset);
+    return B.CreateAlignedLoad(Ty, Ptr, Like->getAlign());
+}
+
+// Loop metadata that makes the loop vectorizer leave a loop alone
+inline MDNode *vectorizedLoopID(LLVMContext &Ctx, MDNode *OrigLoopID) {
+    MDNode *Vectorized = MDNode::get(
+        Ctx, {MDString::get(Ctx, "llvm.loop.isvectorized"),
+              ConstantAsMetadata::get(ConstantInt::get(Type::getInt32Ty(Ctx), 1))});
+    return makePostTransformationMetadata(Ctx, OrigLoopID, {}, {Vectorized});
+}
+
+// Runs the first ((TC - 1) & -Block) iterations of BL.L through a new loop
+// emitted by Body, then enters the original loop for the rest
+inline void blockLoop(BlockableLoop &BL, ScalarEvolution &SE,
+                      const LoopBlockBody &Body, const char *Prefix) {
+    Loop &L = *BL.L;
+    BasicBlock *Header = L.getHeader();
+    BasicBlock *Preheader = BL.Preheader;
+    Function &F = *Header->getParent();
+    LLVMContext &Ctx = F.getContext();
+    Type *I64 = Type::getInt64Ty(Ctx);
+
+    // Everything the new loop and the scalar loop's new entry need is
+    // expanded in the preheader, before the CFG changes
+    Instruction *PHTerm = Preheader->getTerminator();
+    SCEVExpander Expander(SE, F.getParent()->getDataLayout(), Prefix);
+    const SCEV *TCS = SE.getAddExpr(SE.getZeroExtendExpr(BL.BackedgeTakenCount, I64),
+                                    SE.getOne(I64));
+    Value *TC = Expander.expandCodeFor(TCS, I64, PHTerm);
+    IRBuilder<> B(PHTerm);
+    Value *BlockTC = B.CreateAnd(B.CreateSub(TC, B.getInt64(1)), -uint64_t(Body.Block),
+                                 Twine(Prefix) + ".tc");
+    SmallVector<Value *, 2> Bases;
+    for (const SCEV *Base : Body.Bases)
+        Bases.push_back(Expander.expandCodeFor(Base, Base->getType(), PHTerm));
+    const SCEV *BlockTCS = SE.getSCEV(BlockTC);
+    SmallVector<Value *, 2> IVStarts;
+    for (auto &[Phi, ID] : BL.IVs) {
+        const SCEV *Step = ID.getStep();
+        const SCEV *Offset = SE.getMulExpr(SE.getTruncateOrZeroExtend(BlockTCS, Step->getType()), Step);
+        const SCEV *Start = SE.getAddExpr(SE.getSCEV(ID.getStartValue()), Offset);
+        IVStarts.push_back(Expander.expandCodeFor(Start, Phi->getType(), PHTerm));
+    }
+    Value *AccInit = BL.Acc->getIncomingValueForBlock(Preheader);
+    Value *BlockAccInit = Body.Start(B, AccInit);
+
+    BasicBlock *BlockBody = BasicBlock::Create(Ctx, Twine(Prefix) + ".body", &F, Header);
+    BasicBlock *Middle = BasicBlock::Create(Ctx, Twine(Prefix) + ".middle", &F, Header);
+    BasicBlock *ScalarPH = BasicBlock::Create(Ctx, Twine(Prefix) + ".scalar.ph", &F, Header);
+
+    B.CreateCondBr(B.CreateICmpEQ(BlockTC, B.getInt64(0)), ScalarPH, BlockBody);
+    PHTerm->eraseFromParent();
+
+    // Blocked loop over [0, BlockTC)
+    IRBuilder<> BB(BlockBody);
+    PHINode *Idx = BB.CreatePHI(I64, 2, Twine(Prefix) + ".idx");
+    PHINode *Acc = BB.CreatePHI(Body.AccTy, 2, Twine(Prefix) + ".acc");
+    Value *AccNext = Body.Step(BB, Acc, Idx, Bases);
+    Value *IdxNext = BB.CreateAdd(Idx, BB.getInt64(Body.Block), "", /*HasNUW=*/true);
+    BranchInst *Latch = BB.CreateCondBr(BB.CreateICmpEQ(IdxNext, BlockTC), Middle, BlockBody);
+    Idx->addIncoming(BB.getInt64(0), Preheader);
+    Idx->addIncoming(IdxNext, BlockBody);
+    Acc->addIncoming(BlockAccInit, Preheader);
+    Acc->addIncoming(AccNext, BlockBody);
+
+    IRBuilder<> MB(Middle);
+    Value *AccResume = Body.Finish(MB, AccNext, AccInit);
+    MB.CreateBr(ScalarPH);
+
+    // The original loop resumes at iteration BlockTC
+    IRBuilder<> SB(ScalarPH);
+    auto Resume = [&](PHINode *Phi, Value *FromMiddle) {
+        PHINode *NewPhi = SB.CreatePHI(Phi->getType(), 2, Phi->getName() + ".resume");
+        NewPhi->addIncoming(Phi->getIncomingValueForBlock(Preheader), Preheader);
+        NewPhi->addIncoming(FromMiddle, Middle);
+        int Index = Phi->getBasicBlockIndex(Preheader);
+        Phi->setIncomingBlock(Index, ScalarPH);
+        Phi->setIncomingValue(Index, NewPhi);
+    };
+    Resume(BL.Acc, AccResume);
+    for (unsigned I = 0; I < BL.IVs.size(); ++I)
+        Resume(BL.IVs[I].first, IVStarts[I]);
+    SB.CreateBr(Header);
+
+    L.setLoopID(vectorizedLoopID(Ctx, L.getLoopID()));
+    Latch->setMetadata(LLVMContext::MD_loop, vectorizedLoopID(Ctx, nullptr));
+    SE.forgetLoop(&L);
+}
+
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_LOOPBLOCKING_H
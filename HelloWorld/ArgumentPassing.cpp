@@ -0,0 +1,339 @@
+#include "ArgumentPassing.h"
+
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+static cl::opt<bool> RewriteArguments(
+    "rewrite-argument-passing", cl::init(false),
+    cl::desc("Run argument-passing at the end of the optimization pipeline; it changes the "
+             "signatures of internal functions"));
+
+namespace {
+
+// SysV x86-64 passes this many integer and pointer arguments in registers
+constexpr unsigned IntegerRegisters = 6;
+
+// What becomes of one argument of the old signature
+struct ArgPlan {
+    enum { Keep, Drop, Pack } Action = Keep;
+    // Drop: what the body sees instead
+    Value *Replacement = nullptr;
+    // Keep, Pack: the argument of the new signature
+    unsigned NewIndex = 0;
+    // Pack: bit offset in the 64-bit argument, and for the upper half, the
+    // old argument in the lower half
+    unsigned Shift = 0;
+    unsigned Partner = 0;
+    // Keep: a byval aggregate now passed by pointer
+    bool ByvalToPointer = false;
+};
+
+// Integer registers an argument takes; byval aggregates are copied to the
+// stack, and floating-point ones go to vector registers
+unsigned integerRegisters(const Argument &A, Type *Ty) {
+    if (A.hasByValAttr())
+        return 0;
+    if (Ty->isPointerTy())
+        return 1;
+    if (Ty->isIntegerTy())
+        return divideCeil(Ty->getIntegerBitWidth(), 64);
+    return 0;
+}
+
+int stackArguments(unsigned IntegerArgs) {
+    return IntegerArgs > IntegerRegisters ? int(IntegerArgs - IntegerRegisters) : 0;
+}
+
+// Collects the calls of F, if every use of F is a direct call of its type
+bool collectCalls(Function &F, SmallVectorImpl<CallBase *> &Calls) {
+    for (Use &U : F.uses()) {
+        auto *CB = dyn_cast<CallBase>(U.getUser());
+        if (!CB || !CB->isCallee(&U) || isa<CallBrInst>(CB) || CB->isMustTailCall() ||
+            CB->getFunctionType() != F.getFunctionType())
+            return false;
+        Calls.push_back(CB);
+    }
+    return !Calls.empty();
+}
+
+// Arguments whose attributes give them a meaning beyond their value
+bool isSpecial(const Argument &A) {
+    for (Attribute::AttrKind Kind :
+         {Attribute::StructRet, Attribute::InAlloca, Attribute::Preallocated, Attribute::Nest,
+          Attribute::Returned, Attribute::SwiftSelf, Attribute::SwiftError,
+          Attribute::SwiftAsync, Attribute::ByRef})
+        if (A.hasAttribute(Kind))
+            return true;
+    return false;
+}
+
+// Whether the memory A points to is only loaded from, directly or through GEPs
+bool onlyLoadedFrom(Argument &A) {
+    SmallVector<Value *, 8> Worklist{&A};
+    while (!Worklist.empty()) {
+        Value *V = Worklist.pop_back_val();
+        for (User *U : V->users()) {
+            if (auto *LI = dyn_cast<LoadInst>(U)) {
+                if (LI->getPointerOperand() != V || LI->isVolatile())
+                    return false;
+            } else if (auto *GEP = dyn_cast<GetElementPtrInst>(U)) {
+                if (GEP->getPointerOperand() != V)
+                    return false;
+                Worklist.push_back(GEP);
+            } else {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Whether F may write any memory but its own stack frame, in which case a
+// byval copy may differ from the caller's object during the call
+bool writesNonLocalMemory(Function &F) {
+    for (Instruction &I : instructions(F)) {
+        if (!I.mayWriteToMemory() || isa<DbgInfoIntrinsic>(I) || I.isLifetimeStartOrEnd())
+            continue;
+        if (auto *SI = dyn_cast<StoreInst>(&I))
+            if (!SI->isVolatile() &&
+                isa<AllocaInst>(getUnderlyingObject(SI->getPointerOperand())))
+                continue;
+        return true;
+    }
+    return false;
+}
+
+// Only narrow integers with at most value-preserving attributes are packed
+bool isPackable(const Argument &A) {
+    auto *Ty = dyn_cast<IntegerType>(A.getType());
+    if (!Ty || Ty->getBitWidth() > 32)
+        return false;
+    for (const Attribute &Attr : A.getParent()->getAttributes().getParamAttrs(A.getArgNo()))
+        if (!Attr.hasAttribute(Attribute::NoUndef) && !Attr.hasAttribute(Attribute::ZExt) &&
+            !Attr.hasAttribute(Attribute::SExt))
+            return false;
+    return true;
+}
+
+// Per-argument attributes of the new signature: those of the kept
+// arguments, without byval on the ones now passed by pointer
+AttributeList rewriteAttributes(LLVMContext &Ctx, AttributeList Attrs, ArrayRef<ArgPlan> Plans,
+                                unsigned NumParams, bool Definition) {
+    SmallVector<AttributeSet, 8> Params(NumParams);
+    for (auto [ArgNo, Plan] : enumerate(Plans)) {
+        if (Plan.Action != ArgPlan::Keep)
+            continue;
+        AttrBuilder B(Ctx, Attrs.getParamAttrs(ArgNo));
+        if (Plan.ByvalToPointer) {
+            B.removeAttribute(Attribute::ByVal);
+            B.removeAttribute(Attribute::Alignment);
+            if (Definition) {
+                B.addAttribute(Attribute::ReadOnly);
+                B.addAttribute(Attribute::NoCapture);
+            }
+        }
+        Params[Plan.NewIndex] = AttributeSet::get(Ctx, B);
+    }
+    return AttributeList::get(Ctx, Attrs.getFnAttrs(), Attrs.getRetAttrs(), Params);
+}
+
+// Replaces F by a function of the planned signature and rewrites its calls
+Function *rewriteSignature(Function &F, ArrayRef<ArgPlan> Plans, ArrayRef<CallBase *> Calls) {
+    LLVMContext &Ctx = F.getContext();
+    Type *I64 = Type::getInt64Ty(Ctx);
+    SmallVector<Type *, 8> Params;
+    for (auto [ArgNo, Plan] : enumerate(Plans)) {
+        if (Plan.Action == ArgPlan::Keep)
+            Params.push_back(F.getArg(ArgNo)->getType());
+        else if (Plan.Action == ArgPlan::Pack && Plan.Shift == 0)
+            Params.push_back(I64);
+    }
+    auto *NFTy = FunctionType::get(F.getReturnType(), Params, false);
+    Function *NF = Function::Create(NFTy, F.getLinkage(), F.getAddressSpace(), "");
+    NF->copyAttributesFrom(&F);
+    NF->setComdat(F.getComdat());
+    NF->setAttributes(rewriteAttributes(Ctx, F.getAttributes(), Plans, Params.size(), true));
+    NF->copyMetadata(&F, 0);
+    F.getParent()->getFunctionList().insert(F.getIterator(), NF);
+    NF->takeName(&F);
+    NF->splice(NF->begin(), &F);
+
+    // The body sees the old arguments again
+    IRBuilder<> Builder(&*NF->getEntryBlock().getFirstInsertionPt());
+    for (auto [ArgNo, Plan] : enumerate(Plans)) {
+        Argument *Old = F.getArg(ArgNo);
+        Value *New = Plan.Replacement;
+        if (Plan.Action != ArgPlan::Drop)
+            New = NF->getArg(Plan.NewIndex);
+        if (Plan.Action == ArgPlan::Pack)
+            New = Builder.CreateTrunc(Plan.Shift ? Builder.CreateLShr(New, Plan.Shift) : New,
+                                      Old->getType(), Old->getName());
+        else if (Plan.Action == ArgPlan::Keep)
+            New->takeName(Old);
+        Old->replaceAllUsesWith(New);
+    }
+
+    bool ByPointer = any_of(Plans, [](const ArgPlan &P) { return P.ByvalToPointer; });
+    for (CallBase *CB : Calls) {
+        Builder.SetInsertPoint(CB);
+        SmallVector<Value *, 8> Args(Params.size());
+        for (auto [ArgNo, Plan] : enumerate(Plans)) {
+            Value *Arg = CB->getArgOperand(ArgNo);
+            if (Plan.Action == ArgPlan::Keep) {
+                Args[Plan.NewIndex] = Arg;
+            } else if (Plan.Action == ArgPlan::Pack) {
+                // An undef or poison part must not spread to the others
+                if (!isGuaranteedNotToBeUndefOrPoison(Arg))
+                    Arg = Builder.CreateFreeze(Arg, Arg->getName() + ".fr");
+                Value *Part = Builder.CreateZExt(Arg, I64);
+                Args[Plan.NewIndex] =
+                    Plan.Shift ? Builder.CreateOr(Args[Plan.NewIndex],
+                                                  Builder.CreateShl(Part, Plan.Shift))
+                               : Part;
+            }
+        }
+        SmallVector<OperandBundleDef, 1> Bundles;
+        CB->getOperandBundlesAsDefs(Bundles);
+        CallBase *New;
+        if (auto *II = dyn_cast<InvokeInst>(CB)) {
+            New = InvokeInst::Create(NF, II->getNormalDest(), II->getUnwindDest(), Args, Bundles,
+                                     "", CB);
+        } else {
+            auto *CI = CallInst::Create(NF, Args, Bundles, "", CB);
+            // The callee may now read the caller's stack through the pointer
+            CI->setTailCallKind(ByPointer && cast<CallInst>(CB)->isTailCall()
+                                    ? CallInst::TCK_None
+                                    : cast<CallInst>(CB)->getTailCallKind());
+            New = CI;
+        }
+        New->setCallingConv(CB->getCallingConv());
+        New->setAttributes(
+            rewriteAttributes(Ctx, CB->getAttributes(), Plans, Params.size(), false));
+        New->copyMetadata(*CB);
+        New->takeName(CB);
+        CB->replaceAllUsesWith(New);
+        CB->eraseFromParent();
+    }
+    F.eraseFromParent();
+    return NF;
+}
+
+} // namespace
+
+PreservedAnalyses ArgumentPassing::run(Module &M, ModuleAnalysisManager &) {
+    const DataLayout &DL = M.getDataLayout();
+    bool Changed = false;
+    for (Function &F : make_early_inc_range(M)) {
+        SmallVector<CallBase *, 8> Calls;
+        if (!F.hasLocalLinkage() || F.isDeclaration() || F.isVarArg() || F.hasOptNone() ||
+            F.hasFnAttribute(Attribute::Naked) || !collectCalls(F, Calls))
+            continue;
+
+        SmallVector<ArgPlan, 8> Plans(F.arg_size());
+        unsigned IntegersBefore = 0, IntegersAfter = 0, CopiedBytes = 0, ByPointer = 0;
+        bool WritesMemory = writesNonLocalMemory(F);
+        for (Argument &A : F.args()) {
+            ArgPlan &Plan = Plans[A.getArgNo()];
+            IntegersBefore += integerRegisters(A, A.getType());
+            uint64_t Bytes = A.hasByValAttr() ? DL.getTypeAllocSize(A.getParamByValType()) : 0;
+            if (isSpecial(A))
+                continue;
+            if (A.use_empty()) {
+                Plan = {ArgPlan::Drop, PoisonValue::get(A.getType())};
+                CopiedBytes += Bytes;
+                continue;
+            }
+            auto *C = dyn_cast<Constant>(Calls.front()->getArgOperand(A.getArgNo()));
+            if (C && !A.hasByValAttr() && all_of(Calls, [&](CallBase *CB) {
+                    return CB->getArgOperand(A.getArgNo()) == C;
+                })) {
+                Plan = {ArgPlan::Drop, C};
+                continue;
+            }
+            if (A.hasByValAttr() && !WritesMemory && onlyLoadedFrom(A)) {
+                MaybeAlign ParamAlign = A.getParamAlign();
+                Align Needed =
+                    ParamAlign ? *ParamAlign : DL.getABITypeAlign(A.getParamByValType());
+                if (all_of(Calls, [&](CallBase *CB) {
+                        Value *Ptr = CB->getArgOperand(A.getArgNo());
+                        return Ptr->getPointerAlignment(DL) >= Needed;
+                    })) {
+                    Plan.ByvalToPointer = true;
+                    CopiedBytes += Bytes;
+                    ++ByPointer;
+                }
+            }
+        }
+
+        // Number the kept arguments, pairing narrow integers while the
+        // integer arguments do not fit in registers
+        for (Argument &A : F.args())
+            if (Plans[A.getArgNo()].Action == ArgPlan::Keep)
+                IntegersAfter += Plans[A.getArgNo()].ByvalToPointer
+                                     ? 1
+                                     : integerRegisters(A, A.getType());
+        SmallVector<unsigned, 8> Packable;
+        for (Argument &A : F.args())
+            if (Plans[A.getArgNo()].Action == ArgPlan::Keep && !isSpecial(A) &&
+                !Plans[A.getArgNo()].ByvalToPointer && isPackable(A))
+                Packable.push_back(A.getArgNo());
+        for (unsigned I = 0; I + 1 < Packable.size() && IntegersAfter > IntegerRegisters;
+             I += 2, --IntegersAfter) {
+            Plans[Packable[I]].Action = ArgPlan::Pack;
+            Plans[Packable[I + 1]].Action = ArgPlan::Pack;
+            Plans[Packable[I + 1]].Shift = 32;
+            Plans[Packable[I + 1]].Partner = Packable[I];
+        }
+        unsigned NewIndex = 0;
+        for (auto [ArgNo, Plan] : enumerate(Plans)) {
+            if (Plan.Action == ArgPlan::Keep || (Plan.Action == ArgPlan::Pack && !Plan.Shift))
+                Plan.NewIndex = NewIndex++;
+            else if (Plan.Action == ArgPlan::Pack)
+                Plan.NewIndex = Plans[Plan.Partner].NewIndex;
+        }
+        if (all_of(Plans, [](const ArgPlan &P) {
+                return P.Action == ArgPlan::Keep && !P.ByvalToPointer;
+            }))
+            continue;
+
+        // Each argument on the stack is stored by the caller and loaded by
+        // the callee, and so is each 8 bytes of a byval copy
+        int Saved = 2 * (stackArguments(IntegersBefore) - stackArguments(IntegersAfter)) +
+                    2 * int(divideCeil(CopiedBytes, 8));
+        unsigned Dropped =
+            count_if(Plans, [](const ArgPlan &P) { return P.Action == ArgPlan::Drop; });
+        Function *NF = rewriteSignature(F, Plans, Calls);
+        errs() << "argument-passing: " << NF->getName() << ": " << Plans.size() << " -> "
+               << NF->arg_size() << " arguments (" << Dropped << " dropped, " << ByPointer
+               << " byval by pointer), " << IntegersBefore << " -> " << IntegersAfter
+               << " integer registers, ~" << Saved << " stores/loads saved per call\n";
+        Changed = true;
+    }
+    return Changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+}
+
+void llvm::registerArgumentPassing(PassBuilder &PB) {
+    PB.registerPipelineParsingCallback(
+        [](StringRef Name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>) {
+            if (Name == "argument-passing") {
+                MPM.addPass(ArgumentPassing());
+                return true;
+            }
+            return false;
+        });
+    // Only on request, since it changes the ABI of internal functions, and
+    // never at O0, where they must stay as written for the debugger
+    PB.registerOptimizerLastEPCallback([](ModulePassManager &MPM, OptimizationLevel Level) {
+        if (RewriteArguments && Level != OptimizationLevel::O0)
+            MPM.addPass(ArgumentPassing());
+    });
+}
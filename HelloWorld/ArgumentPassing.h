@@ -0,0 +1,35 @@
+//===- ArgumentPassing.h - Cheaper argument passing for internal functions ===//
+//
+// On SysV x86-64, the first 6 integer and pointer arguments are passed in
+// registers and the rest on the stack, and a byval aggregate is copied to
+// the stack on every call. For internal functions whose calls are all
+// known, this pass:
+//
+//  - passes read-only byval aggregates by pointer instead of by copy;
+//  - drops arguments that are unused, or the same constant at every call;
+//  - packs pairs of 32-bit or narrower integer arguments into one 64-bit
+//    argument while more than 6 integer arguments are left.
+//
+// It reports the stores and loads each call is estimated to save.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_ARGUMENTPASSING_H
+#define TUTORIAL_LLVM_PASS_ARGUMENTPASSING_H
+
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+
+namespace llvm {
+
+struct ArgumentPassing : PassInfoMixin<ArgumentPassing> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+// Registers the "argument-passing" pass, and adds it at the end of the
+// optimization pipeline, when only the calls that were not inlined remain
+void registerArgumentPassing(PassBuilder &PB);
+
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_ARGUMENTPASSING_H
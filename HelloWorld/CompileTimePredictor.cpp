@@ -0,0 +1,218 @@
+#include "CompileTimePredictor.h"
+#include "CompileTimeProfiler.h"
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cmath>
+#include <mutex>
+
+using namespace llvm;
+
+static cl::opt<std::string> SamplesFile(
+    "compile-time-samples", cl::init(""),
+    cl::desc("Predict optimization time from the samples in this file, and append "
+             "the samples of this compilation to it"));
+
+namespace {
+
+// The model and what this compilation saw of each function
+struct PredictorState {
+    std::mutex Lock;
+    CompileTimeModel Model;
+    size_t NumSamples = 0;
+    std::map<std::string, FunctionFeatures> Seen;
+};
+
+// Never destroyed, since the profiler still needs it when it reports at exit
+PredictorState &getState() {
+    static auto *State = new PredictorState;
+    return *State;
+}
+
+// Samples are lines of "time_ms,<features>,function"; the function name is
+// last since it is the only field that may contain a comma
+std::vector<CompileTimeSample> readSamples(StringRef Path) {
+    std::vector<CompileTimeSample> Samples;
+    auto Buffer = MemoryBuffer::getFile(Path);
+    if (!Buffer)
+        return Samples;
+    SmallVector<StringRef, 16> Lines, Fields;
+    (*Buffer)->getBuffer().split(Lines, '\n', -1, /*KeepEmpty=*/false);
+    for (StringRef Line : Lines) {
+        Fields.clear();
+        Line.split(Fields, ',', FunctionFeatures::NumFeatures + 1);
+        if (Fields.size() != FunctionFeatures::NumFeatures + 2)
+            continue;
+        CompileTimeSample S;
+        // The header does not parse as numbers and is skipped like any bad line
+        bool Valid = to_float(Fields[0], S.Millis);
+        for (unsigned I = 0; I < FunctionFeatures::NumFeatures; ++I)
+            Valid = Valid && to_float(Fields[I + 1], S.Features.Values[I]);
+        if (Valid)
+            Samples.push_back(S);
+    }
+    return Samples;
+}
+
+void appendSamples(StringRef Path, const CompileTimeProfiler &Profiler) {
+    PredictorState &State = getState();
+    std::map<std::string, CompileTimeProfiler::Clock::duration> Times = Profiler.timePerUnit();
+    // Built in one piece so that parallel compilations appending to the same
+    // file do not interleave lines
+    std::string Text;
+    raw_string_ostream OS(Text);
+    if (!sys::fs::exists(Path))
+        OS << "time_ms,instructions,blocks,loops,max_loop_depth,calls,args,function\n";
+    std::lock_guard<std::mutex> Guard(State.Lock);
+    for (const auto &[Name, Features] : State.Seen) {
+        auto It = Times.find(Name);
+        if (It == Times.end())
+            continue;
+        OS << format("%.4f", std::chrono::duration<double, std::milli>(It->second).count());
+        for (double V : Features.Values)
+            OS << format(",%.0f", V);
+        OS << "," << Name << "\n";
+    }
+    OS.flush();
+    std::error_code EC;
+    raw_fd_ostream Out(Path, EC, sys::fs::OF_Append);
+    if (!EC)
+        Out << Text;
+}
+
+} // namespace
+
+FunctionFeatures FunctionFeatures::extract(const Function &F, const LoopInfo &LI) {
+    FunctionFeatures Features;
+    auto &V = Features.Values;
+    V[Instructions] = F.getInstructionCount();
+    V[Blocks] = F.size();
+    V[Args] = F.arg_size();
+    for (const Loop *L : LI.getLoopsInPreorder()) {
+        V[Loops] += 1;
+        V[MaxLoopDepth] = std::max<double>(V[MaxLoopDepth], L->getLoopDepth());
+    }
+    for (const Instruction &I : instructions(F))
+        if (isa<CallBase>(I) && !isa<DbgInfoIntrinsic>(I))
+            V[Calls] += 1;
+    return Features;
+}
+
+bool CompileTimeModel::fit(ArrayRef<CompileTimeSample> Samples) {
+    constexpr unsigned N = FunctionFeatures::NumFeatures + 1;
+    Trained = false;
+    if (Samples.size() < N)
+        return false;
+
+    // Normal equations (X^T X) W = X^T y, with a column of ones for the intercept
+    double A[N][N + 1] = {};
+    for (const CompileTimeSample &S : Samples) {
+        double X[N] = {1.0};
+        for (unsigned I = 1; I < N; ++I)
+            X[I] = S.Features.Values[I - 1];
+        for (unsigned I = 0; I < N; ++I) {
+            for (unsigned J = 0; J < N; ++J)
+                A[I][J] += X[I] * X[J];
+            A[I][N] += X[I] * S.Millis;
+        }
+    }
+    // A little ridge keeps features that never vary (e.g. no loops in any
+    // sample) from making the system singular
+    for (unsigned I = 1; I < N; ++I)
+        A[I][I] += 1e-6 * (1.0 + A[I][I]);
+
+    // Gaussian elimination with partial pivoting
+    for (unsigned Col = 0; Col < N; ++Col) {
+        unsigned Pivot = Col;
+        for (unsigned Row = Col + 1; Row < N; ++Row)
+            if (std::fabs(A[Row][Col]) > std::fabs(A[Pivot][Col]))
+                Pivot = Row;
+        if (std::fabs(A[Pivot][Col]) < 1e-12)
+            return false;
+        std::swap(A[Col], A[Pivot]);
+        for (unsigned Row = 0; Row < N; ++Row) {
+            if (Row == Col)
+                continue;
+            double Factor = A[Row][Col] / A[Col][Col];
+            for (unsigned K = Col; K <= N; ++K)
+                A[Row][K] -= Factor * A[Col][K];
+        }
+    }
+    for (unsigned I = 0; I < N; ++I)
+        Weights[I] = A[I][N] / A[I][I];
+    Trained = true;
+    return true;
+}
+
+double CompileTimeModel::predict(const FunctionFeatures &Features) const {
+    double Millis = Weights[0];
+    for (unsigned I = 0; I < FunctionFeatures::NumFeatures; ++I)
+        Millis += Weights[I + 1] * Features.Values[I];
+    return std::max(Millis, 0.0);
+}
+
+PreservedAnalyses CompileTimePrediction::run(Module &M, ModuleAnalysisManager &MAM) {
+    auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    PredictorState &State = getState();
+    std::lock_guard<std::mutex> Guard(State.Lock);
+    double Millis = 0;
+    unsigned Functions = 0;
+    for (Function &F : M) {
+        if (F.isDeclaration())
+            continue;
+        FunctionFeatures Features = FunctionFeatures::extract(F, FAM.getResult<LoopAnalysis>(F));
+        State.Seen[F.getName().str()] = Features;
+        if (State.Model.isTrained())
+            Millis += State.Model.predict(Features);
+        ++Functions;
+    }
+
+    // One line per module, for the build scheduler to parse
+    errs() << "compile-time prediction: " << M.getModuleIdentifier() << " ";
+    if (State.Model.isTrained())
+        errs() << format("%.3f", Millis) << " ms";
+    else
+        errs() << "unknown";
+    errs() << " (" << Functions << " functions, " << State.NumSamples << " samples)\n";
+    return PreservedAnalyses::all();
+}
+
+void llvm::registerCompileTimePredictor(PassBuilder &PB) {
+    PB.registerPipelineParsingCallback(
+        [](StringRef Name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>) {
+            if (Name == "compile-time-prediction") {
+                MPM.addPass(CompileTimePrediction());
+                return true;
+            }
+            return false;
+        });
+
+    // Without samples there is no model to train nor file to extend
+    if (SamplesFile.empty())
+        return;
+    // Train once, however many pass builders the process creates
+    static bool Trained = [] {
+        PredictorState &State = getState();
+        std::lock_guard<std::mutex> Guard(State.Lock);
+        std::vector<CompileTimeSample> Samples = readSamples(SamplesFile);
+        State.NumSamples = Samples.size();
+        State.Model.fit(Samples);
+        // Times are only known when the compilation ends
+        CompileTimeProfiler::get().addExitHook(
+            [](const CompileTimeProfiler &Profiler) { appendSamples(SamplesFile, Profiler); });
+        return true;
+    }();
+    (void)Trained;
+
+    PB.registerPipelineStartEPCallback([](ModulePassManager &MPM, OptimizationLevel Level) {
+        MPM.addPass(CompileTimePrediction());
+    });
+}
@@ -0,0 +1,64 @@
+//===- CompileTimePredictor.h - Predict optimization time from IR ---------===//
+//
+// Cheap per-function IR features, and a linear model from those features to
+// the time the optimization pipeline spends on the function. The model is
+// fitted by least squares on samples the compile-time profiler collected in
+// earlier compilations, so it predicts for the build host and pipeline it was
+// trained on. At the start of the pipeline, the prediction for the whole
+// translation unit is printed, so that a build scheduler can start the
+// slowest units first.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_COMPILETIMEPREDICTOR_H
+#define TUTORIAL_LLVM_PASS_COMPILETIMEPREDICTOR_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+
+#include <array>
+
+namespace llvm {
+
+// What a function looks like before it is optimized
+struct FunctionFeatures {
+    enum { Instructions, Blocks, Loops, MaxLoopDepth, Calls, Args, NumFeatures };
+    std::array<double, NumFeatures> Values{};
+
+    static FunctionFeatures extract(const Function &F, const LoopInfo &LI);
+};
+
+// One function of an earlier compilation and the time it took
+struct CompileTimeSample {
+    FunctionFeatures Features;
+    double Millis;
+};
+
+// Time in milliseconds = Weights . (1, features)
+class CompileTimeModel {
+public:
+    // Least-squares fit; returns false if there are too few samples
+    bool fit(ArrayRef<CompileTimeSample> Samples);
+    double predict(const FunctionFeatures &Features) const;
+    bool isTrained() const { return Trained; }
+
+private:
+    std::array<double, FunctionFeatures::NumFeatures + 1> Weights{};
+    bool Trained = false;
+};
+
+// Predicts and prints the optimization time of the module
+struct CompileTimePrediction : PassInfoMixin<CompileTimePrediction> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+// Registers the prediction and the collection of new samples when a samples
+// file is given on the command line
+void registerCompileTimePredictor(PassBuilder &PB);
+
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_COMPILETIMEPREDICTOR_H
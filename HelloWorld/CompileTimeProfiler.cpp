@@ -0,0 +1,389 @@
+#include "CompileTimeProfiler.h"
+
+#include "llvm/Analysis/LazyCallGraph.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Process.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+static cl::opt<unsigned> ProfileTopN(
+    "compile-profile-top", cl::init(10),
+    cl::desc("Number of (function, pass) pairs in the compile-time report (0 disables it)"));
+
+static cl::opt<std::string> ProfileTraceFile(
+    "compile-profile-trace", cl::init(""),
+    cl::desc("Write every pass run as -ftime-trace compatible JSON to this file"));
+
+static cl::opt<bool> TrackInvalidationOpt(
+    "track-analysis-invalidation", cl::init(false),
+    cl::desc("Report the analyses each pass invalidates and the time spent recomputing them"));
+
+static cl::opt<bool> TrackGrowthOpt(
+    "track-ir-growth", cl::init(false),
+    cl::desc("Report instruction, block and heap growth caused by each pass"));
+
+thread_local std::vector<CompileTimeProfiler::Frame> CompileTimeProfiler::Stack;
+thread_local std::pair<std::string, std::string> CompileTimeProfiler::LastPass;
+
+namespace {
+
+// Pass managers and adaptors only contain the passes that are recorded
+bool isWrapperPass(StringRef Pass) {
+    return isSpecialPass(Pass, {"PassManager", "PassAdaptor", "AnalysisManagerProxy",
+                                "DevirtSCCRepeatedPass", "ModuleInlinerWrapperPass"});
+}
+
+// The function an IR unit belongs to, or a name for units above functions
+std::string unitName(Any IR) {
+    if (const auto *F = any_cast<const Function *>(&IR))
+        return (*F)->getName().str();
+    if (const auto *L = any_cast<const Loop *>(&IR))
+        return (*L)->getHeader()->getParent()->getName().str();
+    if (const auto *C = any_cast<const LazyCallGraph::SCC *>(&IR))
+        return (*C)->getName();
+    if (const auto *M = any_cast<const Module *>(&IR))
+        return "[module " + (*M)->getName().str() + "]";
+    return "[unknown]";
+}
+
+// Instructions and blocks of the functions an IR unit covers. A loop pass
+// is measured on its whole function, since it may change code outside the loop.
+std::pair<size_t, size_t> unitSize(Any IR) {
+    auto FunctionSize = [](const Function &F) {
+        return std::make_pair(size_t(F.getInstructionCount()), F.size());
+    };
+    auto Sum = [&](auto &&Functions) {
+        std::pair<size_t, size_t> Size;
+        for (const Function &F : Functions) {
+            auto [Insts, Blocks] = FunctionSize(F);
+            Size.first += Insts;
+            Size.second += Blocks;
+        }
+        return Size;
+    };
+    if (const auto *F = any_cast<const Function *>(&IR))
+        return FunctionSize(**F);
+    if (const auto *L = any_cast<const Loop *>(&IR))
+        return FunctionSize(*(*L)->getHeader()->getParent());
+    if (const auto *C = any_cast<const LazyCallGraph::SCC *>(&IR))
+        return Sum(map_range(**C, [](const LazyCallGraph::Node &N) -> const Function & {
+            return N.getFunction();
+        }));
+    if (const auto *M = any_cast<const Module *>(&IR))
+        return Sum(**M);
+    return {0, 0};
+}
+
+// Heap in use, from mallinfo2 where the C library has it
+size_t heapInUse() { return sys::Process::GetMallocUsage(); }
+
+double toMillis(CompileTimeProfiler::Clock::duration D) {
+    return std::chrono::duration<double, std::milli>(D).count();
+}
+
+int64_t toMicros(CompileTimeProfiler::Clock::duration D) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(D).count();
+}
+
+} // namespace
+
+CompileTimeProfiler &CompileTimeProfiler::get() {
+    static CompileTimeProfiler Profiler;
+    return Profiler;
+}
+
+void CompileTimeProfiler::registerCallbacks(PassInstrumentationCallbacks &PIC) {
+    PIC.registerBeforeNonSkippedPassCallback(
+        [this](StringRef Pass, Any IR) { begin(Pass, IR, /*IsAnalysis=*/false); });
+    PIC.registerAfterPassCallback(
+        [this](StringRef Pass, Any IR, const PreservedAnalyses &) { end(Pass, false, &IR); });
+    // The unit is gone, e.g. a deleted function, but the run still ended
+    PIC.registerAfterPassInvalidatedCallback(
+        [this](StringRef Pass, const PreservedAnalyses &) { end(Pass, false, nullptr); });
+    PIC.registerBeforeAnalysisCallback(
+        [this](StringRef Pass, Any IR) { begin(Pass, IR, /*IsAnalysis=*/true); });
+    PIC.registerAfterAnalysisCallback(
+        [this](StringRef Pass, Any IR) { end(Pass, true, &IR); });
+    if (TrackInvalidationOpt) {
+        TrackInvalidation = true;
+        PIC.registerAnalysisInvalidatedCallback(
+            [this](StringRef Analysis, Any IR) { invalidated(Analysis, IR); });
+    }
+    TrackGrowth = TrackGrowthOpt;
+}
+
+void CompileTimeProfiler::begin(StringRef Pass, Any IR, bool IsAnalysis) {
+    if (isWrapperPass(Pass))
+        return;
+    if (!IsAnalysis)
+        LastPass = {};
+    Frame F{Pass, unitName(IR), IsAnalysis, Clock::now()};
+    if (TrackGrowth) {
+        std::tie(F.Instructions, F.Blocks) = unitSize(IR);
+        F.Heap = F.HeapPeak = heapInUse();
+        // Every event inside a run is a chance to see its peak
+        for (Frame &Outer : Stack)
+            Outer.HeapPeak = std::max(Outer.HeapPeak, F.Heap);
+    }
+    Stack.push_back(std::move(F));
+}
+
+void CompileTimeProfiler::end(StringRef Pass, bool IsAnalysis, const Any *IR) {
+    if (isWrapperPass(Pass) || Stack.empty())
+        return;
+    Frame F = std::move(Stack.back());
+    Stack.pop_back();
+    assert(F.Pass == Pass && F.IsAnalysis == IsAnalysis && "unbalanced pass instrumentation");
+    Clock::duration Elapsed = Clock::now() - F.Start;
+    // Nested runs are charged to themselves only
+    if (!Stack.empty())
+        Stack.back().Children += Elapsed;
+    size_t Heap = 0;
+    if (TrackGrowth) {
+        Heap = heapInUse();
+        F.HeapPeak = std::max(F.HeapPeak, Heap);
+        for (Frame &Outer : Stack)
+            Outer.HeapPeak = std::max(Outer.HeapPeak, F.HeapPeak);
+    }
+
+    std::lock_guard<std::mutex> Guard(Lock);
+    Entry &E = Entries[{F.Unit, F.Pass.str()}];
+    if (!E.Runs) {
+        E.Unit = F.Unit;
+        E.Pass = F.Pass.str();
+        E.IsAnalysis = F.IsAnalysis;
+    }
+    ++E.Runs;
+    E.Self += Elapsed - F.Children;
+    if (TrackInvalidation) {
+        if (!F.IsAnalysis) {
+            LastPass = {F.Pass.str(), F.Unit};
+        } else {
+            // A recomputation is charged to the pass that made it necessary
+            auto It = Stale.find({F.Unit, E.Pass});
+            if (It != Stale.end()) {
+                InvalidationEntry &IE = Invalidations[{It->second, F.Unit}];
+                ++IE.Recomputed;
+                IE.RecomputeTime += Elapsed - F.Children;
+                Stale.erase(It);
+            }
+        }
+    }
+    if (TrackGrowth && !F.IsAnalysis) {
+        // A unit that is gone, e.g. a deleted function, has shrunk to nothing
+        auto [Insts, Blocks] = IR ? unitSize(*IR) : std::make_pair(size_t(0), size_t(0));
+        GrowthEntry &G = Growth[{E.Pass, F.Unit}];
+        G.Pass = E.Pass;
+        G.Unit = F.Unit;
+        ++G.Runs;
+        G.Instructions += int64_t(Insts) - int64_t(F.Instructions);
+        G.Blocks += int64_t(Blocks) - int64_t(F.Blocks);
+        G.Heap += int64_t(Heap) - int64_t(F.Heap);
+        G.HeapPeak = std::max(G.HeapPeak, int64_t(F.HeapPeak) - int64_t(F.Heap));
+    }
+    if (!ProfileTraceFile.empty())
+        Trace.push_back({F.Pass.str(), std::move(F.Unit), F.Start - Epoch, Elapsed});
+}
+
+void CompileTimeProfiler::invalidated(StringRef Analysis, Any IR) {
+    std::string Unit = unitName(IR);
+    // Depending on the LLVM version, pass managers invalidate what a pass did
+    // not preserve right before or right after its AfterPass callbacks
+    std::string Pass = "[pass manager]";
+    if (!Stack.empty() && !Stack.back().IsAnalysis && Stack.back().Unit == Unit)
+        Pass = Stack.back().Pass.str();
+    else if (!LastPass.first.empty() && LastPass.second == Unit)
+        Pass = LastPass.first;
+
+    std::lock_guard<std::mutex> Guard(Lock);
+    InvalidationEntry &IE = Invalidations[{Pass, Unit}];
+    if (!IE.Invalidated && !IE.Recomputed) {
+        IE.Pass = Pass;
+        IE.Unit = Unit;
+    }
+    ++IE.Invalidated;
+    Stale[{Unit, Analysis.str()}] = Pass;
+}
+
+std::vector<CompileTimeProfiler::Entry> CompileTimeProfiler::sortedEntries() const {
+    std::lock_guard<std::mutex> Guard(Lock);
+    std::vector<Entry> Sorted;
+    for (const auto &KV : Entries)
+        Sorted.push_back(KV.second);
+    std::stable_sort(Sorted.begin(), Sorted.end(),
+                     [](const Entry &A, const Entry &B) { return A.Self > B.Self; });
+    return Sorted;
+}
+
+std::map<std::string, CompileTimeProfiler::Clock::duration>
+CompileTimeProfiler::timePerUnit() const {
+    std::lock_guard<std::mutex> Guard(Lock);
+    std::map<std::string, Clock::duration> PerUnit;
+    for (const auto &KV : Entries)
+        PerUnit[KV.second.Unit] += KV.second.Self;
+    return PerUnit;
+}
+
+void CompileTimeProfiler::addExitHook(std::function<void(const CompileTimeProfiler &)> Hook) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    ExitHooks.push_back(std::move(Hook));
+}
+
+void CompileTimeProfiler::printTopN(raw_ostream &OS, unsigned N) const {
+    std::vector<Entry> Sorted = sortedEntries();
+    Clock::duration Total{};
+    std::map<std::string, Clock::duration> PerFunction;
+    for (const Entry &E : Sorted) {
+        Total += E.Self;
+        PerFunction[E.Unit] += E.Self;
+    }
+
+    OS << "===-------------------------------------------------------------------------===\n"
+       << "  Compile-time profile: top " << std::min<size_t>(N, Sorted.size())
+       << " (function, pass) pairs of " << format("%.3f", toMillis(Total)) << " ms\n"
+       << "===-------------------------------------------------------------------------===\n"
+       << "   Time (ms)      %   Runs  Pass  @  Function\n";
+    for (const Entry &E : ArrayRef<Entry>(Sorted).take_front(N))
+        OS << format("%12.3f %6.2f %6u  ", toMillis(E.Self),
+                     Total.count() ? 100.0 * E.Self.count() / Total.count() : 0.0, E.Runs)
+           << E.Pass << (E.IsAnalysis ? " (analysis)" : "") << "  @  " << E.Unit << "\n";
+
+    // The same time summed per function shows the pathological ones
+    std::vector<std::pair<std::string, Clock::duration>> Functions(PerFunction.begin(),
+                                                                   PerFunction.end());
+    std::stable_sort(Functions.begin(), Functions.end(),
+                     [](const auto &A, const auto &B) { return A.second > B.second; });
+    OS << "\n   Time (ms)      %  Function\n";
+    for (const auto &[Name, Time] : ArrayRef(Functions).take_front(N))
+        OS << format("%12.3f %6.2f  ", toMillis(Time),
+                     Total.count() ? 100.0 * Time.count() / Total.count() : 0.0)
+           << Name << "\n";
+}
+
+void CompileTimeProfiler::printInvalidations(raw_ostream &OS, unsigned N) const {
+    std::lock_guard<std::mutex> Guard(Lock);
+    std::vector<InvalidationEntry> Sorted;
+    std::map<std::string, InvalidationEntry> PerPass;
+    for (const auto &KV : Invalidations) {
+        const InvalidationEntry &IE = KV.second;
+        Sorted.push_back(IE);
+        InvalidationEntry &P = PerPass[IE.Pass];
+        P.Pass = IE.Pass;
+        P.Invalidated += IE.Invalidated;
+        P.Recomputed += IE.Recomputed;
+        P.RecomputeTime += IE.RecomputeTime;
+    }
+    auto ByCost = [](const InvalidationEntry &A, const InvalidationEntry &B) {
+        return A.RecomputeTime != B.RecomputeTime ? A.RecomputeTime > B.RecomputeTime
+                                                  : A.Invalidated > B.Invalidated;
+    };
+    std::stable_sort(Sorted.begin(), Sorted.end(), ByCost);
+    std::vector<InvalidationEntry> Passes;
+    for (const auto &KV : PerPass)
+        Passes.push_back(KV.second);
+    std::stable_sort(Passes.begin(), Passes.end(), ByCost);
+
+    OS << "===-------------------------------------------------------------------------===\n"
+       << "  Analysis invalidation: recomputation caused by each pass\n"
+       << "===-------------------------------------------------------------------------===\n"
+       << " Invalidated  Recomputed  Recompute (ms)  Pass\n";
+    for (const InvalidationEntry &P : ArrayRef(Passes).take_front(N))
+        OS << format("%12u %11u %15.3f  ", P.Invalidated, P.Recomputed, toMillis(P.RecomputeTime))
+           << P.Pass << "\n";
+    OS << "\n Invalidated  Recomputed  Recompute (ms)  Pass  @  Function\n";
+    for (const InvalidationEntry &IE : ArrayRef(Sorted).take_front(N))
+        OS << format("%12u %11u %15.3f  ", IE.Invalidated, IE.Recomputed, toMillis(IE.RecomputeTime))
+           << IE.Pass << "  @  " << IE.Unit << "\n";
+}
+
+void CompileTimeProfiler::printGrowth(raw_ostream &OS, unsigned N) const {
+    std::lock_guard<std::mutex> Guard(Lock);
+    std::vector<GrowthEntry> Pairs;
+    std::map<std::string, GrowthEntry> PerPass;
+    for (const auto &KV : Growth) {
+        const GrowthEntry &G = KV.second;
+        Pairs.push_back(G);
+        GrowthEntry &P = PerPass[G.Pass];
+        P.Pass = G.Pass;
+        P.Runs += G.Runs;
+        P.Instructions += G.Instructions;
+        P.Blocks += G.Blocks;
+        P.Heap += G.Heap;
+        P.HeapPeak = std::max(P.HeapPeak, G.HeapPeak);
+    }
+    std::vector<GrowthEntry> Passes;
+    for (const auto &KV : PerPass)
+        Passes.push_back(KV.second);
+    // Memory spikes by pass, code bloat by (pass, function)
+    std::stable_sort(Passes.begin(), Passes.end(), [](const GrowthEntry &A, const GrowthEntry &B) {
+        return A.HeapPeak > B.HeapPeak;
+    });
+    std::stable_sort(Pairs.begin(), Pairs.end(), [](const GrowthEntry &A, const GrowthEntry &B) {
+        return A.Instructions > B.Instructions;
+    });
+
+    auto KiB = [](int64_t Bytes) { return Bytes / 1024.0; };
+    OS << "===-------------------------------------------------------------------------===\n"
+       << "  IR and heap growth caused by each pass\n"
+       << "===-------------------------------------------------------------------------===\n"
+       << "   Runs   Insts  Blocks  Heap (KiB)  Peak (KiB)  Pass\n";
+    for (const GrowthEntry &P : ArrayRef(Passes).take_front(N))
+        OS << format("%7u %+7lld %+7lld %+11.1f %11.1f  ", P.Runs, (long long)P.Instructions,
+                     (long long)P.Blocks, KiB(P.Heap), KiB(P.HeapPeak))
+           << P.Pass << "\n";
+    OS << "\n   Runs   Insts  Blocks  Heap (KiB)  Peak (KiB)  Pass  @  Function\n";
+    for (const GrowthEntry &G : ArrayRef(Pairs).take_front(N))
+        OS << format("%7u %+7lld %+7lld %+11.1f %11.1f  ", G.Runs, (long long)G.Instructions,
+                     (long long)G.Blocks, KiB(G.Heap), KiB(G.HeapPeak))
+           << G.Pass << "  @  " << G.Unit << "\n";
+}
+
+void CompileTimeProfiler::writeTimeTrace(raw_ostream &OS) const {
+    std::lock_guard<std::mutex> Guard(Lock);
+    json::OStream J(OS);
+    J.object([&] {
+        J.attributeArray("traceEvents", [&] {
+            for (const TraceEvent &E : Trace) {
+                J.object([&] {
+                    J.attribute("pid", 1);
+                    J.attribute("tid", 0);
+                    J.attribute("ph", "X");
+                    J.attribute("ts", toMicros(E.Start));
+                    J.attribute("dur", toMicros(E.Duration));
+                    J.attribute("name", E.Name);
+                    J.attributeObject("args", [&] { J.attribute("detail", E.Unit); });
+                });
+            }
+        });
+        J.attribute("beginningOfTime",
+                    toMicros(std::chrono::system_clock::now().time_since_epoch() -
+                             (Clock::now() - Epoch)));
+    });
+}
+
+// Compilation is over when the process exits. LLVM's own streams may be gone
+// by then, so the reports use streams of their own.
+CompileTimeProfiler::~CompileTimeProfiler() {
+    for (auto &Hook : ExitHooks)
+        Hook(*this);
+    raw_fd_ostream Err(2, /*shouldClose=*/false);
+    if (ProfileTopN)
+        printTopN(Err, ProfileTopN);
+    if (TrackInvalidation)
+        printInvalidations(Err, std::max(ProfileTopN.getValue(), 10u));
+    if (TrackGrowth)
+        printGrowth(Err, std::max(ProfileTopN.getValue(), 10u));
+    if (!ProfileTraceFile.empty()) {
+        std::error_code EC;
+        raw_fd_ostream Out(ProfileTraceFile, EC);
+        if (!EC)
+            writeTimeTrace(Out);
+    }
+}
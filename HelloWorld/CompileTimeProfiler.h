@@ -0,0 +1,136 @@
+//===- CompileTimeProfiler.h - Per-pass, per-function compile time --------===//
+//
+// Hooks into PassInstrumentationCallbacks and records the wall time of every
+// pass and analysis run on every IR unit. Time spent in a nested pass or
+// analysis is charged to it rather than to the pass that triggered it, and
+// pass managers and adaptors are not recorded themselves. When compilation
+// ends, the most expensive (function, pass) pairs are printed, and every run
+// can be written as a trace that chrome://tracing and Perfetto load like the
+// output of -ftime-trace.
+//
+// Optionally, the profiler also tracks analysis invalidation: which analyses
+// each pass invalidated on each function, and how long recomputing them took
+// when a later pass asked for them again. It can also attribute IR growth
+// (instructions and blocks) and heap growth to each pass on each function.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_COMPILETIMEPROFILER_H
+#define TUTORIAL_LLVM_PASS_COMPILETIMEPROFILER_H
+
+#include "llvm/ADT/Any.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace llvm {
+
+class CompileTimeProfiler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Time spent by one pass or analysis on one IR unit, over all its runs
+    struct Entry {
+        std::string Unit;
+        std::string Pass;
+        bool IsAnalysis = false;
+        unsigned Runs = 0;
+        Clock::duration Self{};
+    };
+
+    // Analyses a pass invalidated on an IR unit, and what recomputing them cost
+    struct InvalidationEntry {
+        std::string Pass;
+        std::string Unit;
+        unsigned Invalidated = 0;
+        unsigned Recomputed = 0;
+        Clock::duration RecomputeTime{};
+    };
+
+    // How a pass changed the size of an IR unit and of the heap, over all runs.
+    // HeapPeak is the highest heap growth seen at any point inside one run.
+    struct GrowthEntry {
+        std::string Pass;
+        std::string Unit;
+        unsigned Runs = 0;
+        int64_t Instructions = 0;
+        int64_t Blocks = 0;
+        int64_t Heap = 0;
+        int64_t HeapPeak = 0;
+    };
+
+    // The profiler of this process, which reports when it is destroyed
+    static CompileTimeProfiler &get();
+
+    void registerCallbacks(PassInstrumentationCallbacks &PIC);
+
+    // Entries sorted by decreasing self time
+    std::vector<Entry> sortedEntries() const;
+    // Self time of all passes and analyses, summed per IR unit
+    std::map<std::string, Clock::duration> timePerUnit() const;
+    // Runs Hook when compilation ends, before the reports are printed
+    void addExitHook(std::function<void(const CompileTimeProfiler &)> Hook);
+    void printTopN(raw_ostream &OS, unsigned N) const;
+    void printInvalidations(raw_ostream &OS, unsigned N) const;
+    void printGrowth(raw_ostream &OS, unsigned N) const;
+    void writeTimeTrace(raw_ostream &OS) const;
+
+    ~CompileTimeProfiler();
+
+private:
+    // A pass or analysis that is running
+    struct Frame {
+        StringRef Pass;
+        std::string Unit;
+        bool IsAnalysis;
+        Clock::time_point Start;
+        Clock::duration Children{};
+        // Sizes at the start, when growth is tracked
+        size_t Instructions = 0;
+        size_t Blocks = 0;
+        size_t Heap = 0;
+        size_t HeapPeak = 0;
+    };
+
+    // One run, as a complete event of the trace
+    struct TraceEvent {
+        std::string Name;
+        std::string Unit;
+        Clock::duration Start;
+        Clock::duration Duration;
+    };
+
+    void begin(StringRef Pass, Any IR, bool IsAnalysis);
+    void end(StringRef Pass, bool IsAnalysis, const Any *IR);
+    void invalidated(StringRef Analysis, Any IR);
+
+    // Runs in progress on the calling thread, innermost last
+    static thread_local std::vector<Frame> Stack;
+    // The pass that ended last on the calling thread, if no other started
+    // since, as (pass, unit). Pass managers invalidate after it ends.
+    static thread_local std::pair<std::string, std::string> LastPass;
+
+    Clock::time_point Epoch = Clock::now();
+    std::vector<std::function<void(const CompileTimeProfiler &)>> ExitHooks;
+    mutable std::mutex Lock;
+    std::map<std::pair<std::string, std::string>, Entry> Entries;
+    std::vector<TraceEvent> Trace;
+    bool TrackInvalidation = false;
+    std::map<std::pair<std::string, std::string>, InvalidationEntry> Invalidations;
+    // Invalidated analyses not computed again yet, by (unit, analysis), and
+    // the pass that invalidated them
+    std::map<std::pair<std::string, std::string>, std::string> Stale;
+    bool TrackGrowth = false;
+    std::map<std::pair<std::string, std::string>, GrowthEntry> Growth;
+};
+
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_COMPILETIMEPROFILER_H
@@ -0,0 +1,61 @@
+#include "CycleEstimateReport.h"
+#include "CycleEstimate.h"
+
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+static cl::opt<bool> CycleEstimateLatency(
+    "cycle-estimate-latency", cl::init(false),
+    cl::desc("Estimate cycles from instruction latency instead of reciprocal throughput"));
+
+static cl::opt<unsigned> CycleEstimateTopN(
+    "cycle-estimate-top", cl::init(20),
+    cl::desc("Number of functions in the cycle estimate report"));
+
+PreservedAnalyses CycleEstimateReport::run(Module &M, ModuleAnalysisManager &MAM) {
+    auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    std::vector<std::pair<double, const Function *>> Ranked;
+    double Total = 0;
+    for (Function &F : M) {
+        if (F.isDeclaration())
+            continue;
+        double Cycles = FAM.getResult<CycleEstimateAnalysis>(F).CyclesPerCall;
+        Ranked.push_back({Cycles, &F});
+        Total += Cycles;
+    }
+    std::stable_sort(Ranked.begin(), Ranked.end(),
+                     [](const auto &A, const auto &B) { return A.first > B.first; });
+
+    errs() << "===-------------------------------------------------------------------------===\n"
+           << "  Estimated cycles per call in " << M.getModuleIdentifier() << " ("
+           << (CycleEstimateLatency ? "latency" : "throughput") << ", callees excluded)\n"
+           << "===-------------------------------------------------------------------------===\n"
+           << "  Cycles/call      %  Function\n";
+    for (const auto &[Cycles, F] : ArrayRef(Ranked).take_front(CycleEstimateTopN))
+        errs() << format("%13.1f %6.2f  ", Cycles, Total > 0 ? 100.0 * Cycles / Total : 0.0)
+               << F->getName() << "\n";
+    return PreservedAnalyses::all();
+}
+
+void llvm::registerCycleEstimateReport(PassBuilder &PB) {
+    PB.registerAnalysisRegistrationCallback([](FunctionAnalysisManager &FAM) {
+        FAM.registerPass([] {
+            return CycleEstimateAnalysis(CycleEstimateLatency ? TargetTransformInfo::TCK_Latency
+                                                              : TargetTransformInfo::TCK_RecipThroughput);
+        });
+    });
+    PB.registerPipelineParsingCallback(
+        [](StringRef Name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>) {
+            if (Name == "cycle-estimate") {
+                MPM.addPass(CycleEstimateReport());
+                return true;
+            }
+            return false;
+        });
+}
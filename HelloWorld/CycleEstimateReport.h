@@ -0,0 +1,25 @@
+//===- CycleEstimateReport.h - Rank functions by estimated cycles ---------===//
+//
+// Prints the functions of a module ranked by the CycleEstimate of one call,
+// to point at the code likely to dominate runtime when no profile exists.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_CYCLEESTIMATEREPORT_H
+#define TUTORIAL_LLVM_PASS_CYCLEESTIMATEREPORT_H
+
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+
+namespace llvm {
+
+struct CycleEstimateReport : PassInfoMixin<CycleEstimateReport> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+// Registers CycleEstimateAnalysis and the "cycle-estimate" report pass
+void registerCycleEstimateReport(PassBuilder &PB);
+
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_CYCLEESTIMATEREPORT_H
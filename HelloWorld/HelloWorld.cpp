@@ -1,3 +1,8 @@
+#include "ArgumentPassing.h"
+#include "CompileTimePredictor.h"
+#include "CompileTimeProfiler.h"
+#include "CycleEstimateReport.h"
+
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/raw_ostream.h"
@@ -28,6 +33,15 @@ struct HelloWorld : PassInfoMixin<HelloWorld> {
 PassPluginLibraryInfo getHelloWorldPluginInfo() {
     return {LLVM_PLUGIN_API_VERSION, "HelloWorld", LLVM_VERSION_STRING,
             [](PassBuilder &PB) {
+                // Time every pass and analysis run on every function
+                if (PassInstrumentationCallbacks *PIC = PB.getPassInstrumentationCallbacks())
+                    CompileTimeProfiler::get().registerCallbacks(*PIC);
+                // Predict the time it takes, if asked to
+                registerCompileTimePredictor(PB);
+                // Rank functions by estimated cycles per call
+                registerCycleEstimateReport(PB);
+                // Pass the arguments of internal functions more cheaply
+                registerArgumentPassing(PB);
                 PB.registerPipelineParsingCallback(
                     [](StringRef Name, FunctionPassManager &FPM,
                        ArrayRef<PassBuilder::PipelineElement>) {
@@ -1,49 +1,365 @@
 #include "llvm/Pass.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+
+#include "CycleEstimate.h"
+#include "FunctionControls.h"
+#include "RewriteRules.h"
 
 using namespace llvm;
+using namespace llvm::rewrite;
+
+static cl::opt<ControlLevel> StrengthReductionLevel(
+    "strength-reduction", cl::init(ControlLevel::Default),
+    cl::desc("Strength reduction of functions without an sr: control"),
+    cl::values(clEnumValN(ControlLevel::Off, "off", "leave multiplications alone"),
+               clEnumValN(ControlLevel::Default, "default",
+                          "rewrites of at most 3 instructions"),
+               clEnumValN(ControlLevel::Aggressive, "aggressive",
+                          "also the longer shift-and-add sequences")));
 
 namespace {
 
 // Static variable to track modifications
 static bool Modified = false;
+// Cycles per call the rule-table rewrites are estimated to save
+static double EstimatedSavings = 0;
+
+// X << Amount, or X itself for a zero amount
+Value *shlBy(IRBuilder<> &Builder, Value *X, unsigned Amount) {
+    return Amount ? Builder.CreateShl(X, ConstantInt::get(X->getType(), Amount)) : X;
+}
+
+// Computes X * C with at most two shifts and an add or sub, or returns null
+// if C has no such decomposition
+Value *emitShiftAdd(IRBuilder<> &Builder, Value *X, const APInt &C) {
+    auto Shl = [&](unsigned Amount) { return shlBy(Builder, X, Amount); };
+    if (C.isPowerOf2())
+        return Shl(C.exactLogBase2());
+    // Two bits set: (x << a) + (x << b)
+    APInt Low = C & -C;
+    if ((C - Low).isPowerOf2())
+        return Builder.CreateAdd(Shl((C - Low).exactLogBase2()), Shl(Low.exactLogBase2()));
+    // All ones: (x << a) - x
+    if ((C + 1).isPowerOf2())
+        return Builder.CreateSub(Shl((C + 1).exactLogBase2()), X);
+    return nullptr;
+}
+
+// Replaces {umul,smul}.with.overflow(x, C) by a shift-based product and a
+// compare: x > UMAX / C for unsigned, and for signed either a shift
+// round-trip (C a power of two) or a range check on x
+bool replaceMulWithOverflow(IntrinsicInst *II) {
+    Intrinsic::ID ID = II->getIntrinsicID();
+    if (ID != Intrinsic::umul_with_overflow && ID != Intrinsic::smul_with_overflow)
+        return false;
+    bool Signed = ID == Intrinsic::smul_with_overflow;
+    Value *X = II->getArgOperand(0);
+    auto *C = dyn_cast<ConstantInt>(II->getArgOperand(1));
+    if (!C) {
+        X = II->getArgOperand(1);
+        C = dyn_cast<ConstantInt>(II->getArgOperand(0));
+    }
+    // Multiplying by 0 or 1 is left to InstCombine
+    if (!C || C->getValue().ule(1) || (Signed && !C->getValue().isStrictlyPositive()))
+        return false;
+    const APInt &K = C->getValue();
+    unsigned Bits = K.getBitWidth();
+
+    IRBuilder<> Builder(II);
+    Value *Product = emitShiftAdd(Builder, X, K);
+    if (!Product)
+        return false;
+    Value *Overflow;
+    if (!Signed) {
+        Overflow = Builder.CreateICmpUGT(X, Builder.getInt(APInt::getMaxValue(Bits).udiv(K)));
+    } else if (K.isPowerOf2()) {
+        // The shift overflows iff shifting back does not restore the sign bits
+        Value *Back = Builder.CreateAShr(Product, K.exactLogBase2());
+        Overflow = Builder.CreateICmpNE(Back, X);
+    } else {
+        // x * C fits iff SMIN / C <= x <= SMAX / C, checked with one compare
+        APInt Lo = APInt::getSignedMinValue(Bits).sdiv(K);
+        APInt Hi = APInt::getSignedMaxValue(Bits).sdiv(K);
+        Value *Offset = Builder.CreateSub(X, Builder.getInt(Lo));
+        Overflow = Builder.CreateICmpUGT(Offset, Builder.getInt(Hi - Lo));
+    }
+
+    // Feed the extracted fields directly, and rebuild the pair for anything else
+    for (User *U : make_early_inc_range(II->users())) {
+        auto *EV = dyn_cast<ExtractValueInst>(U);
+        if (!EV || EV->getNumIndices() != 1)
+            continue;
+        EV->replaceAllUsesWith(EV->getIndices()[0] == 0 ? Product : Overflow);
+        EV->eraseFromParent();
+    }
+    if (!II->use_empty()) {
+        Value *Pair = Builder.CreateInsertValue(PoisonValue::get(II->getType()), Product, 0);
+        II->replaceAllUsesWith(Builder.CreateInsertValue(Pair, Overflow, 1));
+    }
+    II->eraseFromParent();
+    return true;
+}
+
+// Scales an x86 address can apply to its index register for free
+bool isAddressingScale(uint64_t Scale) {
+    return Scale == 1 || Scale == 2 || Scale == 4 || Scale == 8;
+}
+
+// Match an index x * C, as mul or shl, possibly sign-extended. Without
+// signed wrap the multiplication can move into the GEP's own scaling.
+bool matchScaledIndex(Value *Idx, Value *&X, uint64_t &C) {
+    if (auto *Ext = dyn_cast<SExtInst>(Idx))
+        Idx = Ext->getOperand(0);
+    auto *Op = dyn_cast<BinaryOperator>(Idx);
+    if (!Op || !Op->hasNoSignedWrap() || !Op->hasOneUse())
+        return false;
+    auto *K = dyn_cast<ConstantInt>(Op->getOperand(1));
+    if (!K || !K->getValue().isStrictlyPositive() || K->getValue().getActiveBits() > 32)
+        return false;
+    X = Op->getOperand(0);
+    if (Op->getOpcode() == Instruction::Mul)
+        C = K->getZExtValue();
+    else if (Op->getOpcode() == Instruction::Shl &&
+             K->getZExtValue() < std::min(64u, Op->getType()->getScalarSizeInBits()))
+        C = uint64_t(1) << K->getZExtValue();
+    else
+        return false;
+    return true;
+}
+
+// Rewrites gep T, p, x * C into gep iN, p, x when C * sizeof(T) is a scale
+// the addressing mode applies, so the backend folds the whole computation
+// into the memory operand instead of materializing x * C
+bool foldScaleIntoGEP(GetElementPtrInst *GEP, const DataLayout &DL) {
+    if (GEP->getNumIndices() != 1 || !GEP->getSourceElementType()->isSized())
+        return false;
+    Value *X;
+    uint64_t C;
+    Value *Idx = GEP->getOperand(1);
+    if (!matchScaledIndex(Idx, X, C))
+        return false;
+    uint64_t Scale = C * DL.getTypeAllocSize(GEP->getSourceElementType());
+    if (!isAddressingScale(Scale) || C == 1)
+        return false;
+
+    IRBuilder<> Builder(GEP);
+    Type *ScaledTy = Builder.getIntNTy(Scale * 8);
+    Value *New = GEP->isInBounds()
+                     ? Builder.CreateInBoundsGEP(ScaledTy, GEP->getPointerOperand(), X)
+                     : Builder.CreateGEP(ScaledTy, GEP->getPointerOperand(), X);
+    New->takeName(GEP);
+    GEP->replaceAllUsesWith(New);
+    RecursivelyDeleteTriviallyDeadInstructions(GEP);
+    return true;
+}
+
+// Turns base + i * stride addresses in a loop into a pointer that is
+// incremented by the stride every iteration, when the stride is not one the
+// addressing mode scales by anyway
+bool incrementPointers(Loop &L, LoopInfo &LI, ScalarEvolution &SE) {
+    BasicBlock *Preheader = L.getLoopPreheader();
+    BasicBlock *Latch = L.getLoopLatch();
+    if (!Preheader || !Latch)
+        return false;
+
+    SmallVector<GetElementPtrInst *, 4> Candidates;
+    for (BasicBlock *BB : L.blocks()) {
+        // Addresses in inner loops belong to those loops
+        if (LI.getLoopFor(BB) != &L)
+            continue;
+        for (Instruction &I : *BB) {
+            auto *GEP = dyn_cast<GetElementPtrInst>(&I);
+            if (!GEP || GEP->getNumIndices() != 1)
+                continue;
+            auto *Idx = dyn_cast<BinaryOperator>(GEP->getOperand(1));
+            if (!Idx || (Idx->getOpcode() != Instruction::Mul &&
+                         Idx->getOpcode() != Instruction::Shl))
+                continue;
+            Candidates.push_back(GEP);
+        }
+    }
+
+    bool Changed = false;
+    const DataLayout &DL = Preheader->getModule()->getDataLayout();
+    SCEVExpander Expander(SE, DL, "ms");
+    for (GetElementPtrInst *GEP : Candidates) {
+        auto *AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(GEP));
+        if (!AR || AR->getLoop() != &L || !AR->isAffine())
+            continue;
+        const SCEV *Step = AR->getStepRecurrence(SE);
+        if (!SE.isLoopInvariant(Step, &L) ||
+            !Expander.isSafeToExpand(AR->getStart()) || !Expander.isSafeToExpand(Step))
+            continue;
+        if (auto *K = dyn_cast<SCEVConstant>(Step))
+            if (isAddressingScale(K->getAPInt().getZExtValue()))
+                continue;
+
+        Instruction *PHTerm = Preheader->getTerminator();
+        Value *Start = Expander.expandCodeFor(AR->getStart(), GEP->getType(), PHTerm);
+        Value *Stride = Expander.expandCodeFor(Step, Step->getType(), PHTerm);
+        IRBuilder<> Builder(&L.getHeader()->front());
+        PHINode *Ptr = Builder.CreatePHI(GEP->getType(), 2, GEP->getName() + ".ptr");
+        Builder.SetInsertPoint(Latch->getTerminator());
+        Value *Next = Builder.CreateGEP(Builder.getInt8Ty(), Ptr, Stride, GEP->getName() + ".next");
+        for (BasicBlock *Pred : predecessors(L.getHeader()))
+            Ptr->addIncoming(Pred == Preheader ? Start : Next, Pred);
+
+        GEP->replaceAllUsesWith(Ptr);
+        RecursivelyDeleteTriviallyDeadInstructions(GEP);
+        Changed = true;
+    }
+    if (Changed)
+        SE.forgetLoop(&L);
+    return Changed;
+}
+
+// Whether every use of Mul is the last index of a GEP whose element size
+// times the constant is an addressing scale: the backend folds such a mul
+// into the address, while a shl in its place may not be
+bool backendFoldsIntoAddress(BinaryOperator *Mul, const APInt &C, const DataLayout &DL) {
+    if (C.ugt(8))
+        return false;
+    for (User *U : Mul->users()) {
+        auto *GEP = dyn_cast<GetElementPtrInst>(U);
+        if (!GEP || GEP->getOperand(GEP->getNumOperands() - 1) != Mul ||
+            !GEP->getResultElementType()->isSized())
+            return false;
+        uint64_t Size = DL.getTypeAllocSize(GEP->getResultElementType());
+        if (!isAddressingScale(C.getZExtValue() * Size))
+            return false;
+    }
+    return !Mul->use_empty();
+}
+
+// Rewrites of "x op C" applied during the scan of the function. Each is a
+// row of the table below; RuleMatcher picks the cheapest one that applies.
+
+Value *shlByLog2(IRBuilder<> &Builder, const Match &M) {
+    return Builder.CreateShl(M.X, ConstantInt::get(M.X->getType(), M.C->exactLogBase2()));
+}
+
+Value *shlAddShl(IRBuilder<> &Builder, const Match &M) {
+    APInt Low = *M.C & -*M.C;
+    return Builder.CreateAdd(shlBy(Builder, M.X, (*M.C - Low).exactLogBase2()),
+                             shlBy(Builder, M.X, Low.exactLogBase2()));
+}
+
+Value *shlAddShlAddShl(IRBuilder<> &Builder, const Match &M) {
+    APInt Low = *M.C & -*M.C;
+    APInt Rest = *M.C - Low;
+    APInt Mid = Rest & -Rest;
+    return Builder.CreateAdd(Builder.CreateAdd(shlBy(Builder, M.X, (Rest - Mid).exactLogBase2()),
+                                               shlBy(Builder, M.X, Mid.exactLogBase2())),
+                             shlBy(Builder, M.X, Low.exactLogBase2()));
+}
+
+Value *shlSub(IRBuilder<> &Builder, const Match &M) {
+    return Builder.CreateSub(shlBy(Builder, M.X, (*M.C + 1).exactLogBase2()), M.X);
+}
+
+Value *lshrByLog2(IRBuilder<> &Builder, const Match &M) {
+    return Builder.CreateLShr(M.X, ConstantInt::get(M.X->getType(), M.C->exactLogBase2()));
+}
+
+Value *andLowBits(IRBuilder<> &Builder, const Match &M) {
+    return Builder.CreateAnd(M.X, ConstantInt::get(M.X->getType(), *M.C - 1));
+}
+
+// A shift in place of an address-scaling mul would cost an instruction
+bool notFoldedIntoAddress(const Match &M, const RuleContext &Ctx) {
+    return !backendFoldsIntoAddress(cast<BinaryOperator>(M.I), *M.C, Ctx.DL);
+}
+
+constexpr Rule MulRules[] = {
+    // Name               Opcode             Requires    Constraint             Rewrite           Cost
+    {"mul-pow2",          Instruction::Mul,  Pow2,       notFoldedIntoAddress,  shlByLog2,        1},
+    {"mul-pow2-minus-1",  Instruction::Mul,  Pow2Minus1, nullptr,               shlSub,           2},
+    {"mul-two-bits",      Instruction::Mul,  TwoBits,    nullptr,               shlAddShl,        3},
+    {"mul-three-bits",    Instruction::Mul,  ThreeBits,  nullptr,               shlAddShlAddShl,  5},
+    {"udiv-pow2",         Instruction::UDiv, Pow2,       nullptr,               lshrByLog2,       1},
+    {"urem-pow2",         Instruction::URem, Pow2,       nullptr,               andLowBits,       1},
+};
+static_assert(isValidTable(MulRules), "malformed rewrite rule table");
+constexpr RuleMatcher<std::size(MulRules)> MulRuleMatcher(MulRules);
+// Longest rewrite applied outside of sr:aggressive functions
+constexpr unsigned DefaultMaxCost = 3;
 
 // MultiplicationShifts pass without printing
 struct MultiplicationShifts : public PassInfoMixin<MultiplicationShifts> {
-    PreservedAnalyses run(Function &F, FunctionAnalysisManager &) {
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
         Modified = false;
+        EstimatedSavings = 0;
+        ControlLevel Level =
+            FAM.getResult<FunctionControlsAnalysis>(F).strengthReduction(StrengthReductionLevel);
+        if (Level == ControlLevel::Off)
+            return PreservedAnalyses::all();
+        const DataLayout &DL = F.getParent()->getDataLayout();
+        auto &LI = FAM.getResult<LoopAnalysis>(F);
+        auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+        auto &TTI = FAM.getResult<TargetIRAnalysis>(F);
+        // Block weights stay valid below, since no rewrite changes the CFG
+        auto &Cycles = FAM.getResult<CycleEstimateAnalysis>(F);
+        // Address computations first, so the multiplies they absorb are gone
+        for (Loop *L : LI.getLoopsInPreorder())
+            if (incrementPointers(*L, LI, SE))
+                Modified = true;
+        for (auto &BB : F)
+            for (Instruction &I : make_early_inc_range(BB))
+                if (auto *GEP = dyn_cast<GetElementPtrInst>(&I))
+                    if (foldScaleIntoGEP(GEP, DL))
+                        Modified = true;
+        // Overflow-checked multiplications are rewritten after the scan,
+        // since that erases their users as well
+        SmallVector<IntrinsicInst *, 4> Checked;
+        RuleContext Ctx{DL, Level == ControlLevel::Aggressive ? ~0u : DefaultMaxCost};
         // Iterate over basic blocks in the function
         for (auto &BB : F) {
             // Iterate over instructions in the basic block
             for (auto I = BB.begin(), E = BB.end(); I != E; ) {
                 Instruction *Inst = &(*I++);
-                // Check if the instruction is a binary operator
-                if (auto *Mul = dyn_cast<BinaryOperator>(Inst)) {
-                    // Check if the binary operator is multiplication
-                    if (Mul->getOpcode() == Instruction::Mul) {
-                        // Check if the second operand is a constant power of two
-                        if (auto *C = dyn_cast<ConstantInt>(Mul->getOperand(1))) {
-                            if (C->getValue().isPowerOf2()) {
-                                // If true, replace multiplication with left shift
-                                IRBuilder<> Builder(Mul);
-                                Value *ShiftAmount = Builder.getInt32(C->getValue().exactLogBase2());
-                                Value *NewMul = Builder.CreateShl(Mul->getOperand(0), ShiftAmount);
-                                Mul->replaceAllUsesWith(NewMul);
-                                Mul->eraseFromParent(); // Remove the multiplication instruction
-                                Modified = true;
-                            }
-                        }
-                    }
+                // Apply the first matching peephole from the rule table
+                Instruction *Prev = Inst->getPrevNode();
+                if (Value *New = MulRuleMatcher.apply(*Inst, Ctx)) {
+                    // The replacement is everything inserted right before Inst
+                    double Saved = instructionCycles(*Inst, TTI, TargetTransformInfo::TCK_RecipThroughput);
+                    for (Instruction *NewI = Prev ? Prev->getNextNode() : &BB.front(); NewI != Inst;
+                         NewI = NewI->getNextNode())
+                        Saved -= instructionCycles(*NewI, TTI, TargetTransformInfo::TCK_RecipThroughput);
+                    EstimatedSavings += Saved * Cycles.weight(&BB);
+                    New->takeName(Inst);
+                    Inst->replaceAllUsesWith(New);
+                    Inst->eraseFromParent();
+                    Modified = true;
+                    continue;
                 }
+                // Check if the instruction is an overflow-checked multiplication
+                if (auto *II = dyn_cast<WithOverflowInst>(Inst))
+                    Checked.push_back(II);
             }
         }
-        // Indicate whether the function was modified or not
-        return Modified ? PreservedAnalyses::none() : PreservedAnalyses::all();
+        for (IntrinsicInst *II : Checked)
+            if (replaceMulWithOverflow(II))
+                Modified = true;
+        // Indicate whether the function was modified or not. No rewrite
+        // touches the CFG, so the dominator tree and loops stay valid.
+        if (!Modified)
+            return PreservedAnalyses::all();
+        PreservedAnalyses PA;
+        PA.preserveSet<CFGAnalyses>();
+        return PA;
     }
 };
 
@@ -53,6 +369,8 @@ struct MultiplicationShiftsPrinter : public PassInfoMixin<MultiplicationShiftsPr
         errs() << "*** MULTIPLICATION SHIFTS PASS EXECUTING ***\n";
         if (Modified) {
             errs() << "Some instruction was replaced.\n";
+            errs() << "Estimated savings of the peepholes: "
+                   << format("%.1f", EstimatedSavings) << " cycles per call.\n";
         } else {
             errs() << "Nothing changed.\n";
         }
@@ -65,6 +383,12 @@ struct MultiplicationShiftsPrinter : public PassInfoMixin<MultiplicationShiftsPr
 PassPluginLibraryInfo getMultiplicationShiftsPluginInfo() {
     return {LLVM_PLUGIN_API_VERSION, "MultiplicationShifts", LLVM_VERSION_STRING,
             [](PassBuilder &PB) {
+                // The pass weighs its rewrites with the cycle estimate, and
+                // follows the sr: control of each function
+                PB.registerAnalysisRegistrationCallback([](FunctionAnalysisManager &FAM) {
+                    FAM.registerPass([] { return CycleEstimateAnalysis(); });
+                    FAM.registerPass([] { return FunctionControlsAnalysis(); });
+                });
                 PB.registerPipelineParsingCallback(
                     [](StringRef Name, FunctionPassManager &FPM,
                        ArrayRef<PassBuilder::PipelineElement>) {
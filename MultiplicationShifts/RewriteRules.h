@@ -0,0 +1,161 @@
+//===- RewriteRules.h - Table-driven peephole rewrites --------------------===//
+//
+// Peepholes on "x op C" are written as a table of rules: the opcode, the
+// shape the constant must have, an optional constraint, the replacement and
+// its cost in instructions. The table is checked and compiled at build time
+// into a decision tree indexed by opcode and constant shape, whose leaves
+// list the rules that match structurally, cheapest first. Matching an
+// instruction is then one lookup plus the constraints of those rules only,
+// however many rules other opcodes and shapes have.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_REWRITERULES_H
+#define TUTORIAL_LLVM_PASS_REWRITERULES_H
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/IR/PatternMatch.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+
+namespace llvm {
+namespace rewrite {
+
+// Shapes of the constant operand a rule can require, as a bit mask
+enum ConstShape : unsigned {
+    AnyConst = 0,
+    Pow2 = 1 << 0,       // 2^n
+    TwoBits = 1 << 1,    // 2^a + 2^b
+    Pow2Minus1 = 1 << 2, // 2^n - 1, n > 1
+    ThreeBits = 1 << 3,  // 2^a + 2^b + 2^c
+    NumShapeMasks = 1 << 4,
+};
+
+inline unsigned classifyConstant(const APInt &C) {
+    unsigned Shape = AnyConst;
+    if (C.isPowerOf2())
+        Shape |= Pow2;
+    if (C.popcount() == 2)
+        Shape |= TwoBits;
+    if (C.popcount() == 3)
+        Shape |= ThreeBits;
+    if (C.ugt(1) && (C + 1).isPowerOf2())
+        Shape |= Pow2Minus1;
+    return Shape;
+}
+
+// What the rules see of a matched "x op C" (or "C op x" when op commutes)
+struct Match {
+    Instruction *I;
+    Value *X;
+    const APInt *C;
+};
+
+// Facts about the function that constraints may need
+struct RuleContext {
+    const DataLayout &DL;
+    // Rules that cost more are not applied
+    unsigned MaxCost = ~0u;
+};
+
+struct Rule {
+    const char *Name;
+    unsigned Opcode;
+    // ConstShape bits the constant must all have
+    unsigned Requires;
+    // Extra condition on the match, or null
+    bool (*Constraint)(const Match &, const RuleContext &);
+    // Emits the replacement before M.I and returns it
+    Value *(*Rewrite)(IRBuilder<> &, const Match &);
+    // Instructions the replacement emits; lower is tried first
+    unsigned Cost;
+};
+
+// Build-time sanity checks of a rule table. Two rules with the same opcode,
+// shape and cost would be matched in an arbitrary order.
+template <size_t N> constexpr bool isValidTable(const Rule (&Rules)[N]) {
+    for (size_t I = 0; I < N; ++I) {
+        const Rule &R = Rules[I];
+        if (!R.Name || !R.Rewrite || R.Cost == 0 || R.Requires >= NumShapeMasks ||
+            R.Opcode < Instruction::BinaryOpsBegin || R.Opcode >= Instruction::BinaryOpsEnd)
+            return false;
+        for (size_t J = 0; J < I; ++J)
+            if (Rules[J].Opcode == R.Opcode && Rules[J].Requires == R.Requires &&
+                Rules[J].Cost == R.Cost)
+                return false;
+    }
+    return true;
+}
+
+// The compiled decision tree. Leaf (opcode, shape) holds the range
+// [Begin, End) of Order, which lists the rules applicable to a constant
+// of exactly that shape by increasing cost.
+template <size_t N> class RuleMatcher {
+    static constexpr unsigned NumOpcodes = Instruction::BinaryOpsEnd - Instruction::BinaryOpsBegin;
+    struct Leaf {
+        uint16_t Begin = 0, End = 0;
+    };
+
+    const Rule *Rules;
+    std::array<std::array<Leaf, NumShapeMasks>, NumOpcodes> Tree{};
+    std::array<uint16_t, N * NumShapeMasks> Order{};
+
+public:
+    constexpr explicit RuleMatcher(const Rule (&Table)[N]) : Rules(Table) {
+        uint16_t Next = 0;
+        for (unsigned Op = 0; Op < NumOpcodes; ++Op) {
+            for (unsigned Shape = 0; Shape < NumShapeMasks; ++Shape) {
+                Leaf &L = Tree[Op][Shape];
+                L.Begin = Next;
+                for (size_t R = 0; R < N; ++R) {
+                    if (Table[R].Opcode != Op + Instruction::BinaryOpsBegin ||
+                        (Table[R].Requires & ~Shape) != 0)
+                        continue;
+                    // Insertion sort by cost within the leaf
+                    uint16_t Pos = Next++;
+                    while (Pos > L.Begin && Table[Order[Pos - 1]].Cost > Table[R].Cost) {
+                        Order[Pos] = Order[Pos - 1];
+                        --Pos;
+                    }
+                    Order[Pos] = uint16_t(R);
+                }
+                L.End = Next;
+            }
+        }
+    }
+
+    // Applies the cheapest rule within Ctx.MaxCost whose constraint holds
+    // and returns the replacement, or null if none does. The caller replaces and erases I.
+    Value *apply(Instruction &I, const RuleContext &Ctx) const {
+        using namespace PatternMatch;
+        if (!Instruction::isBinaryOp(I.getOpcode()))
+            return nullptr;
+        Match M{&I, I.getOperand(0), nullptr};
+        if (!match(I.getOperand(1), m_APInt(M.C))) {
+            if (!I.isCommutative() || !match(I.getOperand(0), m_APInt(M.C)))
+                return nullptr;
+            M.X = I.getOperand(1);
+        }
+        const Leaf &L = Tree[I.getOpcode() - Instruction::BinaryOpsBegin][classifyConstant(*M.C)];
+        for (uint16_t Idx = L.Begin; Idx != L.End; ++Idx) {
+            const Rule &R = Rules[Order[Idx]];
+            if (R.Cost > Ctx.MaxCost)
+                break;
+            if (R.Constraint && !R.Constraint(M, Ctx))
+                continue;
+            IRBuilder<> Builder(&I);
+            if (Value *New = R.Rewrite(Builder, M))
+                return New;
+        }
+        return nullptr;
+    }
+};
+
+} // namespace rewrite
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_REWRITERULES_H
@@ -0,0 +1,237 @@
+#include "VectorizationBlockers.h"
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+static cl::opt<std::string> LintOutput(
+    "perf-lint-output", cl::init(""),
+    cl::desc("Append perf-lint findings to this file instead of stderr"));
+
+namespace {
+
+// One hazard at one instruction. Score is the base cost of the hazard,
+// multiplied by 10 for every loop around it.
+struct Finding {
+    StringRef Kind;
+    std::string Message;
+    const Instruction *At;
+    unsigned LoopDepth;
+    unsigned Score;
+};
+
+bool isLibCall(const CallBase &CB, const TargetLibraryInfo &TLI,
+               std::initializer_list<LibFunc> Funcs) {
+    LibFunc LF;
+    const Function *Callee = CB.getCalledFunction();
+    if (!Callee || !TLI.getLibFunc(*Callee, LF) || !TLI.has(LF))
+        return false;
+    return is_contained(Funcs, LF);
+}
+
+// Whether V, through casts, decides whether L exits
+bool feedsLoopExit(const Value *V, const Loop &L) {
+    SmallVector<const Value *, 8> Worklist{V};
+    SmallPtrSet<const Value *, 8> Visited;
+    while (!Worklist.empty()) {
+        const Value *Cur = Worklist.pop_back_val();
+        if (!Visited.insert(Cur).second)
+            continue;
+        for (const User *U : Cur->users()) {
+            const auto *I = dyn_cast<Instruction>(U);
+            if (!I || !L.contains(I))
+                continue;
+            if (const auto *Br = dyn_cast<BranchInst>(I))
+                if (L.isLoopExiting(Br->getParent()))
+                    return true;
+            if (isa<CastInst>(I) || isa<CmpInst>(I) || isa<BinaryOperator>(I))
+                Worklist.push_back(I);
+        }
+    }
+    return false;
+}
+
+void check(Instruction &I, Loop *L, const TargetLibraryInfo &TLI,
+           SmallVectorImpl<Finding> &Findings) {
+    unsigned Depth = L ? L->getLoopDepth() : 0;
+    auto Report = [&](StringRef Kind, unsigned Base, const Twine &Message) {
+        unsigned Score = Base;
+        for (unsigned D = 0; D < Depth; ++D)
+            Score *= 10;
+        Findings.push_back({Kind, Message.str(), &I, Depth, Score});
+    };
+
+    if (auto *Div = dyn_cast<BinaryOperator>(&I)) {
+        switch (Div->getOpcode()) {
+        case Instruction::SDiv:
+        case Instruction::UDiv:
+        case Instruction::SRem:
+        case Instruction::URem:
+            break;
+        default:
+            return;
+        }
+        Value *Divisor = Div->getOperand(1);
+        if (Div->getType()->getScalarSizeInBits() == 64 && !isa<Constant>(Divisor))
+            Report("div64", 40,
+                   "64-bit division; a 32-bit divide is several times faster when the "
+                   "operands fit");
+        if (L && !isa<Constant>(Divisor) && L->isLoopInvariant(Divisor))
+            Report("div-by-invariant", 20,
+                   "division by a loop-invariant value; precompute its reciprocal or a "
+                   "multiply-shift outside the loop");
+        return;
+    }
+
+    if (auto *CB = dyn_cast<CallBase>(&I)) {
+        if (isa<DbgInfoIntrinsic>(CB) || !L)
+            return;
+        if (CB->isIndirectCall()) {
+            Report("indirect-call-in-loop", 10,
+                   "indirect call in a loop; it cannot be inlined and blocks vectorization");
+            return;
+        }
+        if (isLibCall(*CB, TLI, {LibFunc_strlen}) && feedsLoopExit(CB, *L)) {
+            Report("strlen-in-loop-condition", 30,
+                   "strlen in a loop condition makes the loop quadratic; compute the "
+                   "length once");
+            return;
+        }
+        if (isLibCall(*CB, TLI,
+                      {LibFunc_printf, LibFunc_fprintf, LibFunc_puts, LibFunc_putchar,
+                       LibFunc_fputs, LibFunc_fputc, LibFunc_putc, LibFunc_fwrite,
+                       LibFunc_fread, LibFunc_fgets, LibFunc_fgetc, LibFunc_getc,
+                       LibFunc_getchar, LibFunc_scanf, LibFunc_fscanf, LibFunc_sprintf,
+                       LibFunc_snprintf}))
+            Report("stdio-in-loop", 15,
+                   "stdio call in a loop; buffer the output and write it once after the loop");
+        else if (isLibCall(*CB, TLI,
+                           {LibFunc_malloc, LibFunc_calloc, LibFunc_realloc, LibFunc_free,
+                            LibFunc_aligned_alloc, LibFunc_posix_memalign, LibFunc_Znwm,
+                            LibFunc_Znam, LibFunc_ZdlPv, LibFunc_ZdaPv}))
+            Report("alloc-in-loop", 15,
+                   "heap allocation in a loop; reuse one buffer allocated outside the loop");
+        return;
+    }
+
+    bool Volatile = false;
+    if (auto *LI = dyn_cast<LoadInst>(&I))
+        Volatile = LI->isVolatile();
+    else if (auto *SI = dyn_cast<StoreInst>(&I))
+        Volatile = SI->isVolatile();
+    else if (auto *RMW = dyn_cast<AtomicRMWInst>(&I))
+        Volatile = RMW->isVolatile();
+    else if (auto *CX = dyn_cast<AtomicCmpXchgInst>(&I))
+        Volatile = CX->isVolatile();
+    if (Volatile) {
+        Report("volatile-access", 5,
+               "volatile access; it cannot be combined, hoisted or vectorized");
+        return;
+    }
+
+    // A global the loop keeps storing to at the same address, which LICM
+    // could not promote to a register
+    if (auto *SI = dyn_cast<StoreInst>(&I)) {
+        Value *Ptr = SI->getPointerOperand();
+        if (L && L->isLoopInvariant(Ptr) && isa<GlobalVariable>(getUnderlyingObject(Ptr)))
+            Report("global-store-in-loop", 25,
+                   "store to a global in a loop blocks vectorization; accumulate in a "
+                   "local and store once after the loop");
+    }
+}
+
+void emit(json::OStream &J, const Function &F, const Finding &Fd) {
+    J.object([&] {
+        J.attribute("kind", Fd.Kind);
+        J.attribute("function", F.getName());
+        if (const DILocation *Loc = Fd.At->getDebugLoc()) {
+            J.attribute("file", Loc->getFilename());
+            J.attribute("line", Loc->getLine());
+            J.attribute("column", Loc->getColumn());
+        } else {
+            J.attribute("file", F.getParent()->getSourceFileName());
+        }
+        J.attribute("loop_depth", Fd.LoopDepth);
+        J.attribute("score", Fd.Score);
+        J.attribute("message", Fd.Message);
+    });
+}
+
+// Report-only pass: flags common hot-path performance hazards as JSON lines,
+// one finding per line, for tools such as a code review bot
+struct PerfLint : public PassInfoMixin<PerfLint> {
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        auto &LI = FAM.getResult<LoopAnalysis>(F);
+        auto &TLI = FAM.getResult<TargetLibraryAnalysis>(F);
+        SmallVector<Finding, 8> Findings;
+        for (BasicBlock &BB : F)
+            for (Instruction &I : BB)
+                check(I, LI.getLoopFor(&BB), TLI, Findings);
+        if (Findings.empty())
+            return PreservedAnalyses::all();
+
+        // All findings of a function are written at once, so that parallel
+        // compilations appending to the same file do not interleave lines
+        std::string Text;
+        raw_string_ostream OS(Text);
+        for (const Finding &Fd : Findings) {
+            json::OStream J(OS);
+            emit(J, F, Fd);
+            OS << "\n";
+        }
+        OS.flush();
+        if (LintOutput.empty()) {
+            errs() << Text;
+        } else {
+            std::error_code EC;
+            raw_fd_ostream Out(LintOutput, EC, sys::fs::OF_Append);
+            if (EC)
+                errs() << "perf-lint: cannot open " << LintOutput << ": " << EC.message() << "\n";
+            else
+                Out << Text;
+        }
+        return PreservedAnalyses::all();
+    }
+};
+} // namespace
+
+// Register the pass as a plugin
+PassPluginLibraryInfo getPerfLintPluginInfo() {
+    return {LLVM_PLUGIN_API_VERSION, "PerfLint", LLVM_VERSION_STRING,
+            [](PassBuilder &PB) {
+                PB.registerPipelineParsingCallback(
+                    [](StringRef Name, FunctionPassManager &FPM,
+                       ArrayRef<PassBuilder::PipelineElement>) {
+                      if (Name == "perf-lint") {
+                        FPM.addPass(PerfLint());
+                        return true;
+                      }
+                      return false;
+                    });
+                // Run once the IR is simplified, so that only the hazards the
+                // optimizer could not remove itself are reported
+                PB.registerVectorizerStartEPCallback([](FunctionPassManager &FPM,
+                                                        OptimizationLevel Level) {
+                    FPM.addPass(PerfLint());
+                });
+                registerVectorizationBlockers(PB);
+            }};
+}
+
+// Entry point for the pass plugin
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+    return getPerfLintPluginInfo();
+}
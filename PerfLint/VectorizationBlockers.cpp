@@ -0,0 +1,280 @@
+#include "VectorizationBlockers.h"
+
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/LoopAccessAnalysis.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/VectorUtils.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PatternMatch.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <map>
+
+using namespace llvm;
+using namespace llvm::PatternMatch;
+
+static cl::opt<std::string> BlockersOutput(
+    "vectorization-blockers-output", cl::init(""),
+    cl::desc("Append a record for every loop left scalar to this file, and run the "
+             "blocker classification after the optimization pipeline"));
+
+static cl::opt<bool> BlockersSummary(
+    "vectorization-blockers-summary", cl::init(false),
+    cl::desc("Print the blockers recorded in the output file so far, heaviest first"));
+
+namespace {
+
+struct Blocker {
+    StringRef Kind;
+    std::string Detail;
+};
+
+// An operation the vectorizer can only scalarize, or that has no vector
+// form on common targets: integer division by anything but a power of two,
+// and 64-bit multiplication by a constant that is not a shift-and-add
+bool isCostlyOp(const Instruction &I) {
+    const APInt *C;
+    switch (I.getOpcode()) {
+    case Instruction::UDiv:
+    case Instruction::SDiv:
+    case Instruction::URem:
+    case Instruction::SRem:
+        return !match(I.getOperand(1), m_APInt(C)) || !C->isPowerOf2();
+    case Instruction::Mul:
+        if (I.getType()->getScalarSizeInBits() < 64 || !match(I.getOperand(1), m_APInt(C)))
+            return false;
+        return !C->isPowerOf2() && C->popcount() != 2 && !(*C + 1).isPowerOf2();
+    default:
+        return false;
+    }
+}
+
+// Calls the vectorizer can widen: intrinsics with vector forms, and markers
+bool isVectorizableCall(const CallBase &CB) {
+    if (isa<DbgInfoIntrinsic>(CB))
+        return true;
+    if (auto *II = dyn_cast<IntrinsicInst>(&CB)) {
+        switch (II->getIntrinsicID()) {
+        case Intrinsic::assume:
+        case Intrinsic::lifetime_start:
+        case Intrinsic::lifetime_end:
+        case Intrinsic::experimental_noalias_scope_decl:
+            return true;
+        default:
+            return isTriviallyVectorizable(II->getIntrinsicID());
+        }
+    }
+    return false;
+}
+
+Blocker classify(Loop &L, ScalarEvolution &SE, LoopAccessInfoManager &LAIs) {
+    if (!L.getLoopPreheader() || !L.getLoopLatch() || !L.getExitingBlock())
+        return {"control-flow", "loop has several exits or no preheader or single latch"};
+    if (L.getExitingBlock() != L.getLoopLatch())
+        return {"control-flow", "loop exits before its latch"};
+    if (isa<SCEVCouldNotCompute>(SE.getBackedgeTakenCount(&L)))
+        return {"unknown-trip-count", "the trip count cannot be computed before the loop"};
+
+    for (BasicBlock *BB : L.blocks()) {
+        for (Instruction &I : *BB) {
+            if (auto *CB = dyn_cast<CallBase>(&I)) {
+                if (!isVectorizableCall(*CB)) {
+                    const Function *Callee = CB->getCalledFunction();
+                    return {"call", Callee ? ("call to " + Callee->getName()).str()
+                                           : std::string("indirect call")};
+                }
+            }
+        }
+    }
+
+    const LoopAccessInfo &LAI = LAIs.getInfo(L);
+    if (!LAI.canVectorizeMemory())
+        return {"aliasing", "memory accesses may depend on each other across iterations"};
+    if (LAI.getNumRuntimePointerChecks() > 8)
+        return {"aliasing", (Twine(LAI.getNumRuntimePointerChecks()) +
+                             " runtime alias checks would be needed").str()};
+
+    for (BasicBlock *BB : L.blocks())
+        for (Instruction &I : *BB)
+            if (isCostlyOp(I))
+                return {"costly-op", (Twine(I.getOpcodeName()) + " by " +
+                                      (isa<Constant>(I.getOperand(1)) ? "a constant that is not a "
+                                                                        "power of two"
+                                                                      : "a variable"))
+                                         .str()};
+
+    if (L.getNumBlocks() > 1)
+        return {"control-flow", "branches inside the loop could not be if-converted"};
+    return {"cost-model", "the vectorizer did not find a profitable vector factor"};
+}
+
+// Writes one JSON record per line into Text
+void record(raw_ostream &OS, const Module &M, const Function &F, const Loop *L,
+            const Blocker &B, double Weight, bool Profiled) {
+    json::OStream J(OS);
+    J.object([&] {
+        J.attribute("module", M.getModuleIdentifier());
+        J.attribute("function", F.getName());
+        if (L) {
+            if (DebugLoc Loc = L->getStartLoc()) {
+                J.attribute("file", Loc->getFilename());
+                J.attribute("line", Loc.getLine());
+            }
+        }
+        J.attribute("blocker", B.Kind);
+        J.attribute("detail", B.Detail);
+        J.attribute("weight", Weight);
+        J.attribute("weight_source", Profiled ? "profile" : "static");
+    });
+    OS << "\n";
+}
+
+// Totals per blocker over every record in the output file
+void summarize(StringRef Path, raw_ostream &OS) {
+    auto Buffer = MemoryBuffer::getFile(Path);
+    if (!Buffer) {
+        OS << "vectorization-blockers: cannot read " << Path << "\n";
+        return;
+    }
+    struct Total {
+        unsigned Loops = 0;
+        double Static = 0, Profile = 0;
+    };
+    struct HotLoop {
+        double Weight;
+        bool Profiled;
+        std::string Where, Kind;
+    };
+    std::map<std::string, Total> Totals;
+    std::vector<HotLoop> Loops;
+    SmallVector<StringRef, 64> Lines;
+    (*Buffer)->getBuffer().split(Lines, '\n', -1, /*KeepEmpty=*/false);
+    for (StringRef Line : Lines) {
+        Expected<json::Value> V = json::parse(Line);
+        if (!V) {
+            consumeError(V.takeError());
+            continue;
+        }
+        const json::Object *O = V->getAsObject();
+        std::optional<StringRef> Kind = O ? O->getString("blocker") : std::nullopt;
+        if (!Kind)
+            continue;
+        Total &T = Totals[Kind->str()];
+        ++T.Loops;
+        double Weight = O->getNumber("weight").value_or(0.0);
+        bool Profiled = O->getString("weight_source") == StringRef("profile");
+        (Profiled ? T.Profile : T.Static) += Weight;
+        std::string Where = O->getString("function").value_or("").str();
+        if (std::optional<StringRef> File = O->getString("file"))
+            Where = (*File + ":" + Twine(O->getInteger("line").value_or(0)) + " " + Where).str();
+        Loops.push_back({Weight, Profiled, Where, Kind->str()});
+    }
+
+    std::vector<std::pair<std::string, Total>> Sorted(Totals.begin(), Totals.end());
+    std::stable_sort(Sorted.begin(), Sorted.end(), [](const auto &A, const auto &B) {
+        return A.second.Profile != B.second.Profile ? A.second.Profile > B.second.Profile
+                                                    : A.second.Static > B.second.Static;
+    });
+    OS << "===-------------------------------------------------------------------------===\n"
+       << "  Vectorization blockers in " << Path << "\n"
+       << "===-------------------------------------------------------------------------===\n"
+       << "   Loops  Profile weight   Static weight  Blocker\n";
+    for (const auto &[Kind, T] : Sorted)
+        OS << format("%8u %15.0f %15.1f  ", T.Loops, T.Profile, T.Static) << Kind << "\n";
+
+    // Profiled loops first, as their weights are counts rather than per call
+    std::stable_sort(Loops.begin(), Loops.end(), [](const HotLoop &A, const HotLoop &B) {
+        return A.Profiled != B.Profiled ? A.Profiled : A.Weight > B.Weight;
+    });
+    OS << "\n  Heaviest scalar loops\n";
+    for (const HotLoop &HL : ArrayRef(Loops).take_front(10))
+        OS << format("%15.1f %-7s  ", HL.Weight, HL.Profiled ? "profile" : "static")
+           << HL.Kind << "  " << HL.Where << "\n";
+}
+
+} // namespace
+
+PreservedAnalyses VectorizationBlockers::run(Module &M, ModuleAnalysisManager &MAM) {
+    auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    std::string Text;
+    raw_string_ostream OS(Text);
+    for (Function &F : M) {
+        if (F.isDeclaration())
+            continue;
+        auto &LI = FAM.getResult<LoopAnalysis>(F);
+        auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+        auto &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
+        auto &LAIs = FAM.getResult<LoopAccessAnalysis>(F);
+        double Entry = BFI.getBlockFreq(&F.getEntryBlock()).getFrequency();
+
+        // Cycles that are not natural loops are never vectorized
+        ReversePostOrderTraversal<Function *> RPOT(&F);
+        if (containsIrreducibleCFG<const BasicBlock *>(RPOT, LI))
+            record(OS, M, F, nullptr, {"control-flow", "function has irreducible control flow"},
+                   0.0, false);
+
+        for (Loop *L : LI.getLoopsInPreorder()) {
+            if (!L->isInnermost() || getBooleanLoopAttribute(L, "llvm.loop.isvectorized"))
+                continue;
+            // "#pragma clang loop vectorize(disable)" sets a width of 1
+            bool Disabled =
+                getOptionalBoolLoopAttribute(L, "llvm.loop.vectorize.enable") == false ||
+                getOptionalIntLoopAttribute(L, "llvm.loop.vectorize.width") == 1;
+            Blocker B = Disabled ? Blocker{"disabled", "vectorization disabled by a pragma"}
+                                 : classify(*L, SE, LAIs);
+            // Header executions: in total with a profile, per call without
+            double Weight;
+            bool Profiled = false;
+            if (auto Count = BFI.getBlockProfileCount(L->getHeader())) {
+                Weight = double(*Count);
+                Profiled = true;
+            } else {
+                Weight = Entry ? BFI.getBlockFreq(L->getHeader()).getFrequency() / Entry : 0.0;
+            }
+            record(OS, M, F, L, B, Weight, Profiled);
+        }
+    }
+    OS.flush();
+
+    // Written at once, so that parallel compilations do not interleave lines
+    if (BlockersOutput.empty()) {
+        errs() << Text;
+    } else {
+        std::error_code EC;
+        raw_fd_ostream Out(BlockersOutput, EC, sys::fs::OF_Append);
+        if (EC)
+            errs() << "vectorization-blockers: cannot open " << BlockersOutput << ": "
+                   << EC.message() << "\n";
+        else
+            Out << Text;
+    }
+    if (BlockersSummary && !BlockersOutput.empty())
+        summarize(BlockersOutput, errs());
+    return PreservedAnalyses::all();
+}
+
+void llvm::registerVectorizationBlockers(PassBuilder &PB) {
+    PB.registerPipelineParsingCallback(
+        [](StringRef Name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>) {
+            if (Name == "vectorization-blockers") {
+                MPM.addPass(VectorizationBlockers());
+                return true;
+            }
+            return false;
+        });
+    // Only the end of the pipeline knows which loops the vectorizer left
+    if (!BlockersOutput.empty())
+        PB.registerOptimizerLastEPCallback([](ModulePassManager &MPM, OptimizationLevel Level) {
+            MPM.addPass(VectorizationBlockers());
+        });
+}
@@ -0,0 +1,33 @@
+//===- VectorizationBlockers.h - Why loops stayed scalar ------------------===//
+//
+// After the loop vectorizer has run, classifies what blocks each innermost
+// loop it left scalar: control flow it cannot if-convert, an unknown trip
+// count, calls, memory that may alias or depend across iterations, or
+// operations with no cheap vector form, such as integer divisions by values
+// other than powers of two. Each loop is weighted by how hot it is, from the
+// profile when there is one and from static block frequencies otherwise.
+//
+// Records are appended as JSON lines to a file shared by the whole build, and
+// the same pass can summarize that file, heaviest blockers first.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_VECTORIZATIONBLOCKERS_H
+#define TUTORIAL_LLVM_PASS_VECTORIZATIONBLOCKERS_H
+
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+
+namespace llvm {
+
+struct VectorizationBlockers : PassInfoMixin<VectorizationBlockers> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+// Registers the "vectorization-blockers" pass, and adds it after the
+// optimization pipeline when an output file is given
+void registerVectorizationBlockers(PassBuilder &PB);
+
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_VECTORIZATIONBLOCKERS_H
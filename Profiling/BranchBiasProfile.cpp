@@ -0,0 +1,61 @@
+#include "BranchBiasProfile.h"
+#include "FunctionControls.h"
+#include "Instrumentation.h"
+
+#include "llvm/IR/Module.h"
+
+using namespace llvm;
+using namespace llvm::profiling;
+
+// Values of the three records of a branch, in table order
+static const char *const Outcomes[] = {"true", "false", "miss"};
+
+SmallVector<BranchInst *, 16> llvm::profiledBranches(Function &F) {
+    SmallVector<BranchInst *, 16> Sites;
+    for (BasicBlock &BB : F)
+        if (auto *BI = dyn_cast<BranchInst>(BB.getTerminator()))
+            if (BI->isConditional())
+                Sites.push_back(BI);
+    return Sites;
+}
+
+PreservedAnalyses BranchBiasProfile::run(Module &M, ModuleAnalysisManager &MAM) {
+    auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    LLVMContext &Ctx = M.getContext();
+    StringTable Strings(M);
+    SmallVector<Constant *, 64> Records;
+    SmallVector<BranchInst *, 32> Counted;
+    for (Function &F : M) {
+        if (F.isDeclaration() || !FAM.getResult<FunctionControlsAnalysis>(F).counted())
+            continue;
+        Constant *Name = Strings.get(profileName(F));
+        for (auto [Site, BI] : enumerate(profiledBranches(F))) {
+            for (const char *Outcome : Outcomes)
+                Records.push_back(siteRecord(Ctx, Name, Strings.get(Outcome), Site));
+            Counted.push_back(BI);
+        }
+    }
+    if (Records.empty())
+        return PreservedAnalyses::all();
+
+    GlobalVariable *Table = createSiteTable(M, Strings, "branch", Records);
+    // The history and counters of the predictor of each branch
+    auto *StateTy = ArrayType::get(Type::getInt64Ty(Ctx), Counted.size());
+    auto *State = new GlobalVariable(M, StateTy, /*isConstant=*/false,
+                                     GlobalValue::PrivateLinkage,
+                                     Constant::getNullValue(StateTy), ".sr.branch.state");
+    FunctionCallee Predict =
+        M.getOrInsertFunction("__sr_profile_branch", Type::getInt64Ty(Ctx),
+                              PointerType::getUnqual(Ctx), Type::getInt32Ty(Ctx));
+    for (auto [Index, BI] : enumerate(Counted)) {
+        IRBuilder<> Builder(BI);
+        Value *Taken = Builder.CreateZExt(BI->getCondition(), Builder.getInt64Ty());
+        Value *Miss = Builder.CreateCall(
+            Predict, {Builder.CreateConstInBoundsGEP2_32(StateTy, State, 0, Index),
+                      Builder.CreateZExt(BI->getCondition(), Builder.getInt32Ty())});
+        incrementCounter(BI, Table, Index * 3, Taken);
+        incrementCounter(BI, Table, Index * 3 + 1, Builder.CreateXor(Taken, 1));
+        incrementCounter(BI, Table, Index * 3 + 2, Miss);
+    }
+    return PreservedAnalyses::none();
+}
@@ -0,0 +1,32 @@
+//===- BranchBiasProfile.h - Count the directions of conditional branches -===//
+//
+// Instrumentation: each conditional branch of a function counts how often
+// it goes each way, and how often a simple predictor guesses its direction
+// wrong, recorded as "branch function site true|false|miss count". The
+// predictor, in the runtime, is a local-history one: the last 4 directions
+// of the branch select one of 16 two-bit counters. It predicts a branch
+// taken in long runs or in short repeating patterns well, and a branch that
+// follows random data badly, as the hardware does. Since it does not see
+// the other branches, it overestimates the misses of correlated branches.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_BRANCHBIASPROFILE_H
+#define TUTORIAL_LLVM_PASS_BRANCHBIASPROFILE_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+// The conditional branches of F the profile numbers, in order
+SmallVector<BranchInst *, 16> profiledBranches(Function &F);
+
+struct BranchBiasProfile : PassInfoMixin<BranchBiasProfile> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_BRANCHBIASPROFILE_H
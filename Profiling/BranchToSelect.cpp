@@ -0,0 +1,262 @@
+#include "BranchToSelect.h"
+#include "BranchBiasProfile.h"
+#include "Instrumentation.h"
+#include "ProfileData.h"
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/ProfDataUtils.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <optional>
+
+using namespace llvm;
+using namespace llvm::profiling;
+
+static cl::opt<unsigned> MinMispredict(
+    "branch-select-min-mispredict", cl::init(20),
+    cl::desc("Misprediction rate, in percent, from which a profiled branch is unpredictable; "
+             "branch weights biased further than this keep a branch without a profile"));
+
+static cl::opt<unsigned> MinBranchCount(
+    "branch-select-min-count", cl::init(1000),
+    cl::desc("Fewest executions a profiled branch needs to be found unpredictable"));
+
+static cl::opt<unsigned> MaxSelectCost(
+    "branch-select-max-cost", cl::init(8),
+    cl::desc("Largest cost, in size-and-latency units, of the instructions of both arms "
+             "of a branch converted to selects, counting one per select"));
+
+static cl::opt<bool> StaticMode(
+    "branch-select-static", cl::init(false),
+    cl::desc("Without a profile, convert the branches of loops on data loaded per iteration"));
+
+bool llvm::branchToSelectStatic() { return StaticMode; }
+
+namespace {
+
+// A branch of Head whose two ways meet again in Join, through at most one
+// arm block each. A missing arm is the edge from Head straight to Join.
+struct Hammock {
+    BranchInst *BI;
+    BasicBlock *Arm[2] = {nullptr, nullptr}; // the true and the false way
+    BasicBlock *Join = nullptr;
+
+    BasicBlock *from(unsigned Way) const { return Arm[Way] ? Arm[Way] : BI->getParent(); }
+};
+
+// An arm block: only entered from Head, falling through to its successor
+bool isArm(BasicBlock *BB, BasicBlock *Head) {
+    return BB != Head && BB->getSinglePredecessor() == Head && BB->getSingleSuccessor() &&
+           !isa<PHINode>(BB->front());
+}
+
+std::optional<Hammock> findHammock(BranchInst *BI) {
+    BasicBlock *Head = BI->getParent();
+    BasicBlock *True = BI->getSuccessor(0), *False = BI->getSuccessor(1);
+    if (True == False)
+        return std::nullopt;
+    Hammock H{BI};
+    if (isArm(True, Head) && isArm(False, Head) &&
+        True->getSingleSuccessor() == False->getSingleSuccessor()) {
+        H.Arm[0] = True;
+        H.Arm[1] = False;
+        H.Join = True->getSingleSuccessor();
+    } else if (isArm(True, Head) && True->getSingleSuccessor() == False) {
+        H.Arm[0] = True;
+        H.Join = False;
+    } else if (isArm(False, Head) && False->getSingleSuccessor() == True) {
+        H.Arm[1] = False;
+        H.Join = True;
+    } else {
+        return std::nullopt;
+    }
+    if (H.Join == Head || H.Join == H.Arm[0] || H.Join == H.Arm[1])
+        return std::nullopt;
+    return H;
+}
+
+// Cost of running both arms and the selects unconditionally, or nothing if
+// an arm has side effects or cannot run when its way is not taken
+std::optional<InstructionCost> selectCost(const Hammock &H, const TargetTransformInfo &TTI) {
+    InstructionCost Cost = 0;
+    for (BasicBlock *Arm : H.Arm) {
+        if (!Arm)
+            continue;
+        for (Instruction &I : *Arm) {
+            if (I.isTerminator() || I.isDebugOrPseudoInst())
+                continue;
+            if (!isSafeToSpeculativelyExecute(&I, H.BI) || I.mayHaveSideEffects())
+                return std::nullopt;
+            Cost += TTI.getInstructionCost(&I, TargetTransformInfo::TCK_SizeAndLatency);
+        }
+    }
+    for (PHINode &Phi : H.Join->phis())
+        if (Phi.getIncomingValueForBlock(H.from(0)) != Phi.getIncomingValueForBlock(H.from(1)))
+            Cost += 1;
+    return Cost;
+}
+
+// Whether the condition of a branch in loop L depends, within a few steps
+// and without going through a phi, on a load from an address that changes
+// from one iteration to the next
+bool dependsOnLoadedData(Value *Cond, const Loop &L) {
+    SmallVector<Value *, 8> Worklist{Cond};
+    SmallPtrSet<Value *, 16> Seen;
+    while (!Worklist.empty() && Seen.size() < 16) {
+        auto *I = dyn_cast<Instruction>(Worklist.pop_back_val());
+        if (!I || !L.contains(I) || isa<PHINode>(I) || !Seen.insert(I).second)
+            continue;
+        if (auto *Load = dyn_cast<LoadInst>(I)) {
+            if (!L.isLoopInvariant(Load->getPointerOperand()))
+                return true;
+            continue;
+        }
+        append_range(Worklist, I->operands());
+    }
+    return false;
+}
+
+// Static heuristic: a branch inside a loop on data loaded per iteration,
+// which its branch weights, if any, do not show to be biased
+bool looksUnpredictable(const Hammock &H, const LoopInfo &LI) {
+    const Loop *L = LI.getLoopFor(H.BI->getParent());
+    if (!L || !L->contains(H.Join) || L->isLoopInvariant(H.BI->getCondition()) ||
+        !dependsOnLoadedData(H.BI->getCondition(), *L))
+        return false;
+    uint64_t True, False;
+    if (extractBranchWeights(*H.BI, True, False) && True + False &&
+        std::min(True, False) * 100 < (True + False) * MinMispredict)
+        return false;
+    return true;
+}
+
+void convert(const Hammock &H) {
+    BranchInst *BI = H.BI;
+    BasicBlock *Head = BI->getParent();
+    LLVMContext &Ctx = BI->getContext();
+    MDNode *Unpredictable = MDNode::get(Ctx, {});
+    for (BasicBlock *Arm : H.Arm) {
+        if (!Arm)
+            continue;
+        for (Instruction &I : make_early_inc_range(*Arm)) {
+            if (I.isTerminator() || I.isDebugOrPseudoInst())
+                continue;
+            // It now also runs when its way is not taken
+            I.dropUBImplyingAttrsAndMetadata();
+            I.moveBefore(BI);
+        }
+    }
+
+    IRBuilder<> Builder(BI);
+    for (PHINode &Phi : H.Join->phis()) {
+        Value *True = Phi.getIncomingValueForBlock(H.from(0));
+        Value *False = Phi.getIncomingValueForBlock(H.from(1));
+        Value *V = True;
+        if (True != False) {
+            auto *Select = cast<SelectInst>(
+                Builder.CreateSelect(BI->getCondition(), True, False, Phi.getName() + ".sel"));
+            Select->copyMetadata(*BI, {LLVMContext::MD_prof});
+            Select->setMetadata(LLVMContext::MD_unpredictable, Unpredictable);
+            V = Select;
+        }
+        for (BasicBlock *Arm : H.Arm)
+            if (Arm)
+                Phi.removeIncomingValue(Arm, /*DeletePHIIfEmpty=*/false);
+        if (Phi.getBasicBlockIndex(Head) >= 0)
+            Phi.setIncomingValueForBlock(Head, V);
+        else
+            Phi.addIncoming(V, Head);
+    }
+    Builder.CreateBr(H.Join);
+    BI->eraseFromParent();
+    for (BasicBlock *Arm : H.Arm)
+        if (Arm)
+            Arm->eraseFromParent();
+}
+
+} // namespace
+
+PreservedAnalyses BranchPredictability::run(Module &M, ModuleAnalysisManager &) {
+    const ProfileData *PD = ProfileData::get();
+    if (!PD)
+        return PreservedAnalyses::all();
+
+    LLVMContext &Ctx = M.getContext();
+    MDBuilder MDB(Ctx);
+    unsigned Profiled = 0, Unpredictable = 0;
+    for (Function &F : M) {
+        if (F.isDeclaration())
+            continue;
+        std::string Name = profileName(F);
+        if (!PD->hasFunction("branch", Name))
+            continue;
+        for (auto [Site, BI] : enumerate(profiledBranches(F))) {
+            uint64_t True = 0, False = 0, Misses = 0;
+            for (const ProfileData::Record &R : PD->lookup("branch", Name, Site)) {
+                if (R.Value == "true")
+                    True = R.Count;
+                else if (R.Value == "false")
+                    False = R.Count;
+                else if (R.Value == "miss")
+                    Misses = R.Count;
+            }
+            uint64_t Count = True + False;
+            if (!Count)
+                continue;
+            BI->setMetadata(LLVMContext::MD_prof,
+                            MDB.createBranchWeights(clampWeight(True), clampWeight(False)));
+            ++Profiled;
+            if (Count >= MinBranchCount && Misses * 100 >= Count * MinMispredict) {
+                BI->setMetadata(LLVMContext::MD_unpredictable, MDNode::get(Ctx, {}));
+                ++Unpredictable;
+            }
+        }
+    }
+
+    errs() << "branch-predictability: " << M.getModuleIdentifier() << ": " << Unpredictable
+           << " of " << Profiled << " profiled branches mispredict at least " << MinMispredict
+           << "%\n";
+    return Profiled ? PreservedAnalyses::none() : PreservedAnalyses::all();
+}
+
+PreservedAnalyses BranchToSelect::run(Function &F, FunctionAnalysisManager &FAM) {
+    // With a profile, only the branches it found unpredictable are converted
+    bool Profiled = ProfileData::get();
+    auto &TTI = FAM.getResult<TargetIRAnalysis>(F);
+    auto &LI = FAM.getResult<LoopAnalysis>(F);
+
+    SmallVector<Hammock, 8> Candidates;
+    for (BasicBlock &BB : F) {
+        auto *BI = dyn_cast<BranchInst>(BB.getTerminator());
+        if (!BI || !BI->isConditional())
+            continue;
+        std::optional<Hammock> H = findHammock(BI);
+        if (!H)
+            continue;
+        bool Unpredictable = BI->getMetadata(LLVMContext::MD_unpredictable) ||
+                             (!Profiled && looksUnpredictable(*H, LI));
+        if (!Unpredictable)
+            continue;
+        std::optional<InstructionCost> Cost = selectCost(*H, TTI);
+        if (Cost && *Cost <= MaxSelectCost)
+            Candidates.push_back(*H);
+    }
+    // Arms end in unconditional branches, so converting one candidate
+    // never erases the block of another
+    for (const Hammock &H : Candidates)
+        convert(H);
+
+    if (Candidates.empty())
+        return PreservedAnalyses::all();
+    errs() << "branch-to-select: " << F.getName() << ": " << Candidates.size()
+           << " branches converted to selects (" << (Profiled ? "profile" : "static") << ")\n";
+    return PreservedAnalyses::none();
+}
@@ -0,0 +1,43 @@
+//===- BranchToSelect.h - Turn unpredictable branches into selects --------===//
+//
+// A branch that follows random data, such as the "arr[i] > max" test of
+// findMax in test_hello.c, mispredicts about every other time, and each
+// misprediction costs some 15-20 cycles. When both ways only compute a few
+// values without side effects, computing both and picking one with a select
+// (a cmov on x86) is cheaper.
+//
+// BranchPredictability reads the branch profile (see BranchBiasProfile.h):
+// it gives each profiled branch its branch weights and marks those whose
+// estimated misprediction rate reaches -branch-select-min-mispredict as
+// !unpredictable. BranchToSelect then converts the unpredictable branches
+// whose arms are small enough. Without a profile, it instead converts the
+// branches inside loops whose condition depends on data loaded from memory
+// that changes per iteration, unless their branch weights say they are
+// biased; the pipeline only runs it so with -branch-select-static.
+//
+// The selects are !unpredictable too, so that the backend does not turn
+// them back into branches.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_BRANCHTOSELECT_H
+#define TUTORIAL_LLVM_PASS_BRANCHTOSELECT_H
+
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+struct BranchPredictability : PassInfoMixin<BranchPredictability> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+struct BranchToSelect : PassInfoMixin<BranchToSelect> {
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM);
+};
+
+// Whether BranchToSelect runs without a profile, from -branch-select-static
+bool branchToSelectStatic();
+
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_BRANCHTOSELECT_H
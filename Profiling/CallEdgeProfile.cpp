@@ -0,0 +1,45 @@
+#include "CallEdgeProfile.h"
+#include "FunctionControls.h"
+#include "Instrumentation.h"
+
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+
+using namespace llvm;
+using namespace llvm::profiling;
+
+SmallVector<CallBase *, 16> llvm::profiledCallSites(Function &F) {
+    SmallVector<CallBase *, 16> Sites;
+    for (BasicBlock &BB : F)
+        for (Instruction &I : BB)
+            if (auto *CB = dyn_cast<CallBase>(&I))
+                if (Function *Callee = CB->getCalledFunction())
+                    if (!Callee->isIntrinsic())
+                        Sites.push_back(CB);
+    return Sites;
+}
+
+PreservedAnalyses CallEdgeProfile::run(Module &M, ModuleAnalysisManager &MAM) {
+    auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    LLVMContext &Ctx = M.getContext();
+    StringTable Strings(M);
+    SmallVector<Constant *, 64> Records;
+    SmallVector<CallBase *, 64> Counted;
+    for (Function &F : M) {
+        if (F.isDeclaration() || !FAM.getResult<FunctionControlsAnalysis>(F).counted())
+            continue;
+        Constant *Caller = Strings.get(profileName(F));
+        for (auto [Site, CB] : enumerate(profiledCallSites(F))) {
+            Constant *Callee = Strings.get(profileName(*CB->getCalledFunction()));
+            Records.push_back(siteRecord(Ctx, Caller, Callee, Site));
+            Counted.push_back(CB);
+        }
+    }
+    if (Records.empty())
+        return PreservedAnalyses::all();
+
+    GlobalVariable *Table = createSiteTable(M, Strings, "call", Records);
+    for (auto [Index, CB] : enumerate(Counted))
+        incrementCounter(CB, Table, Index);
+    return PreservedAnalyses::none();
+}
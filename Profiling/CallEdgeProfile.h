@@ -0,0 +1,30 @@
+//===- CallEdgeProfile.h - Count the calls of every direct call site ------===//
+//
+// Instrumentation: each direct call site of a function counts how often it
+// runs, recorded as "call caller site callee count". It is meant to be a
+// much lighter workflow than -fprofile-instr-generate: one counter per call
+// site and no CFG counters.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_CALLEDGEPROFILE_H
+#define TUTORIAL_LLVM_PASS_CALLEDGEPROFILE_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+// The call sites of F the profile numbers, in order: direct calls of
+// functions other than intrinsics. Instrumentation and use must both see
+// F as it is at the start of the pipeline.
+SmallVector<CallBase *, 16> profiledCallSites(Function &F);
+
+struct CallEdgeProfile : PassInfoMixin<CallEdgeProfile> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_CALLEDGEPROFILE_H
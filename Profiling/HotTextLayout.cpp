@@ -0,0 +1,106 @@
+#include "HotTextLayout.h"
+#include "Instrumentation.h"
+#include "ProfileData.h"
+
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+using namespace llvm::profiling;
+
+static cl::opt<unsigned> HotTextPercent(
+    "hot-text-percent", cl::init(99),
+    cl::desc("Functions placed in the hot text: those making or receiving as many calls as "
+             "the hottest call sites that make up this percentage of all profiled calls"));
+
+namespace {
+
+const char *const HotSection = ".text.hot";
+const uint64_t HugePage = 2 << 20;
+
+// The empty function that starts the group of hot text, kept once by the
+// linker: the first in the module, so that it comes before the hot
+// functions of the module
+Function *groupStart(Module &M) {
+    const char *Name = "__sr_hot_text_begin";
+    if (Function *F = M.getFunction(Name))
+        return F;
+    LLVMContext &Ctx = M.getContext();
+    auto *F = Function::Create(FunctionType::get(Type::getVoidTy(Ctx), false),
+                               GlobalValue::LinkOnceODRLinkage, Name);
+    M.getFunctionList().push_front(F);
+    F->setVisibility(GlobalValue::HiddenVisibility);
+    F->setComdat(M.getOrInsertComdat(Name));
+    F->setSection(HotSection);
+    F->setAlignment(Align(HugePage));
+    F->addFnAttr(Attribute::NoInline);
+    F->addFnAttr(Attribute::NoUnwind);
+    ReturnInst::Create(Ctx, BasicBlock::Create(Ctx, "", F));
+    return F;
+}
+
+// The constructor that moves the group once all the modules of the
+// executable or library have registered theirs with priority 0. Its
+// .init_array entry is in its COMDAT, so that it runs once per executable
+// or library, when it is loaded, dlopen included.
+void groupMove(Module &M, Function *Start) {
+    const char *Name = "__sr_hot_text_move";
+    if (M.getFunction(Name))
+        return;
+    LLVMContext &Ctx = M.getContext();
+    auto *F = Function::Create(FunctionType::get(Type::getVoidTy(Ctx), false),
+                               GlobalValue::LinkOnceODRLinkage, Name, M);
+    F->setVisibility(GlobalValue::HiddenVisibility);
+    F->setComdat(M.getOrInsertComdat(Name));
+    IRBuilder<> Builder(BasicBlock::Create(Ctx, "", F));
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    FunctionCallee Remap =
+        M.getOrInsertFunction("__sr_hot_text_remap", Type::getVoidTy(Ctx), Ptr);
+    Builder.CreateCall(Remap, {Start});
+    Builder.CreateRetVoid();
+    appendToGlobalCtors(M, F, /*Priority=*/101, /*Data=*/F);
+}
+
+} // namespace
+
+PreservedAnalyses HotTextLayout::run(Module &M, ModuleAnalysisManager &) {
+    const ProfileData *PD = ProfileData::get();
+    if (!PD || !PD->total("call"))
+        return PreservedAnalyses::all();
+
+    uint64_t HotCount = PD->hotCount("call", HotTextPercent);
+    unsigned Defined = 0, Hot = 0;
+    Function *Last = nullptr;
+    for (Function &F : M) {
+        if (F.isDeclaration() || F.hasAvailableExternallyLinkage())
+            continue;
+        ++Defined;
+        std::string Name = profileName(F);
+        if (F.hasSection() || std::max(PD->functionTotal("call", Name),
+                                       PD->valueTotal("call", Name)) < HotCount)
+            continue;
+        F.setSection(HotSection);
+        Last = &F;
+        ++Hot;
+    }
+
+    errs() << "hot-text-layout: " << M.getModuleIdentifier() << ": " << Hot << " of "
+           << Defined << " functions placed in " << HotSection << "\n";
+    if (!Hot)
+        return PreservedAnalyses::all();
+
+    LLVMContext &Ctx = M.getContext();
+    auto *Ctor = Function::Create(FunctionType::get(Type::getVoidTy(Ctx), false),
+                                  GlobalValue::InternalLinkage, "sr.register.hottext", M);
+    IRBuilder<> Builder(BasicBlock::Create(Ctx, "", Ctor));
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    FunctionCallee Register =
+        M.getOrInsertFunction("__sr_hot_text_register", Type::getVoidTy(Ctx), Ptr, Ptr);
+    Function *Start = groupStart(M);
+    Builder.CreateCall(Register, {Start, Last});
+    Builder.CreateRetVoid();
+    appendToGlobalCtors(M, Ctor, /*Priority=*/0);
+    groupMove(M, Start);
+    return PreservedAnalyses::none();
+}
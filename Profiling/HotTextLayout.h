@@ -0,0 +1,33 @@
+//===- HotTextLayout.h - Group hot functions for huge text pages ----------===//
+//
+// With the call-edge profile, places the hot functions of the module, those
+// that make or receive at least as many calls as a hot call site, in the
+// .text.hot section, which the GNU linkers gather at the start of .text
+// for all objects. Every module with hot functions also defines, in the
+// same COMDAT, an empty function aligned to 2 MB, emitted first: the
+// linker keeps the one of the first object, so that the group starts on a
+// huge page boundary, with a single padding.
+//
+// A constructor registers the start of the group and the last hot function
+// of the module with the runtime (see runtime/HotText.c). Another, in a
+// COMDAT, runs once per executable or library after all of these and has
+// the runtime copy the 2 MB pages of the group to an anonymous mapping
+// backed by transparent huge pages and move it over the original text, so
+// that the hot code is covered by a few i-TLB entries.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_HOTTEXTLAYOUT_H
+#define TUTORIAL_LLVM_PASS_HOTTEXTLAYOUT_H
+
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+struct HotTextLayout : PassInfoMixin<HotTextLayout> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_HOTTEXTLAYOUT_H
@@ -0,0 +1,97 @@
+#include "IOProfile.h"
+#include "FunctionControls.h"
+#include "Instrumentation.h"
+
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+
+using namespace llvm;
+using namespace llvm::profiling;
+
+namespace {
+
+// The runtime wrapper of an I/O function; with _FILE_OFFSET_BITS=64, pread
+// and pwrite are called by their 64-bit names
+StringRef wrapperOf(StringRef Callee) {
+    return StringSwitch<StringRef>(Callee)
+        .Case("read", "__sr_io_read")
+        .Case("write", "__sr_io_write")
+        .Cases("pread", "pread64", "__sr_io_pread")
+        .Cases("pwrite", "pwrite64", "__sr_io_pwrite")
+        .Case("recv", "__sr_io_recv")
+        .Case("send", "__sr_io_send")
+        .Case("fread", "__sr_io_fread")
+        .Case("fwrite", "__sr_io_fwrite")
+        .Case("printf", "__sr_io_printf")
+        .Case("fprintf", "__sr_io_fprintf")
+        .Case("puts", "__sr_io_puts")
+        .Case("fputs", "__sr_io_fputs")
+        .Case("putchar", "__sr_io_putchar")
+        .Case("fputc", "__sr_io_fputc")
+        .Default("");
+}
+
+} // namespace
+
+PreservedAnalyses IOProfile::run(Module &M, ModuleAnalysisManager &MAM) {
+    auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    LLVMContext &Ctx = M.getContext();
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    auto *I64 = Type::getInt64Ty(Ctx);
+    // struct sr_io_site { const char *Function, *Location, *Call;
+    //                     uint64_t Calls, Asked, Done, Short, Errors, Ns, MaxNs;
+    //                     uint64_t Sizes[IOSizeBuckets]; }
+    auto *SizesTy = ArrayType::get(I64, IOSizeBuckets);
+    auto *SiteTy =
+        StructType::get(Ctx, {Ptr, Ptr, Ptr, I64, I64, I64, I64, I64, I64, I64, SizesTy});
+    StringTable Strings(M);
+
+    SmallVector<Constant *, 16> Records;
+    SmallVector<std::pair<CallInst *, StringRef>, 16> Calls;
+    for (Function &F : M) {
+        if (F.isDeclaration() || !FAM.getResult<FunctionControlsAnalysis>(F).timed())
+            continue;
+        Constant *Name = Strings.get(profileName(F));
+        unsigned Site = 0;
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : BB) {
+                auto *Call = dyn_cast<CallInst>(&I);
+                Function *Callee = Call ? Call->getCalledFunction() : nullptr;
+                if (!Callee || !Callee->isDeclaration())
+                    continue;
+                StringRef Wrapper = wrapperOf(Callee->getName());
+                if (Wrapper.empty())
+                    continue;
+                Calls.push_back({Call, Wrapper});
+                SmallVector<Constant *, 11> Fields = {Name, Strings.get(location(I, Site)),
+                                                      Strings.get(Callee->getName())};
+                Fields.append(7, ConstantInt::get(I64, 0));
+                Fields.push_back(Constant::getNullValue(SizesTy));
+                Records.push_back(ConstantStruct::get(SiteTy, Fields));
+                ++Site;
+            }
+        }
+    }
+    if (Calls.empty())
+        return PreservedAnalyses::all();
+
+    auto *TableTy = ArrayType::get(SiteTy, Records.size());
+    auto *Table = new GlobalVariable(M, TableTy, /*isConstant=*/false, GlobalValue::PrivateLinkage,
+                                     ConstantArray::get(TableTy, Records), ".sr.io");
+    for (auto [Index, C] : enumerate(Calls)) {
+        auto [Call, Wrapper] = C;
+        redirectCall(Call, Wrapper,
+                     IRBuilder<>(Call).CreateConstInBoundsGEP2_32(TableTy, Table, 0, Index));
+    }
+
+    auto *Ctor = Function::Create(FunctionType::get(Type::getVoidTy(Ctx), false),
+                                  GlobalValue::InternalLinkage, "sr.register.io", M);
+    IRBuilder<> Builder(BasicBlock::Create(Ctx, "", Ctor));
+    FunctionCallee Register = M.getOrInsertFunction("__sr_io_register", Type::getVoidTy(Ctx), Ptr,
+                                                    Type::getInt32Ty(Ctx));
+    Builder.CreateCall(Register, {Table, Builder.getInt32(Records.size())});
+    Builder.CreateRetVoid();
+    appendToGlobalCtors(M, Ctor, /*Priority=*/0);
+    return PreservedAnalyses::none();
+}
@@ -0,0 +1,34 @@
+//===- IOProfile.h - Profile the I/O calls of each site -------------------===//
+//
+// Instrumentation: each call of read, write, pread, pwrite, send, recv,
+// fread and fwrite, and of the stdio output functions printf, fprintf,
+// puts, fputs, putchar and fputc, becomes a call of a runtime wrapper,
+// given the record of its site (see runtime/IOProfile.c). The wrapper times
+// the call and counts, in the record, the bytes asked for and done, short
+// reads and writes, errors, and a histogram of the request sizes. At exit,
+// the runtime reports the sites, and points out those that do many tiny
+// requests, which buffering or batching would turn into fewer, larger ones.
+//
+// It runs at the end of the optimization pipeline, once printf calls have
+// been simplified into puts and putchar where they can be.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_IOPROFILE_H
+#define TUTORIAL_LLVM_PASS_IOPROFILE_H
+
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+// Buckets of the request size histogram of a site; must match
+// SR_IO_BUCKETS in runtime/IOProfile.c
+constexpr unsigned IOSizeBuckets = 32;
+
+struct IOProfile : PassInfoMixin<IOProfile> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_IOPROFILE_H
@@ -0,0 +1,80 @@
+#include "IndirectCallProfile.h"
+#include "FunctionControls.h"
+#include "Instrumentation.h"
+
+#include "llvm/IR/Module.h"
+
+using namespace llvm;
+using namespace llvm::profiling;
+
+SmallVector<CallBase *, 8> llvm::profiledIndirectCalls(Function &F) {
+    SmallVector<CallBase *, 8> Sites;
+    for (BasicBlock &BB : F)
+        for (Instruction &I : BB)
+            if (auto *CB = dyn_cast<CallBase>(&I))
+                if (CB->isIndirectCall())
+                    Sites.push_back(CB);
+    return Sites;
+}
+
+PreservedAnalyses IndirectCallProfile::run(Module &M, ModuleAnalysisManager &MAM) {
+    auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    LLVMContext &Ctx = M.getContext();
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    auto *I32 = Type::getInt32Ty(Ctx);
+    auto *I64 = Type::getInt64Ty(Ctx);
+    // struct sr_icall_site { const char *Function; uint32_t Site; uint64_t Other;
+    //                        struct { void *Target; uint64_t Count; } Top[ICallTopK]; }
+    auto *TopTy = ArrayType::get(StructType::get(Ptr, I64), ICallTopK);
+    auto *SiteTy = StructType::get(Ptr, I32, I64, TopTy);
+    StringTable Strings(M);
+
+    SmallVector<Constant *, 16> Records;
+    SmallVector<CallBase *, 16> Counted;
+    for (Function &F : M) {
+        if (F.isDeclaration() || !FAM.getResult<FunctionControlsAnalysis>(F).counted())
+            continue;
+        Constant *Name = Strings.get(profileName(F));
+        for (auto [Site, CB] : enumerate(profiledIndirectCalls(F))) {
+            Records.push_back(ConstantStruct::get(SiteTy, Name, ConstantInt::get(I32, Site),
+                                                  ConstantInt::get(I64, 0),
+                                                  Constant::getNullValue(TopTy)));
+            Counted.push_back(CB);
+        }
+    }
+    if (Records.empty())
+        return PreservedAnalyses::all();
+
+    auto *TableTy = ArrayType::get(SiteTy, Records.size());
+    auto *Table = new GlobalVariable(M, TableTy, /*isConstant=*/false, GlobalValue::PrivateLinkage,
+                                     ConstantArray::get(TableTy, Records), ".sr.icall");
+    FunctionCallee Record =
+        M.getOrInsertFunction("__sr_profile_icall", Type::getVoidTy(Ctx), Ptr, Ptr);
+    for (auto [Index, CB] : enumerate(Counted)) {
+        IRBuilder<> Builder(CB);
+        Value *Site = Builder.CreateConstInBoundsGEP2_32(TableTy, Table, 0, Index);
+        Builder.CreateCall(Record, {Site, CB->getCalledOperand()});
+    }
+
+    // Names of the functions that may be targets, for the runtime
+    auto *NameTy = StructType::get(Ptr, Ptr);
+    SmallVector<Constant *, 16> Names;
+    for (Function &F : M)
+        if (!F.isDeclaration() && F.hasAddressTaken())
+            Names.push_back(ConstantStruct::get(NameTy, &F, Strings.get(profileName(F))));
+    auto *NamesTy = ArrayType::get(NameTy, Names.size());
+    auto *NameTable = new GlobalVariable(M, NamesTy, /*isConstant=*/true,
+                                         GlobalValue::PrivateLinkage,
+                                         ConstantArray::get(NamesTy, Names), ".sr.names");
+
+    auto *Ctor = Function::Create(FunctionType::get(Type::getVoidTy(Ctx), false),
+                                  GlobalValue::InternalLinkage, "sr.register.icall", M);
+    IRBuilder<> Builder(BasicBlock::Create(Ctx, "", Ctor));
+    FunctionCallee Register = M.getOrInsertFunction("__sr_profile_register_icalls",
+                                                    Type::getVoidTy(Ctx), Ptr, I32, Ptr, I32);
+    Builder.CreateCall(Register, {Table, Builder.getInt32(Records.size()), NameTable,
+                                  Builder.getInt32(Names.size())});
+    Builder.CreateRetVoid();
+    appendToGlobalCtors(M, Ctor, /*Priority=*/0);
+    return PreservedAnalyses::none();
+}
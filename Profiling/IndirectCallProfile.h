@@ -0,0 +1,33 @@
+//===- IndirectCallProfile.h - Record the targets of indirect calls -------===//
+//
+// Instrumentation: before each indirect call, the runtime is told the target
+// it is about to call. Each site keeps the first ICallTopK distinct targets
+// with their counts in a lock-free table, and counts the calls to any other
+// target together; it is recorded as "icall function site target count",
+// "*" standing for the other targets. Address-taken functions are registered
+// with their names, so that the runtime can name the targets.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_INDIRECTCALLPROFILE_H
+#define TUTORIAL_LLVM_PASS_INDIRECTCALLPROFILE_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+// Targets kept per site; must match SR_ICALL_TOP_K in ProfileRuntime.c
+constexpr unsigned ICallTopK = 4;
+
+// The indirect call sites of F the profile numbers, in order
+SmallVector<CallBase *, 8> profiledIndirectCalls(Function &F);
+
+struct IndirectCallProfile : PassInfoMixin<IndirectCallProfile> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_INDIRECTCALLPROFILE_H
@@ -0,0 +1,80 @@
+#include "IndirectCallPromotion.h"
+#include "IndirectCallProfile.h"
+#include "Instrumentation.h"
+#include "ProfileData.h"
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/CallPromotionUtils.h"
+
+using namespace llvm;
+using namespace llvm::profiling;
+
+static cl::opt<unsigned> ICPMaxTargets(
+    "icp-max-targets", cl::init(2),
+    cl::desc("Most targets promoted at one indirect call site"));
+
+static cl::opt<unsigned> ICPMinPercent(
+    "icp-min-percent", cl::init(30),
+    cl::desc("Share of the remaining calls of a site a target needs to be promoted"));
+
+static cl::opt<unsigned> ICPMinCount(
+    "icp-min-count", cl::init(1000),
+    cl::desc("Fewest calls a target needs to be promoted"));
+
+PreservedAnalyses IndirectCallPromotion::run(Module &M, ModuleAnalysisManager &) {
+    const ProfileData *PD = ProfileData::get();
+    if (!PD)
+        return PreservedAnalyses::all();
+
+    // Targets are named as the instrumentation named them
+    StringMap<Function *> ByName;
+    for (Function &F : M)
+        ByName[profileName(F)] = &F;
+
+    MDBuilder MDB(M.getContext());
+    unsigned Sites = 0, Promoted = 0;
+    for (Function &F : M) {
+        if (F.isDeclaration())
+            continue;
+        std::string Name = profileName(F);
+        if (!PD->hasFunction("icall", Name))
+            continue;
+        for (auto [Site, CB] : enumerate(profiledIndirectCalls(F))) {
+            ArrayRef<ProfileData::Record> Targets = PD->lookup("icall", Name, Site);
+            uint64_t Remaining = 0;
+            for (const ProfileData::Record &R : Targets)
+                Remaining += R.Count;
+            bool Changed = false;
+            for (const ProfileData::Record &R : Targets.take_front(ICPMaxTargets)) {
+                if (R.Count < ICPMinCount || R.Count * 100 < Remaining * ICPMinPercent)
+                    break;
+                Function *Target = ByName.lookup(R.Value);
+                if (!Target || !isLegalToPromote(*CB, Target))
+                    continue;
+                // The compare goes to the direct call R.Count times out of
+                // Remaining; the indirect call keeps the rest
+                MDNode *Weights = MDB.createBranchWeights(clampWeight(R.Count),
+                                                          clampWeight(Remaining - R.Count));
+                CallBase &Direct = promoteCallWithIfThenElse(*CB, Target, Weights);
+                Direct.setMetadata(LLVMContext::MD_prof,
+                                   MDB.createBranchWeights(clampWeight(R.Count)));
+                Remaining -= R.Count;
+                ++Promoted;
+                Changed = true;
+            }
+            if (Changed) {
+                CB->setMetadata(LLVMContext::MD_prof,
+                                MDB.createBranchWeights(clampWeight(Remaining)));
+                ++Sites;
+            }
+        }
+    }
+
+    errs() << "indirect-call-promotion: " << M.getModuleIdentifier() << ": " << Promoted
+           << " targets promoted at " << Sites << " call sites\n";
+    return Promoted ? PreservedAnalyses::none() : PreservedAnalyses::all();
+}
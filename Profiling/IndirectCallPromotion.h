@@ -0,0 +1,28 @@
+//===- IndirectCallPromotion.h - Promote hot indirect call targets --------===//
+//
+// With the indirect call target profile, rewrites an indirect call whose
+// profile is dominated by a few targets into
+//
+//   if (fp == hot_target) hot_target(...); else fp(...);
+//
+// with branch weights from the counts, so that the direct call can be
+// inlined and optimized further. Up to -icp-max-targets targets are
+// promoted per site, each taking at least -icp-min-percent of the calls
+// still left.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_INDIRECTCALLPROMOTION_H
+#define TUTORIAL_LLVM_PASS_INDIRECTCALLPROMOTION_H
+
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+struct IndirectCallPromotion : PassInfoMixin<IndirectCallPromotion> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_INDIRECTCALLPROMOTION_H
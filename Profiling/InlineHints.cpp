@@ -0,0 +1,169 @@
+#include "InlineHints.h"
+#include "CallEdgeProfile.h"
+#include "Instrumentation.h"
+#include "ProfileData.h"
+
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/ProfileData/ProfileCommon.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+
+using namespace llvm;
+using namespace llvm::profiling;
+
+static cl::opt<unsigned> HotCallPercent(
+    "inline-hint-hot-percent", cl::init(90),
+    cl::desc("Call sites counted as very hot: the hottest ones of the program that "
+             "make up this percentage of all profiled calls"));
+
+static cl::opt<unsigned> InlineHintMaxSize(
+    "inline-hint-max-size", cl::init(50),
+    cl::desc("Largest callee, in instructions, forced inline at a very hot call site"));
+
+static cl::opt<unsigned> InlineHintGrowth(
+    "inline-hint-growth", cl::init(10),
+    cl::desc("Code growth allowed for forced inlining, in percent of the module's "
+             "instructions"));
+
+static cl::opt<unsigned> ColdCallMinSize(
+    "inline-hint-cold-min-size", cl::init(10),
+    cl::desc("Smallest callee, in instructions, kept out of line at a call site that "
+             "never ran; smaller ones are cheaper inlined"));
+
+namespace {
+
+struct ProfiledCall {
+    CallBase *CB;
+    Function *Callee;
+    uint64_t Count;
+};
+
+// The calls a function received from profiled call sites. Calls from code
+// that was not instrumented are missing, so 0 does not mean the function
+// never ran.
+uint64_t entryCount(const ProfileData &PD, StringRef Name) {
+    return PD.valueTotal("call", Name) + PD.valueTotal("icall", Name);
+}
+
+// A function that no profiled call reaches, such as main or a callback from
+// a library, gets the entry count that makes the block frequencies agree with
+// the count of its hottest call site
+uint64_t estimatedEntryCount(BlockFrequencyInfo &BFI, CallBase &CB, uint64_t Count) {
+    uint64_t Freq = BFI.getBlockFreq(CB.getParent()).getFrequency();
+    if (!Freq)
+        return 1;
+    return std::max<uint64_t>(1, double(Count) * BFI.getEntryFreq() / Freq);
+}
+
+} // namespace
+
+PreservedAnalyses InlineHints::run(Module &M, ModuleAnalysisManager &MAM) {
+    const ProfileData *PD = ProfileData::get();
+    if (!PD)
+        return PreservedAnalyses::all();
+
+    // The inliner only trusts counts when the module has a profile summary,
+    // and derives the count of a call site from the entry count of its
+    // function. A module that already has a profile keeps it.
+    bool SetCounts = !M.getProfileSummary(/*IsCS=*/false);
+    InstrProfSummaryBuilder Summary(ProfileSummaryBuilder::DefaultCutoffs);
+    FunctionAnalysisManager &FAM =
+        MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    MDBuilder MDB(M.getContext());
+    SmallVector<ProfiledCall, 64> Calls;
+    unsigned ModuleSize = 0, Cold = 0, Counted = 0;
+    bool Weighted = false;
+    for (Function &F : M) {
+        if (F.isDeclaration())
+            continue;
+        ModuleSize += F.getInstructionCount();
+        std::string Caller = profileName(F);
+        // The first count of a record is the entry count, the others are
+        // the counts of its call sites
+        std::vector<uint64_t> Counts{entryCount(*PD, Caller)};
+        CallBase *Hottest = nullptr;
+        uint64_t HottestCount = 0;
+        // Sites of functions that made no profiled call stay as they are:
+        // they may not have been counted at all
+        bool Ran = PD->hasFunction("call", Caller);
+        SmallVector<CallBase *, 16> Sites;
+        if (Ran)
+            Sites = profiledCallSites(F);
+        for (auto [Site, CB] : enumerate(Sites)) {
+            Function *Callee = CB->getCalledFunction();
+            ArrayRef<ProfileData::Record> Records = PD->lookup("call", Caller, Site);
+            // A different callee means the source changed since profiling
+            if (!Records.empty() && Records.front().Value != profileName(*Callee))
+                continue;
+            uint64_t Count = Records.empty() ? 0 : Records.front().Count;
+            if (SetCounts) {
+                CB->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(clampWeight(Count)));
+                Counts.push_back(Count);
+                Weighted = true;
+            }
+            if (Count > HottestCount) {
+                Hottest = CB;
+                HottestCount = Count;
+            }
+            if (Count) {
+                Calls.push_back({CB, Callee, Count});
+            } else if (!Callee->isDeclaration() &&
+                       !Callee->hasFnAttribute(Attribute::AlwaysInline) &&
+                       Callee->getInstructionCount() >= ColdCallMinSize) {
+                CB->setIsNoInline();
+                ++Cold;
+            }
+        }
+        if (!SetCounts || (!Counts.front() && !Ran))
+            continue;
+        if (!Counts.front() && Hottest)
+            Counts.front() = estimatedEntryCount(FAM.getResult<BlockFrequencyAnalysis>(F),
+                                                 *Hottest, HottestCount);
+        if (Counts.front()) {
+            F.setEntryCount(Counts.front());
+            ++Counted;
+        }
+        Summary.addRecord(InstrProfRecord(std::move(Counts)));
+    }
+    if (SetCounts && Counted) {
+        M.setProfileSummary(Summary.getSummary()->getMD(M.getContext()),
+                            ProfileSummary::PSK_Instr);
+        // Computed once per module and never invalidated otherwise
+        if (auto *PSI = MAM.getCachedResult<ProfileSummaryAnalysis>(M))
+            PSI->refresh();
+    }
+
+    // Hottest sites first, so that they get the budget
+    std::stable_sort(Calls.begin(), Calls.end(), [](const ProfiledCall &A, const ProfiledCall &B) {
+        return A.Count > B.Count;
+    });
+    uint64_t HotCount = PD->hotCount("call", HotCallPercent);
+    uint64_t Budget = uint64_t(ModuleSize) * InlineHintGrowth / 100, Growth = 0;
+    unsigned Hot = 0;
+    for (const ProfiledCall &PC : Calls) {
+        if (PC.Count < HotCount)
+            break;
+        Function *Callee = PC.Callee;
+        if (Callee->isDeclaration() || Callee->isInterposable() ||
+            Callee == PC.CB->getFunction() || Callee->hasFnAttribute(Attribute::NoInline))
+            continue;
+        unsigned Size = Callee->getInstructionCount();
+        if (Size > InlineHintMaxSize || Growth + Size > Budget)
+            continue;
+        PC.CB->addFnAttr(Attribute::AlwaysInline);
+        Growth += Size;
+        ++Hot;
+    }
+
+    errs() << "profile-inline-hints: " << M.getModuleIdentifier() << ": " << Hot
+           << " call sites forced inline (+" << Growth << " of " << Budget
+           << " instructions), " << Cold << " kept out of line, " << Counted
+           << " entry counts\n";
+    return Weighted || Counted || Hot || Cold ? PreservedAnalyses::none()
+                                              : PreservedAnalyses::all();
+}
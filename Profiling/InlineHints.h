@@ -0,0 +1,31 @@
+//===- InlineHints.h - Inlining decisions from the call-edge profile ------===//
+//
+// Turns the counts of the call-edge profile into hints for the standard
+// inliner, before it runs:
+//
+//  - the hottest call sites, those that together make up most of the calls
+//    of the program, get a call-site alwaysinline when the callee is small,
+//    as long as the callees inlined this way fit a code-growth budget;
+//  - call sites that never ran, in functions that did, get noinline.
+//
+// Unless the module already has a profile, the counts also go to the
+// inliner's own hot and cold thresholds: each call site gets its count as
+// branch weights, each function the calls it received as entry count, and
+// the module a profile summary of these counts.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_INLINEHINTS_H
+#define TUTORIAL_LLVM_PASS_INLINEHINTS_H
+
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+struct InlineHints : PassInfoMixin<InlineHints> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_INLINEHINTS_H
@@ -0,0 +1,155 @@
+//===- Instrumentation.h - Helpers shared by the profiling passes ---------===//
+//
+// Every instrumentation pass of the plugin counts events at numbered sites
+// of a function into a table of SiteCounter records:
+//
+//   struct sr_site_counter { const char *Function, *Value; uint32_t Site; uint64_t Count; };
+//
+// A constructor registers each table with the runtime under a kind, such as
+// "call", and the runtime appends the non-zero records to the profile file
+// at exit, one "kind function site value count" line each, tab-separated.
+// The passes that use a profile number the sites the same way.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_INSTRUMENTATION_H
+#define TUTORIAL_LLVM_PASS_INSTRUMENTATION_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include <algorithm>
+#include <limits>
+#include <string>
+
+namespace llvm {
+namespace profiling {
+
+// Name of F in the profile; local functions are qualified by their source
+// file, as several files may define one of the same name
+inline std::string profileName(const Function &F) {
+    if (F.hasLocalLinkage())
+        return (F.getParent()->getSourceFileName() + ":" + F.getName()).str();
+    return F.getName().str();
+}
+
+// Where I is in the source, for the reports: file and line, and column if
+// asked, or the site number when there is no debug info
+inline std::string location(const Instruction &I, unsigned Site, bool Column = false) {
+    const DILocation *Loc = I.getDebugLoc();
+    if (!Loc)
+        return "#" + std::to_string(Site);
+    std::string Str = (Loc->getFilename() + ":" + Twine(Loc->getLine())).str();
+    if (Column)
+        Str += ":" + std::to_string(Loc->getColumn());
+    return Str;
+}
+
+inline StructType *siteCounterType(LLVMContext &Ctx) {
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    return StructType::get(Ptr, Ptr, Type::getInt32Ty(Ctx), Type::getInt64Ty(Ctx));
+}
+
+// Field of a SiteCounter record the instrumentation increments
+constexpr unsigned CountField = 3;
+
+// Private C strings of a module, each emitted once
+class StringTable {
+    Module &M;
+    StringMap<Constant *> Strings;
+
+public:
+    explicit StringTable(Module &M) : M(M) {}
+
+    Constant *get(StringRef Str) {
+        Constant *&GV = Strings[Str];
+        if (!GV) {
+            Constant *Init = ConstantDataArray::getString(M.getContext(), Str);
+            auto *Var = new GlobalVariable(M, Init->getType(), /*isConstant=*/true,
+                                           GlobalValue::PrivateLinkage, Init, ".sr.str");
+            Var->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+            Var->setAlignment(Align(1));
+            GV = Var;
+        }
+        return GV;
+    }
+};
+
+// Adds the table of SiteCounter records to M and a constructor registering
+// it with the runtime under Kind. Returns the table, for the counters.
+inline GlobalVariable *createSiteTable(Module &M, StringTable &Strings, StringRef Kind,
+                                       ArrayRef<Constant *> Records) {
+    LLVMContext &Ctx = M.getContext();
+    auto *TableTy = ArrayType::get(siteCounterType(Ctx), Records.size());
+    auto *Table = new GlobalVariable(M, TableTy, /*isConstant=*/false,
+                                     GlobalValue::PrivateLinkage,
+                                     ConstantArray::get(TableTy, Records), ".sr." + Kind);
+
+    auto *Ctor = Function::Create(FunctionType::get(Type::getVoidTy(Ctx), false),
+                                  GlobalValue::InternalLinkage, "sr.register." + Kind, M);
+    IRBuilder<> Builder(BasicBlock::Create(Ctx, "", Ctor));
+    FunctionCallee Register = M.getOrInsertFunction(
+        "__sr_profile_register", Type::getVoidTy(Ctx), PointerType::getUnqual(Ctx),
+        PointerType::getUnqual(Ctx), Type::getInt32Ty(Ctx));
+    Builder.CreateCall(Register, {Strings.get(Kind), Table, Builder.getInt32(Records.size())});
+    Builder.CreateRetVoid();
+    appendToGlobalCtors(M, Ctor, /*Priority=*/0);
+    return Table;
+}
+
+inline Constant *siteRecord(LLVMContext &Ctx, Constant *Fn, Constant *Value, unsigned Site) {
+    return ConstantStruct::get(siteCounterType(Ctx), Fn, Value,
+                               ConstantInt::get(Type::getInt32Ty(Ctx), Site),
+                               ConstantInt::get(Type::getInt64Ty(Ctx), 0));
+}
+
+// Adds Step to the count of record Index before I. Like the counters of
+// -fprofile-instr-generate, they are not atomic: a race loses an increment.
+inline void incrementCounter(Instruction *I, GlobalVariable *Table, unsigned Index,
+                             Value *Step = nullptr) {
+    IRBuilder<> Builder(I);
+    Value *Counter = Builder.CreateConstInBoundsGEP2_32(Table->getValueType(), Table, 0, Index);
+    Counter = Builder.CreateStructGEP(siteCounterType(I->getContext()), Counter, CountField);
+    Value *Count = Builder.CreateLoad(Builder.getInt64Ty(), Counter);
+    Builder.CreateStore(Builder.CreateAdd(Count, Step ? Step : Builder.getInt64(1)), Counter);
+}
+
+// Replaces Call by a call of the runtime function Wrapper, which takes the
+// same arguments, after Site if there is one, and returns the same value
+inline CallInst *redirectCall(CallInst *Call, StringRef Wrapper, Value *Site = nullptr) {
+    Module &M = *Call->getModule();
+    FunctionType *Ty = Call->getFunctionType();
+    SmallVector<Type *, 4> Params;
+    SmallVector<Value *, 4> Args;
+    if (Site) {
+        Params.push_back(Site->getType());
+        Args.push_back(Site);
+    }
+    append_range(Params, Ty->params());
+    append_range(Args, Call->args());
+    FunctionCallee Callee = M.getOrInsertFunction(
+        Wrapper, FunctionType::get(Ty->getReturnType(), Params, Ty->isVarArg()));
+    CallInst *New = IRBuilder<>(Call).CreateCall(Callee, Args);
+    New->setDebugLoc(Call->getDebugLoc());
+    New->takeName(Call);
+    Call->replaceAllUsesWith(New);
+    Call->eraseFromParent();
+    return New;
+}
+
+// A profile count as a branch weight, which has only 32 bits
+inline uint32_t clampWeight(uint64_t Count) {
+    return uint32_t(std::min<uint64_t>(Count, std::numeric_limits<uint32_t>::max()));
+}
+
+} // namespace profiling
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_INSTRUMENTATION_H
@@ -0,0 +1,103 @@
+#include "LockContention.h"
+#include "FunctionControls.h"
+#include "Instrumentation.h"
+
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+
+using namespace llvm;
+using namespace llvm::profiling;
+
+namespace {
+
+// The runtime wrapper of a pthread function, and whether it takes a site
+StringRef wrapperOf(StringRef Callee, bool &TakesSite) {
+    TakesSite = true;
+    StringRef Wrapper = StringSwitch<StringRef>(Callee)
+                            .Case("pthread_mutex_lock", "__sr_mutex_lock")
+                            .Case("pthread_rwlock_rdlock", "__sr_rwlock_rdlock")
+                            .Case("pthread_rwlock_wrlock", "__sr_rwlock_wrlock")
+                            .Case("pthread_cond_wait", "__sr_cond_wait")
+                            .Case("pthread_cond_timedwait", "__sr_cond_timedwait")
+                            .Default("");
+    if (!Wrapper.empty())
+        return Wrapper;
+    TakesSite = false;
+    return StringSwitch<StringRef>(Callee)
+        .Case("pthread_mutex_unlock", "__sr_mutex_unlock")
+        .Case("pthread_rwlock_unlock", "__sr_rwlock_unlock")
+        .Default("");
+}
+
+} // namespace
+
+PreservedAnalyses LockContention::run(Module &M, ModuleAnalysisManager &MAM) {
+    auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    LLVMContext &Ctx = M.getContext();
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    auto *I32 = Type::getInt32Ty(Ctx);
+    // struct sr_lock_site { const char *Function, *Location, *Call; uint32_t Id; }
+    auto *SiteTy = StructType::get(Ptr, Ptr, Ptr, I32);
+    StringTable Strings(M);
+
+    struct WrappedCall {
+        CallInst *Call;
+        StringRef Wrapper;
+        int Site; // index in Records, or -1 for an unlock
+    };
+    SmallVector<Constant *, 16> Records;
+    SmallVector<WrappedCall, 16> Calls;
+    for (Function &F : M) {
+        if (F.isDeclaration() || !FAM.getResult<FunctionControlsAnalysis>(F).timed())
+            continue;
+        Constant *Name = Strings.get(profileName(F));
+        unsigned Site = 0;
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : BB) {
+                auto *Call = dyn_cast<CallInst>(&I);
+                Function *Callee = Call ? Call->getCalledFunction() : nullptr;
+                if (!Callee || !Callee->isDeclaration())
+                    continue;
+                bool TakesSite;
+                StringRef Wrapper = wrapperOf(Callee->getName(), TakesSite);
+                if (Wrapper.empty())
+                    continue;
+                if (!TakesSite) {
+                    Calls.push_back({Call, Wrapper, -1});
+                    continue;
+                }
+                Calls.push_back({Call, Wrapper, int(Records.size())});
+                Records.push_back(ConstantStruct::get(SiteTy, Name,
+                                                      Strings.get(location(I, Site)),
+                                                      Strings.get(Callee->getName()),
+                                                      ConstantInt::get(I32, 0)));
+                ++Site;
+            }
+        }
+    }
+    if (Calls.empty())
+        return PreservedAnalyses::all();
+
+    auto *TableTy = ArrayType::get(SiteTy, Records.size());
+    auto *Table = new GlobalVariable(M, TableTy, /*isConstant=*/false, GlobalValue::PrivateLinkage,
+                                     ConstantArray::get(TableTy, Records), ".sr.locks");
+    for (const WrappedCall &W : Calls) {
+        Value *Site = nullptr;
+        if (W.Site >= 0)
+            Site = IRBuilder<>(W.Call).CreateConstInBoundsGEP2_32(TableTy, Table, 0, W.Site);
+        redirectCall(W.Call, W.Wrapper, Site);
+    }
+
+    if (!Records.empty()) {
+        auto *Ctor = Function::Create(FunctionType::get(Type::getVoidTy(Ctx), false),
+                                      GlobalValue::InternalLinkage, "sr.register.locks", M);
+        IRBuilder<> Builder(BasicBlock::Create(Ctx, "", Ctor));
+        FunctionCallee Register =
+            M.getOrInsertFunction("__sr_lock_register", Type::getVoidTy(Ctx), Ptr, I32);
+        Builder.CreateCall(Register, {Table, Builder.getInt32(Records.size())});
+        Builder.CreateRetVoid();
+        appendToGlobalCtors(M, Ctor, /*Priority=*/0);
+    }
+    return PreservedAnalyses::none();
+}
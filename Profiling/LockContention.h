@@ -0,0 +1,27 @@
+//===- LockContention.h - Profile contended pthread locks -----------------===//
+//
+// Instrumentation: each call of pthread_mutex_lock, pthread_rwlock_rdlock,
+// pthread_rwlock_wrlock, pthread_cond_wait and pthread_cond_timedwait
+// becomes a call of a runtime wrapper, given the site it is called from
+// (see runtime/LockProfile.c). The wrapper tries the lock first and only
+// reads the clock when it is taken: uncontended locking stays cheap. Calls
+// of pthread_mutex_unlock and pthread_rwlock_unlock go through the runtime
+// too, so that it can tell how long each site held the lock. At exit, the
+// runtime reports the sites ranked by the time threads waited at them.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_LOCKCONTENTION_H
+#define TUTORIAL_LLVM_PASS_LOCKCONTENTION_H
+
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+struct LockContention : PassInfoMixin<LockContention> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_LOCKCONTENTION_H
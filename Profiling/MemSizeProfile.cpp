@@ -0,0 +1,103 @@
+#include "MemSizeProfile.h"
+#include "FunctionControls.h"
+#include "Instrumentation.h"
+
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+
+using namespace llvm;
+using namespace llvm::profiling;
+
+Intrinsic::ID llvm::memSizeOperation(const CallBase &CB, const TargetLibraryInfo &TLI) {
+    // The length is the third argument of all of them
+    if (CB.arg_size() < 3 || isa<Constant>(CB.getArgOperand(2)))
+        return Intrinsic::not_intrinsic;
+    if (auto *MI = dyn_cast<MemIntrinsic>(&CB)) {
+        if (MI->isVolatile())
+            return Intrinsic::not_intrinsic;
+        switch (MI->getIntrinsicID()) {
+        case Intrinsic::memcpy:
+        case Intrinsic::memmove:
+        case Intrinsic::memset:
+            return MI->getIntrinsicID();
+        default:
+            return Intrinsic::not_intrinsic;
+        }
+    }
+    // Calls of the library functions are left when they were not known to
+    // be builtins at the time, or were written through a pointer
+    LibFunc LF;
+    if (!TLI.getLibFunc(CB, LF) || !TLI.has(LF))
+        return Intrinsic::not_intrinsic;
+    switch (LF) {
+    case LibFunc_memcpy:
+        return Intrinsic::memcpy;
+    case LibFunc_memmove:
+        return Intrinsic::memmove;
+    case LibFunc_memset:
+        return Intrinsic::memset;
+    default:
+        return Intrinsic::not_intrinsic;
+    }
+}
+
+SmallVector<CallBase *, 8> llvm::profiledMemCalls(Function &F, const TargetLibraryInfo &TLI) {
+    SmallVector<CallBase *, 8> Sites;
+    for (BasicBlock &BB : F)
+        for (Instruction &I : BB)
+            if (auto *CB = dyn_cast<CallBase>(&I))
+                if (memSizeOperation(*CB, TLI) != Intrinsic::not_intrinsic)
+                    Sites.push_back(CB);
+    return Sites;
+}
+
+PreservedAnalyses MemSizeProfile::run(Module &M, ModuleAnalysisManager &MAM) {
+    auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    LLVMContext &Ctx = M.getContext();
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    auto *I32 = Type::getInt32Ty(Ctx);
+    auto *I64 = Type::getInt64Ty(Ctx);
+    // struct sr_memsize_site { const char *Function; uint32_t Site; uint64_t Other;
+    //                          struct { uint64_t Size, Count; } Top[MemSizeTopK]; }
+    auto *TopTy = ArrayType::get(StructType::get(I64, I64), MemSizeTopK);
+    auto *SiteTy = StructType::get(Ptr, I32, I64, TopTy);
+    StringTable Strings(M);
+
+    SmallVector<Constant *, 16> Records;
+    SmallVector<CallBase *, 16> Counted;
+    for (Function &F : M) {
+        if (F.isDeclaration() || !FAM.getResult<FunctionControlsAnalysis>(F).counted())
+            continue;
+        Constant *Name = Strings.get(profileName(F));
+        auto &TLI = FAM.getResult<TargetLibraryAnalysis>(F);
+        for (auto [Site, CB] : enumerate(profiledMemCalls(F, TLI))) {
+            Records.push_back(ConstantStruct::get(SiteTy, Name, ConstantInt::get(I32, Site),
+                                                  ConstantInt::get(I64, 0),
+                                                  Constant::getNullValue(TopTy)));
+            Counted.push_back(CB);
+        }
+    }
+    if (Records.empty())
+        return PreservedAnalyses::all();
+
+    auto *TableTy = ArrayType::get(SiteTy, Records.size());
+    auto *Table = new GlobalVariable(M, TableTy, /*isConstant=*/false, GlobalValue::PrivateLinkage,
+                                     ConstantArray::get(TableTy, Records), ".sr.memsize");
+    FunctionCallee Record =
+        M.getOrInsertFunction("__sr_profile_memsize", Type::getVoidTy(Ctx), Ptr, I64);
+    for (auto [Index, CB] : enumerate(Counted)) {
+        IRBuilder<> Builder(CB);
+        Value *Site = Builder.CreateConstInBoundsGEP2_32(TableTy, Table, 0, Index);
+        Builder.CreateCall(Record, {Site, Builder.CreateZExtOrTrunc(CB->getArgOperand(2), I64)});
+    }
+
+    auto *Ctor = Function::Create(FunctionType::get(Type::getVoidTy(Ctx), false),
+                                  GlobalValue::InternalLinkage, "sr.register.memsize", M);
+    IRBuilder<> Builder(BasicBlock::Create(Ctx, "", Ctor));
+    FunctionCallee Register = M.getOrInsertFunction("__sr_profile_register_memsizes",
+                                                    Type::getVoidTy(Ctx), Ptr, I32);
+    Builder.CreateCall(Register, {Table, Builder.getInt32(Records.size())});
+    Builder.CreateRetVoid();
+    appendToGlobalCtors(M, Ctor, /*Priority=*/0);
+    return PreservedAnalyses::none();
+}
@@ -0,0 +1,38 @@
+//===- MemSizeProfile.h - Record the lengths of memory copies and sets ----===//
+//
+// Instrumentation: before each memcpy, memmove and memset whose length is
+// not a constant, intrinsic or library call, the runtime is told the
+// length. As for indirect call targets, each site keeps the first
+// MemSizeTopK distinct lengths with their counts, and counts the others
+// together; it is recorded as "memsize function site length count", "*"
+// standing for the other lengths.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_MEMSIZEPROFILE_H
+#define TUTORIAL_LLVM_PASS_MEMSIZEPROFILE_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+// Lengths kept per site; must match SR_MEMSIZE_TOP_K in ProfileRuntime.c
+constexpr unsigned MemSizeTopK = 4;
+
+// Intrinsic::memcpy, Intrinsic::memmove or Intrinsic::memset for a call of
+// variable length that the profile counts, or not_intrinsic
+Intrinsic::ID memSizeOperation(const CallBase &CB, const TargetLibraryInfo &TLI);
+
+// The memory operations of F the profile numbers, in order
+SmallVector<CallBase *, 8> profiledMemCalls(Function &F, const TargetLibraryInfo &TLI);
+
+struct MemSizeProfile : PassInfoMixin<MemSizeProfile> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_MEMSIZEPROFILE_H
@@ -0,0 +1,128 @@
+#include "MemSizeSpecialization.h"
+#include "Instrumentation.h"
+#include "MemSizeProfile.h"
+#include "ProfileData.h"
+
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+using namespace llvm::profiling;
+
+static cl::opt<unsigned> MemSizeMaxSizes(
+    "memsize-max-sizes", cl::init(3),
+    cl::desc("Most lengths specialized at one memcpy, memmove or memset site"));
+
+static cl::opt<unsigned> MemSizeMaxSize(
+    "memsize-max-size", cl::init(128),
+    cl::desc("Largest length, in bytes, a memory operation is specialized on"));
+
+static cl::opt<unsigned> MemSizeMinPercent(
+    "memsize-min-percent", cl::init(20),
+    cl::desc("Share of the calls of a site a length needs to be specialized"));
+
+static cl::opt<unsigned> MemSizeMinCount(
+    "memsize-min-count", cl::init(1000),
+    cl::desc("Fewest calls a length needs to be specialized"));
+
+namespace {
+
+// The operation of CB on Size bytes, inline for copies and sets
+void emitFixedSize(IRBuilder<> &Builder, CallBase &CB, Intrinsic::ID Op, Value *Size) {
+    Value *Dst = CB.getArgOperand(0), *Src = CB.getArgOperand(1);
+    MaybeAlign DstAlign = CB.getParamAlign(0);
+    switch (Op) {
+    case Intrinsic::memcpy:
+        Builder.CreateMemCpyInline(Dst, DstAlign, Src, CB.getParamAlign(1), Size);
+        break;
+    case Intrinsic::memmove:
+        Builder.CreateMemMove(Dst, DstAlign, Src, CB.getParamAlign(1), Size);
+        break;
+    default:
+        // The library function takes the byte as an int
+        Builder.CreateMemSetInline(Dst, DstAlign, Builder.CreateTrunc(Src, Builder.getInt8Ty()),
+                                   Size);
+        break;
+    }
+}
+
+// Replaces CB by a switch on its length, with a block of the operation on
+// each of Sizes and the original call as the default
+void specialize(CallBase &CB, Intrinsic::ID Op, ArrayRef<std::pair<uint64_t, uint64_t>> Sizes,
+                uint64_t Remaining) {
+    // The library functions return their destination
+    if (!CB.use_empty())
+        CB.replaceAllUsesWith(CB.getArgOperand(0));
+    BasicBlock *Head = CB.getParent();
+    BasicBlock *Tail = Head->splitBasicBlock(CB.getNextNode(), "memsize.cont");
+    BasicBlock *Generic = Head->splitBasicBlock(&CB, "memsize.generic");
+    Head->getTerminator()->eraseFromParent();
+
+    Value *Length = CB.getArgOperand(2);
+    auto *Switch = SwitchInst::Create(Length, Generic, Sizes.size(), Head);
+    Switch->setDebugLoc(CB.getDebugLoc());
+    SmallVector<uint32_t, 4> Weights = {clampWeight(Remaining)};
+    for (auto [Size, Count] : Sizes) {
+        auto *Case = BasicBlock::Create(CB.getContext(), "memsize." + Twine(Size),
+                                        Head->getParent(), Generic);
+        IRBuilder<> Builder(Case);
+        Builder.SetCurrentDebugLocation(CB.getDebugLoc());
+        auto *Fixed = cast<ConstantInt>(ConstantInt::get(Length->getType(), Size));
+        emitFixedSize(Builder, CB, Op, Fixed);
+        Builder.CreateBr(Tail);
+        Switch->addCase(Fixed, Case);
+        Weights.push_back(clampWeight(Count));
+    }
+    Switch->setMetadata(LLVMContext::MD_prof,
+                        MDBuilder(CB.getContext()).createBranchWeights(Weights));
+}
+
+} // namespace
+
+PreservedAnalyses MemSizeSpecialization::run(Module &M, ModuleAnalysisManager &MAM) {
+    const ProfileData *PD = ProfileData::get();
+    if (!PD)
+        return PreservedAnalyses::all();
+    auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+
+    unsigned Sites = 0, Specialized = 0;
+    for (Function &F : M) {
+        if (F.isDeclaration())
+            continue;
+        std::string Name = profileName(F);
+        if (!PD->hasFunction("memsize", Name))
+            continue;
+        auto &TLI = FAM.getResult<TargetLibraryAnalysis>(F);
+        for (auto [Site, CB] : enumerate(profiledMemCalls(F, TLI))) {
+            ArrayRef<ProfileData::Record> Lengths = PD->lookup("memsize", Name, Site);
+            uint64_t Total = 0;
+            for (const ProfileData::Record &R : Lengths)
+                Total += R.Count;
+            // The dominant lengths, highest count first, that are small
+            // enough to expand inline
+            SmallVector<std::pair<uint64_t, uint64_t>, 4> Sizes;
+            uint64_t Remaining = Total;
+            for (const ProfileData::Record &R : Lengths) {
+                if (Sizes.size() == MemSizeMaxSizes || R.Count < MemSizeMinCount ||
+                    R.Count * 100 < Total * MemSizeMinPercent)
+                    break;
+                uint64_t Size;
+                if (StringRef(R.Value).getAsInteger(10, Size) || Size > MemSizeMaxSize)
+                    continue;
+                Sizes.push_back({Size, R.Count});
+                Remaining -= R.Count;
+            }
+            if (Sizes.empty())
+                continue;
+            specialize(*CB, memSizeOperation(*CB, TLI), Sizes, Remaining);
+            Specialized += Sizes.size();
+            ++Sites;
+        }
+    }
+
+    errs() << "mem-size-specialization: " << M.getModuleIdentifier() << ": " << Specialized
+           << " lengths specialized at " << Sites << " memory operations\n";
+    return Specialized ? PreservedAnalyses::none() : PreservedAnalyses::all();
+}
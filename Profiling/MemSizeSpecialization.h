@@ -0,0 +1,33 @@
+//===- MemSizeSpecialization.h - Version memory copies on hot lengths -----===//
+//
+// With the memory operation length profile, rewrites a memcpy, memmove or
+// memset whose lengths are dominated by a few small values into
+//
+//   switch (n) {
+//   case 16: memcpy(d, s, 16); break;   // llvm.memcpy.inline
+//   case 32: memcpy(d, s, 32); break;
+//   default: memcpy(d, s, n);           // the original call
+//   }
+//
+// with branch weights from the counts. The backend expands the constant
+// lengths into a few vector loads and stores, where the generic call goes
+// through the dispatcher of the C library. Up to -memsize-max-sizes lengths
+// of at most -memsize-max-size bytes are specialized per site, each taking
+// at least -memsize-min-percent of the calls.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_MEMSIZESPECIALIZATION_H
+#define TUTORIAL_LLVM_PASS_MEMSIZESPECIALIZATION_H
+
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+struct MemSizeSpecialization : PassInfoMixin<MemSizeSpecialization> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_MEMSIZESPECIALIZATION_H
@@ -0,0 +1,172 @@
+#include "MemoryTrace.h"
+#include "FunctionControls.h"
+#include "Instrumentation.h"
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/DebugInfo.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+using namespace llvm;
+using namespace llvm::profiling;
+
+namespace {
+
+// Name of the source variable V holds, from the debug info, or else its IR
+// name, which clang only keeps in debug builds
+StringRef variableName(Value *V) {
+    SmallVector<DbgValueInst *, 1> Values;
+    findDbgValues(Values, V);
+    if (!Values.empty())
+        return Values.front()->getVariable()->getName();
+    for (DbgDeclareInst *Declare : FindDbgDeclareUses(V))
+        return Declare->getVariable()->getName();
+    return V->getName();
+}
+
+// The data structure Ptr points into, as the IR tells it
+std::string dataStructure(Value *Ptr, const Function &F, unsigned Depth = 0) {
+    Value *Object = getUnderlyingObject(Ptr);
+    if (auto *GV = dyn_cast<GlobalVariable>(Object))
+        return GV->getName().str();
+    // A field reached through a pointer counts towards its struct type
+    if (auto *GEP = dyn_cast<GEPOperator>(Ptr))
+        if (auto *ST = dyn_cast<StructType>(GEP->getSourceElementType()))
+            if (ST->hasName())
+                return ST->getName().str();
+    // What a loaded pointer points to is named after where it was loaded from
+    if (auto *Load = dyn_cast<LoadInst>(Object); Load && Depth < 4)
+        return dataStructure(Load->getPointerOperand(), F, Depth + 1) + "->*";
+    StringRef Name = variableName(Object);
+    if (Name.empty())
+        return isa<AllocaInst>(Object) ? profileName(F) + ":<stack>" : "<unknown>";
+    return profileName(F) + ":" + Name.str();
+}
+
+} // namespace
+
+PreservedAnalyses MemoryTrace::run(Module &M, ModuleAnalysisManager &MAM) {
+    auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    const DataLayout &DL = M.getDataLayout();
+    LLVMContext &Ctx = M.getContext();
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    auto *I32 = Type::getInt32Ty(Ctx);
+    auto *I64 = Type::getInt64Ty(Ctx);
+    // struct sr_trace_site { const char *Function, *Location, *Object;
+    //                        struct sr_trace_loop *Loop; uint32_t Size, IsStore, Id; }
+    auto *SiteTy = StructType::get(Ptr, Ptr, Ptr, Ptr, I32, I32, I32);
+    // struct sr_trace_loop { const char *Function, *Location;
+    //                        struct sr_trace_loop *Parent; uint32_t Depth;
+    //                        uint64_t Reuses[ReuseBuckets]; }
+    auto *ReusesTy = ArrayType::get(I64, ReuseBuckets);
+    auto *LoopTy = StructType::get(Ptr, Ptr, Ptr, I32, ReusesTy);
+    StringTable Strings(M);
+
+    struct TracedAccess {
+        Instruction *I;
+        Constant *Function, *Location, *Object;
+        int Loop; // index in Loops, or -1 outside loops
+    };
+    struct LoopRecord {
+        Constant *Function, *Location;
+        int Parent;
+        unsigned Depth;
+    };
+    SmallVector<TracedAccess, 64> Traced;
+    SmallVector<LoopRecord, 16> Loops;
+    for (Function &F : M) {
+        if (F.isDeclaration() || !FAM.getResult<FunctionControlsAnalysis>(F).counted())
+            continue;
+        Constant *Name = Strings.get(profileName(F));
+        // Loops in preorder, so that a parent comes before its children
+        auto &LI = FAM.getResult<LoopAnalysis>(F);
+        DenseMap<const Loop *, int> LoopIndex;
+        for (auto [Number, L] : enumerate(LI.getLoopsInPreorder())) {
+            LoopIndex[L] = Loops.size();
+            std::string Where = "loop #" + std::to_string(Number);
+            if (DebugLoc Loc = L->getStartLoc())
+                Where = (Loc->getFilename() + ":" + Twine(Loc.getLine())).str();
+            Loops.push_back({Name, Strings.get(Where),
+                             L->getParentLoop() ? LoopIndex[L->getParentLoop()] : -1,
+                             L->getLoopDepth()});
+        }
+        unsigned Site = 0;
+        for (BasicBlock &BB : F) {
+            const Loop *L = LI.getLoopFor(&BB);
+            for (Instruction &I : BB) {
+                Value *Address = getLoadStorePointerOperand(&I);
+                if (!Address || Address->getType()->getPointerAddressSpace() != 0)
+                    continue;
+                Traced.push_back({&I, Name, Strings.get(location(I, Site, /*Column=*/true)),
+                                  Strings.get(dataStructure(Address, F)),
+                                  L ? LoopIndex[L] : -1});
+                ++Site;
+            }
+        }
+    }
+    if (Traced.empty())
+        return PreservedAnalyses::all();
+
+    auto *LoopsTy = ArrayType::get(LoopTy, Loops.size());
+    auto *LoopTable = new GlobalVariable(M, LoopsTy, /*isConstant=*/false,
+                                         GlobalValue::PrivateLinkage, nullptr, ".sr.loops");
+    auto LoopRef = [&](int Index) -> Constant * {
+        if (Index < 0)
+            return ConstantPointerNull::get(Ptr);
+        return ConstantExpr::getInBoundsGetElementPtr(
+            LoopsTy, LoopTable,
+            ArrayRef<Constant *>{ConstantInt::get(I32, 0), ConstantInt::get(I32, Index)});
+    };
+    SmallVector<Constant *, 16> LoopRecords;
+    for (const LoopRecord &L : Loops)
+        LoopRecords.push_back(ConstantStruct::get(LoopTy, L.Function, L.Location,
+                                                  LoopRef(L.Parent),
+                                                  ConstantInt::get(I32, L.Depth),
+                                                  Constant::getNullValue(ReusesTy)));
+    LoopTable->setInitializer(ConstantArray::get(LoopsTy, LoopRecords));
+
+    SmallVector<Constant *, 64> Records;
+    for (const TracedAccess &A : Traced)
+        Records.push_back(ConstantStruct::get(
+            SiteTy, A.Function, A.Location, A.Object, LoopRef(A.Loop),
+            ConstantInt::get(I32, DL.getTypeStoreSize(getLoadStoreType(A.I)).getKnownMinValue()),
+            ConstantInt::get(I32, isa<StoreInst>(A.I)), ConstantInt::get(I32, 0)));
+    auto *TableTy = ArrayType::get(SiteTy, Records.size());
+    auto *Table = new GlobalVariable(M, TableTy, /*isConstant=*/false, GlobalValue::PrivateLinkage,
+                                     ConstantArray::get(TableTy, Records), ".sr.trace");
+
+    // Accesses left until the runtime is called next, in the runtime
+    auto *Countdown = cast<GlobalVariable>(M.getOrInsertGlobal("__sr_trace_countdown", I64));
+    Countdown->setThreadLocalMode(GlobalValue::InitialExecTLSModel);
+    FunctionCallee Access =
+        M.getOrInsertFunction("__sr_trace_access", Type::getVoidTy(Ctx), Ptr, Ptr);
+    MDNode *Unlikely = MDBuilder(Ctx).createBranchWeights(1, 1000);
+    for (auto [Index, A] : enumerate(Traced)) {
+        Instruction *I = A.I;
+        IRBuilder<> Builder(I);
+        Value *Counter = Builder.CreateThreadLocalAddress(Countdown);
+        Value *Left = Builder.CreateSub(Builder.CreateLoad(I64, Counter), Builder.getInt64(1));
+        Builder.CreateStore(Left, Counter);
+        Instruction *Call = SplitBlockAndInsertIfThen(
+            Builder.CreateICmpSLE(Left, Builder.getInt64(0)), I, /*Unreachable=*/false, Unlikely);
+        Builder.SetInsertPoint(Call);
+        Builder.CreateCall(Access, {Builder.CreateConstInBoundsGEP2_32(TableTy, Table, 0, Index),
+                                    getLoadStorePointerOperand(I)});
+    }
+
+    auto *Ctor = Function::Create(FunctionType::get(Type::getVoidTy(Ctx), false),
+                                  GlobalValue::InternalLinkage, "sr.register.trace", M);
+    IRBuilder<> Builder(BasicBlock::Create(Ctx, "", Ctor));
+    FunctionCallee Register = M.getOrInsertFunction("__sr_trace_register", Type::getVoidTy(Ctx),
+                                                    Ptr, I32, Ptr, I32);
+    Builder.CreateCall(Register, {Table, Builder.getInt32(Records.size()), LoopTable,
+                                  Builder.getInt32(Loops.size())});
+    Builder.CreateRetVoid();
+    appendToGlobalCtors(M, Ctor, /*Priority=*/0);
+    return PreservedAnalyses::none();
+}
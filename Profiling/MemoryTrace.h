@@ -0,0 +1,39 @@
+//===- MemoryTrace.h - Trace sampled loads and stores ---------------------===//
+//
+// Instrumentation: each load and store of a function becomes a site of a
+// table registered with the runtime, with its source location, its size
+// and the data structure it accesses, as far as the IR tells: a global, a
+// local variable, the struct type of a field, or the variable a pointer
+// came from. Before the access, a thread-local countdown is decremented
+// inline; only when it runs out is the runtime called with the site and the
+// address. The runtime records bursts of consecutive accesses, so that a
+// cache simulator replaying them sees realistic reuse, and skips the
+// accesses between bursts (see runtime/MemoryTrace.c and tools/CacheSim.cpp).
+//
+// Each site also points to the record of the innermost loop it is in, of a
+// table of the loops of the module, where the runtime can instead count
+// the reuse distances of the accesses, when SR_TRACE_MODE is "reuse".
+//
+// It runs at the end of the optimization pipeline, so that only the
+// accesses left in the optimized program are traced.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_MEMORYTRACE_H
+#define TUTORIAL_LLVM_PASS_MEMORYTRACE_H
+
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+// Buckets of the reuse distance histogram of a loop; must match
+// SR_REUSE_BUCKETS in runtime/MemoryTrace.c
+constexpr unsigned ReuseBuckets = 40;
+
+struct MemoryTrace : PassInfoMixin<MemoryTrace> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_MEMORYTRACE_H
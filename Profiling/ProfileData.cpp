@@ -0,0 +1,94 @@
+#include "ProfileData.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include <optional>
+
+using namespace llvm;
+using namespace llvm::profiling;
+
+static cl::opt<std::string> ProfileUse(
+    "sr-profile-use", cl::init(""),
+    cl::desc("Optimize with the profile an instrumented build of the program wrote"));
+
+Expected<ProfileData> ProfileData::load(StringRef Path) {
+    auto Buffer = MemoryBuffer::getFile(Path);
+    if (!Buffer)
+        return createStringError(Buffer.getError(), "cannot read profile " + Path);
+
+    ProfileData PD;
+    SmallVector<StringRef, 0> Lines;
+    (*Buffer)->getBuffer().split(Lines, '\n', -1, /*KeepEmpty=*/false);
+    for (auto [Number, Line] : enumerate(Lines)) {
+        SmallVector<StringRef, 5> Fields;
+        Line.split(Fields, '\t');
+        unsigned Site;
+        uint64_t Count;
+        if (Fields.size() != 5 || Fields[2].getAsInteger(10, Site) ||
+            Fields[4].getAsInteger(10, Count))
+            return createStringError(inconvertibleErrorCode(), Path + ":" + Twine(Number + 1) +
+                                                                   ": malformed profile line");
+        auto &Records = PD.Sites[key(Fields[0], Fields[1])][Site];
+        auto It = find_if(Records, [&](const Record &R) { return R.Value == Fields[3]; });
+        if (It != Records.end())
+            It->Count += Count;
+        else
+            Records.push_back({Fields[3].str(), Count});
+        PD.Totals[Fields[0]] += Count;
+        PD.FunctionTotals[key(Fields[0], Fields[1])] += Count;
+        PD.ValueTotals[key(Fields[0], Fields[3])] += Count;
+    }
+    for (auto &Function : PD.Sites)
+        for (auto &[Site, Records] : Function.second)
+            std::stable_sort(Records.begin(), Records.end(),
+                             [](const Record &A, const Record &B) { return A.Count > B.Count; });
+    return PD;
+}
+
+const ProfileData *ProfileData::get() {
+    static const std::optional<ProfileData> Loaded = []() -> std::optional<ProfileData> {
+        if (ProfileUse.empty())
+            return std::nullopt;
+        Expected<ProfileData> PD = load(ProfileUse);
+        if (!PD) {
+            errs() << "warning: " << toString(PD.takeError()) << "\n";
+            return std::nullopt;
+        }
+        return std::move(*PD);
+    }();
+    return Loaded ? &*Loaded : nullptr;
+}
+
+ArrayRef<ProfileData::Record> ProfileData::lookup(StringRef Kind, StringRef Function,
+                                                  unsigned Site) const {
+    auto FunctionSites = Sites.find(key(Kind, Function));
+    if (FunctionSites == Sites.end())
+        return {};
+    auto It = FunctionSites->second.find(Site);
+    if (It == FunctionSites->second.end())
+        return {};
+    return It->second;
+}
+
+uint64_t ProfileData::hotCount(StringRef Kind, unsigned Percent) const {
+    std::vector<uint64_t> Counts;
+    std::string Prefix = (Kind + "\t").str();
+    for (const auto &Function : Sites)
+        if (Function.getKey().startswith(Prefix))
+            for (const auto &[Site, Records] : Function.second)
+                for (const Record &R : Records)
+                    Counts.push_back(R.Count);
+    std::sort(Counts.begin(), Counts.end(), std::greater<uint64_t>());
+    uint64_t Target = total(Kind) / 100 * Percent, Covered = 0;
+    for (uint64_t Count : Counts) {
+        Covered += Count;
+        if (Covered >= Target)
+            return Count;
+    }
+    return Counts.empty() ? 0 : Counts.back();
+}
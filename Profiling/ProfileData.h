@@ -0,0 +1,78 @@
+//===- ProfileData.h - Profile written by the instrumented program --------===//
+//
+// Reads the profile file the runtime appends to (see Instrumentation.h).
+// Lines of several runs, or of several processes, for the same site and
+// value are summed. The file is given by -sr-profile-use and read once.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_PROFILEDATA_H
+#define TUTORIAL_LLVM_PASS_PROFILEDATA_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/Error.h"
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+namespace llvm {
+namespace profiling {
+
+class ProfileData {
+public:
+    struct Record {
+        std::string Value;
+        uint64_t Count;
+    };
+
+    // Loads and merges the lines of the file at Path
+    static Expected<ProfileData> load(StringRef Path);
+
+    // The profile given by -sr-profile-use, or null if there is none or it
+    // cannot be read, in which case the error is reported once
+    static const ProfileData *get();
+
+    // Records of one site, highest count first; empty if it never counted
+    ArrayRef<Record> lookup(StringRef Kind, StringRef Function, unsigned Site) const;
+
+    // Whether any site of Function counted events of Kind, that is, whether
+    // a site missing from the profile ran zero times rather than was unknown
+    bool hasFunction(StringRef Kind, StringRef Function) const {
+        return Sites.count(key(Kind, Function));
+    }
+
+    // Sum of the counts of Kind over the whole profile
+    uint64_t total(StringRef Kind) const { return Totals.lookup(Kind); }
+
+    // Sum of the counts of the sites of Function, and of the records of
+    // Value over all sites: for "call", the calls a function makes and the
+    // calls it receives
+    uint64_t functionTotal(StringRef Kind, StringRef Function) const {
+        return FunctionTotals.lookup(key(Kind, Function));
+    }
+    uint64_t valueTotal(StringRef Kind, StringRef Value) const {
+        return ValueTotals.lookup(key(Kind, Value));
+    }
+
+    // Lowest count among the hottest records of Kind that together make up
+    // Percent of its total: records counting at least as much are hot
+    uint64_t hotCount(StringRef Kind, unsigned Percent) const;
+
+private:
+    static std::string key(StringRef Kind, StringRef Function) {
+        return (Kind + "\t" + Function).str();
+    }
+
+    StringMap<std::map<unsigned, SmallVector<Record, 1>>> Sites;
+    StringMap<uint64_t> Totals;
+    StringMap<uint64_t> FunctionTotals;
+    StringMap<uint64_t> ValueTotals;
+};
+
+} // namespace profiling
+} // namespace llvm
+
+#endif // TUTORIAL_LLVM_PASS_PROFILEDATA_H
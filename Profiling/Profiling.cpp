@@ -0,0 +1,167 @@
+#include "BranchBiasProfile.h"
+#include "BranchToSelect.h"
+#include "CallEdgeProfile.h"
+#include "FunctionControls.h"
+#include "HotTextLayout.h"
+#include "IOProfile.h"
+#include "IndirectCallProfile.h"
+#include "IndirectCallPromotion.h"
+#include "InlineHints.h"
+#include "LockContention.h"
+#include "MemSizeProfile.h"
+#include "MemSizeSpecialization.h"
+#include "MemoryTrace.h"
+#include "ProfileData.h"
+
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+
+using namespace llvm;
+
+static cl::opt<bool> ProfileGenerate(
+    "sr-profile-generate", cl::init(false),
+    cl::desc("Instrument the program to write a profile for -sr-profile-use; link it "
+             "with the ProfileRuntime library"));
+
+static cl::opt<bool> MemoryTraceGenerate(
+    "sr-memory-trace", cl::init(false),
+    cl::desc("Instrument the loads and stores of the program to write a sampled trace for "
+             "sr-cachesim; link it with the ProfileRuntime library"));
+
+static cl::opt<bool> LockProfileGenerate(
+    "sr-lock-profile", cl::init(false),
+    cl::desc("Instrument the pthread locking calls of the program to report the contended "
+             "ones at exit; link it with the ProfileRuntime library"));
+
+static cl::opt<bool> IOProfileGenerate(
+    "sr-io-profile", cl::init(false),
+    cl::desc("Instrument the I/O calls of the program to report their sizes and latencies at "
+             "exit; link it with the ProfileRuntime library"));
+
+static cl::opt<bool> HotText(
+    "sr-hot-text", cl::init(false),
+    cl::desc("With -sr-profile-use, place the hot functions together for the runtime to move "
+             "onto huge pages at startup; link the program with the ProfileRuntime library"));
+
+// Register the passes as a plugin
+PassPluginLibraryInfo getProfilingPluginInfo() {
+    return {LLVM_PLUGIN_API_VERSION, "Profiling", LLVM_VERSION_STRING,
+            [](PassBuilder &PB) {
+                // Instrumentation follows the instrument: control of each function
+                PB.registerAnalysisRegistrationCallback([](FunctionAnalysisManager &FAM) {
+                    FAM.registerPass([] { return FunctionControlsAnalysis(); });
+                });
+                PB.registerPipelineParsingCallback(
+                    [](StringRef Name, ModulePassManager &MPM,
+                       ArrayRef<PassBuilder::PipelineElement>) {
+                      if (Name == "branch-bias-profile") {
+                        MPM.addPass(BranchBiasProfile());
+                        return true;
+                      }
+                      if (Name == "branch-predictability") {
+                        MPM.addPass(BranchPredictability());
+                        return true;
+                      }
+                      if (Name == "call-edge-profile") {
+                        MPM.addPass(CallEdgeProfile());
+                        return true;
+                      }
+                      if (Name == "hot-text-layout") {
+                        MPM.addPass(HotTextLayout());
+                        return true;
+                      }
+                      if (Name == "indirect-call-profile") {
+                        MPM.addPass(IndirectCallProfile());
+                        return true;
+                      }
+                      if (Name == "indirect-call-promotion") {
+                        MPM.addPass(IndirectCallPromotion());
+                        return true;
+                      }
+                      if (Name == "io-profile") {
+                        MPM.addPass(IOProfile());
+                        return true;
+                      }
+                      if (Name == "lock-contention") {
+                        MPM.addPass(LockContention());
+                        return true;
+                      }
+                      if (Name == "mem-size-profile") {
+                        MPM.addPass(MemSizeProfile());
+                        return true;
+                      }
+                      if (Name == "mem-size-specialization") {
+                        MPM.addPass(MemSizeSpecialization());
+                        return true;
+                      }
+                      if (Name == "memory-trace") {
+                        MPM.addPass(MemoryTrace());
+                        return true;
+                      }
+                      if (Name == "profile-inline-hints") {
+                        MPM.addPass(InlineHints());
+                        return true;
+                      }
+                      return false;
+                    });
+                PB.registerPipelineParsingCallback(
+                    [](StringRef Name, FunctionPassManager &FPM,
+                       ArrayRef<PassBuilder::PipelineElement>) {
+                      if (Name == "branch-to-select") {
+                        FPM.addPass(BranchToSelect());
+                        return true;
+                      }
+                      return false;
+                    });
+                // All at the start of the pipeline, so that the use sees the
+                // same sites the instrumentation numbered. The branch and
+                // length profiles add direct calls, and promotion and
+                // specialization add direct calls and branches, so they come
+                // after the passes that number them. Promotion last, as it
+                // can turn an indirect call into a direct memcpy.
+                PB.registerPipelineStartEPCallback([](ModulePassManager &MPM,
+                                                      OptimizationLevel Level) {
+                    if (ProfileGenerate) {
+                        MPM.addPass(CallEdgeProfile());
+                        MPM.addPass(IndirectCallProfile());
+                        MPM.addPass(BranchBiasProfile());
+                        MPM.addPass(MemSizeProfile());
+                    }
+                    if (profiling::ProfileData::get()) {
+                        MPM.addPass(InlineHints());
+                        MPM.addPass(BranchPredictability());
+                        MPM.addPass(MemSizeSpecialization());
+                        MPM.addPass(IndirectCallPromotion());
+                    }
+                });
+                // Once the arms of the branches are cleaned up, but before
+                // the backend chooses between branches and selects
+                PB.registerScalarOptimizerLateEPCallback([](FunctionPassManager &FPM,
+                                                            OptimizationLevel Level) {
+                    if (profiling::ProfileData::get() || branchToSelectStatic())
+                        FPM.addPass(BranchToSelect());
+                });
+                // Only the accesses left after optimization are traced, a
+                // lock site inlined in several callers is one site in each,
+                // printf calls are seen as simplified, and functions
+                // inlined everywhere are gone from the hot text
+                PB.registerOptimizerLastEPCallback([](ModulePassManager &MPM,
+                                                      OptimizationLevel Level) {
+                    if (MemoryTraceGenerate)
+                        MPM.addPass(MemoryTrace());
+                    if (LockProfileGenerate)
+                        MPM.addPass(LockContention());
+                    if (IOProfileGenerate)
+                        MPM.addPass(IOProfile());
+                    if (HotText && profiling::ProfileData::get())
+                        MPM.addPass(HotTextLayout());
+                });
+            }};
+}
+
+// Entry point for the pass plugin
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+    return getProfilingPluginInfo();
+}
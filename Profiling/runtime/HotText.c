@@ -0,0 +1,150 @@
+//===- HotText.c - Move the hot text onto transparent huge pages ----------===//
+//
+// Instrumented modules with hot functions call __sr_hot_text_register from
+// a constructor, with the 2 MB aligned start of the group of hot text the
+// linker gathered and their last hot function. Once all the modules of an
+// executable or library have, a single constructor of it calls
+// __sr_hot_text_remap: the huge pages the group overlaps, within the
+// executable segment that holds it, are copied to an anonymous mapping
+// aligned to a huge page, advised MADV_HUGEPAGE before it is written to,
+// made executable, and moved over the original text with mremap, which
+// replaces the pages at once: even the code running the remap stays in
+// place, with the same bytes. Libraries loaded with dlopen are moved the
+// same way, possibly while other threads run.
+//
+// SR_HOT_TEXT=0 turns it off, and SR_HOT_TEXT_VERBOSE=1 tells what is done
+// on stderr. The moved pages are no longer backed by the executable, so
+// profilers that find code through the file mappings, such as perf, no
+// longer see them as part of it.
+//
+//===----------------------------------------------------------------------===//
+
+#define _GNU_SOURCE
+#include <link.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SR_HUGE_PAGE ((uintptr_t)2 << 20)
+
+// Groups of hot text, one per executable or library: the modules of one
+// share its start, and each pushes its end to its last hot function
+#define SR_HOT_TEXT_MAX 16
+static struct sr_group {
+    uintptr_t Start, Stop;
+    int Moved;
+} Groups[SR_HOT_TEXT_MAX];
+static unsigned NumGroups;
+// Protects the groups
+static pthread_mutex_t Mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct sr_segment {
+    uintptr_t Address;
+    uintptr_t Begin, End;
+};
+
+// Finds the executable segment that holds Address
+static int findSegment(struct dl_phdr_info *Info, size_t Size, void *Data) {
+    (void)Size;
+    struct sr_segment *S = Data;
+    for (unsigned I = 0; I < Info->dlpi_phnum; ++I) {
+        const ElfW(Phdr) *P = &Info->dlpi_phdr[I];
+        if (P->p_type != PT_LOAD || !(P->p_flags & PF_X))
+            continue;
+        uintptr_t Begin = Info->dlpi_addr + P->p_vaddr;
+        if (S->Address >= Begin && S->Address < Begin + P->p_memsz) {
+            S->Begin = Begin;
+            S->End = Begin + P->p_memsz;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int verbose(void) {
+    const char *Value = getenv("SR_HOT_TEXT_VERBOSE");
+    return Value && *Value && strcmp(Value, "0");
+}
+
+// Moves the huge pages the group overlaps, within its segment
+static void remap(const struct sr_group *G) {
+    struct sr_segment S = {G->Start, 0, 0};
+    if (!dl_iterate_phdr(findSegment, &S))
+        return;
+    uintptr_t From = G->Start & ~(SR_HUGE_PAGE - 1);
+    uintptr_t To = (G->Stop + SR_HUGE_PAGE) & ~(SR_HUGE_PAGE - 1);
+    if (From < S.Begin)
+        From += SR_HUGE_PAGE;
+    if (To > S.End)
+        To -= SR_HUGE_PAGE;
+    if (From >= To) {
+        if (verbose())
+            fprintf(stderr, "hot-text: hot text at %p covers no whole huge page\n",
+                    (void *)G->Start);
+        return;
+    }
+
+    // An anonymous mapping aligned to a huge page, written once advised
+    size_t Len = To - From;
+    char *Map = mmap(NULL, Len + SR_HUGE_PAGE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Map == MAP_FAILED) {
+        perror("hot-text: mmap");
+        return;
+    }
+    uintptr_t Slack = -(uintptr_t)Map & (SR_HUGE_PAGE - 1);
+    char *Copy = Map + Slack;
+    if (Slack)
+        munmap(Map, Slack);
+    if (SR_HUGE_PAGE - Slack)
+        munmap(Copy + Len, SR_HUGE_PAGE - Slack);
+    madvise(Copy, Len, MADV_HUGEPAGE);
+    memcpy(Copy, (void *)From, Len);
+    if (mprotect(Copy, Len, PROT_READ | PROT_EXEC) ||
+        mremap(Copy, Len, Len, MREMAP_MAYMOVE | MREMAP_FIXED, (void *)From) == MAP_FAILED) {
+        perror("hot-text: remap");
+        munmap(Copy, Len);
+        return;
+    }
+    if (verbose())
+        fprintf(stderr, "hot-text: %zu KiB of hot text at %p: moved %zu KiB onto huge pages\n",
+                (size_t)(G->Stop - G->Start) >> 10, (void *)G->Start, Len >> 10);
+}
+
+static int enabled(void) {
+    const char *Value = getenv("SR_HOT_TEXT");
+    return !Value || strcmp(Value, "0");
+}
+
+static struct sr_group *findGroup(uintptr_t Start) {
+    for (unsigned I = 0; I < NumGroups; ++I)
+        if (Groups[I].Start == Start)
+            return &Groups[I];
+    return NULL;
+}
+
+void __sr_hot_text_register(char *Start, char *Last) {
+    pthread_mutex_lock(&Mutex);
+    struct sr_group *G = findGroup((uintptr_t)Start);
+    if (!G && NumGroups < SR_HOT_TEXT_MAX) {
+        G = &Groups[NumGroups++];
+        *G = (struct sr_group){(uintptr_t)Start, (uintptr_t)Start, 0};
+    }
+    if (G && (uintptr_t)Last > G->Stop)
+        G->Stop = (uintptr_t)Last;
+    pthread_mutex_unlock(&Mutex);
+}
+
+void __sr_hot_text_remap(char *Start) {
+    pthread_mutex_lock(&Mutex);
+    struct sr_group *G = findGroup((uintptr_t)Start);
+    if (G && !G->Moved && enabled()) {
+        G->Moved = 1;
+        remap(G);
+    }
+    pthread_mutex_unlock(&Mutex);
+}
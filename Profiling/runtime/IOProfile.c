@@ -0,0 +1,312 @@
+//===- IOProfile.c - Runtime of the I/O call profile ----------------------===//
+//
+// The instrumented I/O calls come here with the record of their site, in
+// the table of their module. Each wrapper times the real call and adds to
+// the record, with relaxed atomic operations, as an I/O call costs far more:
+// the calls, the bytes asked for and done, the short reads and writes, the
+// errors, and the request size in a histogram of powers of two.
+//
+// At exit, the sites are appended to SR_IO_FILE, "sr-io.txt" by default,
+// ranked by the time spent in them, in a single write. A site is a tiny-I/O
+// hotspot when it is called at least SR_IO_MIN_CALLS times (1000) for less
+// than SR_IO_TINY bytes (512) on average: each system call, or each stdio
+// call, then costs more than the bytes it moves.
+//
+//===----------------------------------------------------------------------===//
+
+#define _GNU_SOURCE
+#include "RuntimeUtil.h"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Bucket 0 counts empty requests, and bucket B requests from 2^(B-1) to
+// 2^B - 1 bytes; the last one also counts all larger requests. Must match
+// IOSizeBuckets in IOProfile.h.
+#define SR_IO_BUCKETS 32
+
+// Must match IOProfile.cpp
+struct sr_io_site {
+    const char *Function;
+    const char *Location;
+    const char *Call;
+    uint64_t Calls;
+    uint64_t Asked;
+    uint64_t Done;
+    uint64_t Short;
+    uint64_t Errors;
+    uint64_t Ns;
+    uint64_t MaxNs;
+    uint64_t Sizes[SR_IO_BUCKETS];
+};
+
+struct sr_io_table {
+    struct sr_io_site *Sites;
+    uint32_t N;
+    struct sr_io_table *Next;
+};
+
+static struct sr_io_table *Tables;
+
+static uint64_t now(void) {
+    struct timespec T;
+    clock_gettime(CLOCK_MONOTONIC, &T);
+    return (uint64_t)T.tv_sec * 1000000000u + (uint64_t)T.tv_nsec;
+}
+
+static void add(uint64_t *Counter, uint64_t N) {
+    __atomic_fetch_add(Counter, N, __ATOMIC_RELAXED);
+}
+
+// Counts a call that asked for Asked bytes and did Done, or failed when
+// Done is negative, since Start
+static void record(struct sr_io_site *S, uint64_t Asked, int64_t Done, uint64_t Start) {
+    uint64_t Ns = now() - Start;
+    add(&S->Calls, 1);
+    add(&S->Asked, Asked);
+    if (Done < 0)
+        add(&S->Errors, 1);
+    else {
+        add(&S->Done, (uint64_t)Done);
+        if ((uint64_t)Done < Asked)
+            add(&S->Short, 1);
+    }
+    add(&S->Ns, Ns);
+    uint64_t Max = __atomic_load_n(&S->MaxNs, __ATOMIC_RELAXED);
+    while (Ns > Max &&
+           !__atomic_compare_exchange_n(&S->MaxNs, &Max, Ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    unsigned B = Asked ? 64 - __builtin_clzll(Asked) : 0;
+    add(&S->Sizes[B < SR_IO_BUCKETS ? B : SR_IO_BUCKETS - 1], 1);
+}
+
+ssize_t __sr_io_read(struct sr_io_site *S, int Fd, void *Buf, size_t N) {
+    uint64_t Start = now();
+    ssize_t Result = read(Fd, Buf, N);
+    record(S, N, Result, Start);
+    return Result;
+}
+
+ssize_t __sr_io_write(struct sr_io_site *S, int Fd, const void *Buf, size_t N) {
+    uint64_t Start = now();
+    ssize_t Result = write(Fd, Buf, N);
+    record(S, N, Result, Start);
+    return Result;
+}
+
+ssize_t __sr_io_pread(struct sr_io_site *S, int Fd, void *Buf, size_t N, off_t Offset) {
+    uint64_t Start = now();
+    ssize_t Result = pread(Fd, Buf, N, Offset);
+    record(S, N, Result, Start);
+    return Result;
+}
+
+ssize_t __sr_io_pwrite(struct sr_io_site *S, int Fd, const void *Buf, size_t N, off_t Offset) {
+    uint64_t Start = now();
+    ssize_t Result = pwrite(Fd, Buf, N, Offset);
+    record(S, N, Result, Start);
+    return Result;
+}
+
+ssize_t __sr_io_recv(struct sr_io_site *S, int Fd, void *Buf, size_t N, int Flags) {
+    uint64_t Start = now();
+    ssize_t Result = recv(Fd, Buf, N, Flags);
+    record(S, N, Result, Start);
+    return Result;
+}
+
+ssize_t __sr_io_send(struct sr_io_site *S, int Fd, const void *Buf, size_t N, int Flags) {
+    uint64_t Start = now();
+    ssize_t Result = send(Fd, Buf, N, Flags);
+    record(S, N, Result, Start);
+    return Result;
+}
+
+// An error shows as a short count of items, which ferror tells apart
+size_t __sr_io_fread(struct sr_io_site *S, void *Buf, size_t Size, size_t N, FILE *F) {
+    uint64_t Start = now();
+    size_t Result = fread(Buf, Size, N, F);
+    record(S, Size * N, (int64_t)(Result * Size), Start);
+    return Result;
+}
+
+size_t __sr_io_fwrite(struct sr_io_site *S, const void *Buf, size_t Size, size_t N, FILE *F) {
+    uint64_t Start = now();
+    size_t Result = fwrite(Buf, Size, N, F);
+    record(S, Size * N, (int64_t)(Result * Size), Start);
+    return Result;
+}
+
+// The formatted output functions ask for the bytes they produce
+int __sr_io_printf(struct sr_io_site *S, const char *Format, ...) {
+    va_list Args;
+    va_start(Args, Format);
+    uint64_t Start = now();
+    int Result = vprintf(Format, Args);
+    record(S, Result < 0 ? 0 : (uint64_t)Result, Result, Start);
+    va_end(Args);
+    return Result;
+}
+
+int __sr_io_fprintf(struct sr_io_site *S, FILE *F, const char *Format, ...) {
+    va_list Args;
+    va_start(Args, Format);
+    uint64_t Start = now();
+    int Result = vfprintf(F, Format, Args);
+    record(S, Result < 0 ? 0 : (uint64_t)Result, Result, Start);
+    va_end(Args);
+    return Result;
+}
+
+int __sr_io_puts(struct sr_io_site *S, const char *Str) {
+    uint64_t Start = now();
+    int Result = puts(Str);
+    size_t N = strlen(Str) + 1;
+    record(S, N, Result < 0 ? -1 : (int64_t)N, Start);
+    return Result;
+}
+
+int __sr_io_fputs(struct sr_io_site *S, const char *Str, FILE *F) {
+    uint64_t Start = now();
+    int Result = fputs(Str, F);
+    size_t N = strlen(Str);
+    record(S, N, Result < 0 ? -1 : (int64_t)N, Start);
+    return Result;
+}
+
+int __sr_io_putchar(struct sr_io_site *S, int C) {
+    uint64_t Start = now();
+    int Result = putchar(C);
+    record(S, 1, Result == EOF ? -1 : 1, Start);
+    return Result;
+}
+
+int __sr_io_fputc(struct sr_io_site *S, int C, FILE *F) {
+    uint64_t Start = now();
+    int Result = fputc(C, F);
+    record(S, 1, Result == EOF ? -1 : 1, Start);
+    return Result;
+}
+
+static uint64_t envOr(const char *Name, uint64_t Default) {
+    const char *Value = getenv(Name);
+    return Value && *Value ? strtoull(Value, NULL, 0) : Default;
+}
+
+// Whether each call of the site is a system call, rather than a call of
+// stdio, which buffers
+static int isSystemCall(const char *Call) {
+    static const char *const Calls[] = {"read",     "write", "pread", "pread64",
+                                        "pwrite",   "pwrite64", "recv", "send"};
+    for (unsigned I = 0; I < sizeof(Calls) / sizeof(*Calls); ++I)
+        if (!strcmp(Call, Calls[I]))
+            return 1;
+    return 0;
+}
+
+static int isRead(const char *Call) {
+    return !strncmp(Call, "read", 4) || !strncmp(Call, "pread", 5) || !strcmp(Call, "recv") ||
+           !strcmp(Call, "fread");
+}
+
+static int byTime(const void *A, const void *B) {
+    const struct sr_io_site *SA = *(struct sr_io_site *const *)A;
+    const struct sr_io_site *SB = *(struct sr_io_site *const *)B;
+    return SA->Ns < SB->Ns ? 1 : SA->Ns > SB->Ns ? -1 : 0;
+}
+
+static void writeReport(void) {
+    uint64_t Tiny = envOr("SR_IO_TINY", 512);
+    uint64_t MinCalls = envOr("SR_IO_MIN_CALLS", 1000);
+    uint32_t N = 0;
+    for (struct sr_io_table *T = Tables; T; T = T->Next)
+        N += T->N;
+    struct sr_io_site **Order = malloc((N ? N : 1) * sizeof(*Order));
+    if (!Order)
+        return;
+    N = 0;
+    uint64_t Calls = 0, Ns = 0;
+    for (struct sr_io_table *T = Tables; T; T = T->Next)
+        for (uint32_t I = 0; I < T->N; ++I) {
+            struct sr_io_site *S = &T->Sites[I];
+            if (!__atomic_load_n(&S->Calls, __ATOMIC_RELAXED))
+                continue;
+            Order[N++] = S;
+            Calls += S->Calls;
+            Ns += S->Ns;
+        }
+    qsort(Order, N, sizeof(*Order), byTime);
+
+    char *Buf = NULL;
+    size_t Len = 0;
+    FILE *Out = open_memstream(&Buf, &Len);
+    if (!Out) {
+        free(Order);
+        return;
+    }
+    unsigned Hotspots = 0;
+    for (uint32_t K = 0; K < N; ++K)
+        Hotspots += Order[K]->Calls >= MinCalls && Order[K]->Asked / Order[K]->Calls < Tiny;
+    fprintf(Out, "io-profile: pid %d: %u sites, %llu calls, ", (int)getpid(), N,
+            (unsigned long long)Calls);
+    printTime(Out, Ns);
+    fprintf(Out, " in I/O, %u tiny-I/O hotspots\n", Hotspots);
+    for (uint32_t K = 0; K < N; ++K) {
+        struct sr_io_site *S = Order[K];
+        uint64_t Mean = S->Asked / S->Calls;
+        fprintf(Out, "  %s %s in %s: %llu calls, %llu bytes, %llu per call, ", S->Call,
+                S->Location, S->Function, (unsigned long long)S->Calls,
+                (unsigned long long)S->Done, (unsigned long long)Mean);
+        printTime(Out, S->Ns);
+        fprintf(Out, " (");
+        printTime(Out, S->Ns / S->Calls);
+        fprintf(Out, " per call, max ");
+        printTime(Out, S->MaxNs);
+        fprintf(Out, ")");
+        if (S->Short)
+            fprintf(Out, ", %llu short", (unsigned long long)S->Short);
+        if (S->Errors)
+            fprintf(Out, ", %llu errors", (unsigned long long)S->Errors);
+        fprintf(Out, "\n    sizes:");
+        for (unsigned B = 0; B < SR_IO_BUCKETS; ++B)
+            if (S->Sizes[B])
+                fprintf(Out, " %llu:%llu", B ? 1ull << (B - 1) : 0ull,
+                        (unsigned long long)S->Sizes[B]);
+        fprintf(Out, "\n");
+        if (S->Calls < MinCalls || Mean >= Tiny)
+            continue;
+        int System = isSystemCall(S->Call);
+        const char *Advice;
+        if (System)
+            Advice = isRead(S->Call) ? "read into a larger buffer, or gather the reads with readv"
+                                     : "buffer the data, or gather the writes with writev";
+        else
+            Advice = isRead(S->Call) ? "read larger blocks at once"
+                                     : "format the items into a larger buffer and write it once";
+        fprintf(Out, "    tiny I/O: one %s call per %llu bytes; %s\n", System ? "system" : "stdio",
+                (unsigned long long)Mean, Advice);
+    }
+    fclose(Out);
+    free(Order);
+
+    appendOutput("SR_IO_FILE", "sr-io.txt", "sr-io", Buf, Len);
+    free(Buf);
+}
+
+void __sr_io_register(struct sr_io_site *Sites, uint32_t N) {
+    struct sr_io_table *T = malloc(sizeof(*T));
+    if (!T)
+        return;
+    if (!Tables)
+        atexit(writeReport);
+    T->Sites = Sites;
+    T->N = N;
+    T->Next = Tables;
+    Tables = T;
+}
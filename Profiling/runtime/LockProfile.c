@@ -0,0 +1,419 @@
+//===- LockProfile.c - Runtime of the lock contention profile -------------===//
+//
+// The instrumented calls of pthread locking functions come here with their
+// site. A lock is tried first; only when it is taken does the thread read
+// the clock, block in the real function, and count the wait at the site, in
+// a histogram of powers of two nanoseconds. Each thread also remembers the
+// locks it holds and where it took them, so that unlocking, and waiting on
+// a condition variable, which releases the mutex, count the hold time at
+// the site that took the lock.
+//
+// Counts go to a table per thread, without any atomic operation, which is
+// merged into the process table when the thread exits. At exit, the sites
+// are appended to SR_LOCK_FILE, "sr-locks.txt" by default, ranked by total
+// contended wait, in a single write. Threads still running are included as
+// they are.
+//
+//===----------------------------------------------------------------------===//
+
+#define _GNU_SOURCE
+#include "RuntimeUtil.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Must match LockContention.cpp
+struct sr_lock_site {
+    const char *Function;
+    const char *Location;
+    const char *Call;
+    uint32_t Id;
+};
+
+// Bucket B counts waits from 2^B to 2^(B+1) - 1 nanoseconds; the last one,
+// from 2^39 ns, about 9 minutes, also counts the longer ones
+#define SR_LOCK_BUCKETS 40
+
+struct sr_lock_stats {
+    uint64_t Acquired;
+    uint64_t Contended;
+    uint64_t WaitNs;
+    uint64_t MaxWaitNs;
+    uint64_t HoldNs;
+    uint64_t Holds;
+    uint64_t CondWaitNs;
+    uint64_t Waits[SR_LOCK_BUCKETS];
+};
+
+struct sr_lock_table {
+    struct sr_lock_site *Sites;
+    uint32_t N;
+    struct sr_lock_table *Next;
+};
+
+// Locks a thread holds at once that it can tell the hold time of
+#define SR_LOCK_HELD 16
+
+struct sr_lock_thread {
+    struct sr_lock_stats *Stats;
+    uint32_t NumStats;
+    struct {
+        void *Lock;
+        uint32_t Site;
+        uint64_t Since;
+    } Held[SR_LOCK_HELD];
+    uint32_t NumHeld;
+    struct sr_lock_thread *Next, **Prev;
+};
+
+static struct sr_lock_table *Tables;
+static uint32_t NumSites;
+// Protects the list of live threads and the table of exited ones
+static pthread_mutex_t Mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct sr_lock_thread *Threads;
+static struct sr_lock_stats *Exited;
+static uint32_t NumExited;
+static pthread_key_t ThreadKey;
+static pthread_once_t Once = PTHREAD_ONCE_INIT;
+static __thread struct sr_lock_thread *Thread;
+
+static uint64_t now(void) {
+    struct timespec T;
+    clock_gettime(CLOCK_MONOTONIC, &T);
+    return (uint64_t)T.tv_sec * 1000000000u + (uint64_t)T.tv_nsec;
+}
+
+static void addStats(struct sr_lock_stats *To, const struct sr_lock_stats *From) {
+    To->Acquired += From->Acquired;
+    To->Contended += From->Contended;
+    To->WaitNs += From->WaitNs;
+    if (From->MaxWaitNs > To->MaxWaitNs)
+        To->MaxWaitNs = From->MaxWaitNs;
+    To->HoldNs += From->HoldNs;
+    To->Holds += From->Holds;
+    To->CondWaitNs += From->CondWaitNs;
+    for (unsigned B = 0; B < SR_LOCK_BUCKETS; ++B)
+        To->Waits[B] += From->Waits[B];
+}
+
+// Adds N stats to the table of Exited, growing it as needed; under Mutex
+static void mergeExited(const struct sr_lock_stats *Stats, uint32_t N) {
+    if (N > NumExited) {
+        struct sr_lock_stats *Grown = realloc(Exited, N * sizeof(*Grown));
+        if (!Grown)
+            return;
+        memset(Grown + NumExited, 0, (N - NumExited) * sizeof(*Grown));
+        Exited = Grown;
+        NumExited = N;
+    }
+    for (uint32_t I = 0; I < N; ++I)
+        addStats(&Exited[I], &Stats[I]);
+}
+
+static void threadExit(void *Arg) {
+    struct sr_lock_thread *T = Arg;
+    pthread_mutex_lock(&Mutex);
+    mergeExited(T->Stats, T->NumStats);
+    *T->Prev = T->Next;
+    if (T->Next)
+        T->Next->Prev = T->Prev;
+    pthread_mutex_unlock(&Mutex);
+    free(T->Stats);
+    free(T);
+    Thread = NULL;
+}
+
+static void init(void) { pthread_key_create(&ThreadKey, threadExit); }
+
+static struct sr_lock_thread *threadState(void) {
+    if (Thread)
+        return Thread;
+    pthread_once(&Once, init);
+    struct sr_lock_thread *T = calloc(1, sizeof(*T));
+    if (!T)
+        return NULL;
+    pthread_mutex_lock(&Mutex);
+    T->Next = Threads;
+    T->Prev = &Threads;
+    if (Threads)
+        Threads->Prev = &T->Next;
+    Threads = T;
+    pthread_mutex_unlock(&Mutex);
+    pthread_setspecific(ThreadKey, T);
+    return Thread = T;
+}
+
+// The stats of the site in the table of this thread, grown to every site
+// registered so far, since libraries may be loaded later
+static struct sr_lock_stats *siteStats(struct sr_lock_thread *T, uint32_t Id) {
+    if (Id >= T->NumStats) {
+        uint32_t N = __atomic_load_n(&NumSites, __ATOMIC_RELAXED);
+        if (Id >= N)
+            return NULL;
+        struct sr_lock_stats *Grown = calloc(N, sizeof(*Grown));
+        if (!Grown)
+            return NULL;
+        // The report reads the old table under Mutex, possibly while this
+        // thread runs: it is only freed once replaced
+        pthread_mutex_lock(&Mutex);
+        struct sr_lock_stats *Old = T->Stats;
+        if (Old)
+            memcpy(Grown, Old, T->NumStats * sizeof(*Grown));
+        T->Stats = Grown;
+        T->NumStats = N;
+        pthread_mutex_unlock(&Mutex);
+        free(Old);
+    }
+    return &T->Stats[Id];
+}
+
+static void acquired(struct sr_lock_site *Site, void *Lock, uint64_t WaitStart) {
+    struct sr_lock_thread *T = threadState();
+    struct sr_lock_stats *S = T ? siteStats(T, Site->Id) : NULL;
+    if (!S)
+        return;
+    ++S->Acquired;
+    uint64_t Now = now();
+    if (WaitStart) {
+        uint64_t Wait = Now - WaitStart;
+        ++S->Contended;
+        S->WaitNs += Wait;
+        if (Wait > S->MaxWaitNs)
+            S->MaxWaitNs = Wait;
+        unsigned B = Wait ? 63 - __builtin_clzll(Wait) : 0;
+        ++S->Waits[B < SR_LOCK_BUCKETS ? B : SR_LOCK_BUCKETS - 1];
+    }
+    if (T->NumHeld < SR_LOCK_HELD) {
+        T->Held[T->NumHeld].Lock = Lock;
+        T->Held[T->NumHeld].Site = Site->Id;
+        T->Held[T->NumHeld].Since = Now;
+        ++T->NumHeld;
+    }
+}
+
+// Counts the hold time of Lock up to now, if this thread took it at a
+// site. With Keep, it still holds it, as a condition variable takes it
+// back, and the hold time restarts when the wait returns.
+static int heldIndex(struct sr_lock_thread *T, void *Lock) {
+    for (uint32_t I = T->NumHeld; I-- > 0;)
+        if (T->Held[I].Lock == Lock)
+            return (int)I;
+    return -1;
+}
+
+static void released(void *Lock, int Keep) {
+    struct sr_lock_thread *T = Thread;
+    int I = T ? heldIndex(T, Lock) : -1;
+    if (I < 0)
+        return;
+    struct sr_lock_stats *S = siteStats(T, T->Held[I].Site);
+    if (S) {
+        S->HoldNs += now() - T->Held[I].Since;
+        S->Holds += !Keep;
+    }
+    if (!Keep)
+        T->Held[I] = T->Held[--T->NumHeld];
+}
+
+// Only a busy lock is waited for; any other result of the try, such as
+// EOWNERDEAD, which still acquires a robust mutex, is the caller's
+int __sr_mutex_lock(struct sr_lock_site *Site, pthread_mutex_t *M) {
+    int Result = pthread_mutex_trylock(M);
+    if (Result != EBUSY) {
+        if (Result == 0 || Result == EOWNERDEAD)
+            acquired(Site, M, 0);
+        return Result;
+    }
+    uint64_t Start = now();
+    Result = pthread_mutex_lock(M);
+    if (Result == 0 || Result == EOWNERDEAD)
+        acquired(Site, M, Start);
+    return Result;
+}
+
+int __sr_rwlock_rdlock(struct sr_lock_site *Site, pthread_rwlock_t *L) {
+    int Result = pthread_rwlock_tryrdlock(L);
+    if (Result != EBUSY) {
+        if (Result == 0)
+            acquired(Site, L, 0);
+        return Result;
+    }
+    uint64_t Start = now();
+    Result = pthread_rwlock_rdlock(L);
+    if (Result == 0)
+        acquired(Site, L, Start);
+    return Result;
+}
+
+int __sr_rwlock_wrlock(struct sr_lock_site *Site, pthread_rwlock_t *L) {
+    int Result = pthread_rwlock_trywrlock(L);
+    if (Result != EBUSY) {
+        if (Result == 0)
+            acquired(Site, L, 0);
+        return Result;
+    }
+    uint64_t Start = now();
+    Result = pthread_rwlock_wrlock(L);
+    if (Result == 0)
+        acquired(Site, L, Start);
+    return Result;
+}
+
+int __sr_mutex_unlock(pthread_mutex_t *M) {
+    released(M, 0);
+    return pthread_mutex_unlock(M);
+}
+
+int __sr_rwlock_unlock(pthread_rwlock_t *L) {
+    released(L, 0);
+    return pthread_rwlock_unlock(L);
+}
+
+// The time a condition wait blocks is kept apart from the contended waits
+// the sites are ranked by: it is mostly waiting for the condition, as idle
+// workers do, not for the mutex. The mutex stays held by the site that took
+// it.
+static void condWaited(struct sr_lock_site *Site, pthread_mutex_t *M, uint64_t Start) {
+    struct sr_lock_thread *T = threadState();
+    struct sr_lock_stats *S = T ? siteStats(T, Site->Id) : NULL;
+    uint64_t Now = now();
+    if (S) {
+        ++S->Acquired;
+        S->CondWaitNs += Now - Start;
+    }
+    int I = T ? heldIndex(T, M) : -1;
+    if (I >= 0)
+        T->Held[I].Since = Now;
+}
+
+int __sr_cond_wait(struct sr_lock_site *Site, pthread_cond_t *C, pthread_mutex_t *M) {
+    released(M, 1);
+    uint64_t Start = now();
+    int Result = pthread_cond_wait(C, M);
+    condWaited(Site, M, Start);
+    return Result;
+}
+
+int __sr_cond_timedwait(struct sr_lock_site *Site, pthread_cond_t *C, pthread_mutex_t *M,
+                        const struct timespec *Until) {
+    released(M, 1);
+    uint64_t Start = now();
+    int Result = pthread_cond_timedwait(C, M, Until);
+    condWaited(Site, M, Start);
+    return Result;
+}
+
+static int byWait(const void *A, const void *B) {
+    const struct sr_lock_stats *SA = *(struct sr_lock_stats *const *)A;
+    const struct sr_lock_stats *SB = *(struct sr_lock_stats *const *)B;
+    return SA->WaitNs < SB->WaitNs ? 1 : SA->WaitNs > SB->WaitNs ? -1 : 0;
+}
+
+static struct sr_lock_site *siteOf(uint32_t Id) {
+    for (struct sr_lock_table *T = Tables; T; T = T->Next)
+        if (Id >= T->Sites[0].Id && Id < T->Sites[0].Id + T->N)
+            return &T->Sites[Id - T->Sites[0].Id];
+    return NULL;
+}
+
+static void writeReport(void) {
+    pthread_mutex_lock(&Mutex);
+    struct sr_lock_stats *Total = calloc(NumSites ? NumSites : 1, sizeof(*Total));
+    struct sr_lock_stats **Order = calloc(NumSites ? NumSites : 1, sizeof(*Order));
+    if (!Total || !Order) {
+        pthread_mutex_unlock(&Mutex);
+        free(Total);
+        free(Order);
+        return;
+    }
+    for (uint32_t I = 0; I < NumExited && I < NumSites; ++I)
+        addStats(&Total[I], &Exited[I]);
+    for (struct sr_lock_thread *T = Threads; T; T = T->Next)
+        for (uint32_t I = 0; I < T->NumStats && I < NumSites; ++I)
+            addStats(&Total[I], &T->Stats[I]);
+    pthread_mutex_unlock(&Mutex);
+
+    uint32_t N = 0;
+    uint64_t TotalWait = 0;
+    for (uint32_t I = 0; I < NumSites; ++I)
+        if (Total[I].Acquired) {
+            Order[N++] = &Total[I];
+            TotalWait += Total[I].WaitNs;
+        }
+    qsort(Order, N, sizeof(*Order), byWait);
+
+    char *Buf = NULL;
+    size_t Len = 0;
+    FILE *Out = open_memstream(&Buf, &Len);
+    if (!Out) {
+        free(Total);
+        free(Order);
+        return;
+    }
+    fprintf(Out, "lock-contention: pid %d: %u sites, ", (int)getpid(), N);
+    printTime(Out, TotalWait);
+    fprintf(Out, " waited\n");
+    for (uint32_t K = 0; K < N; ++K) {
+        struct sr_lock_stats *S = Order[K];
+        struct sr_lock_site *Site = siteOf((uint32_t)(S - Total));
+        fprintf(Out, "  %s %s in %s: ", Site ? Site->Call : "?", Site ? Site->Location : "?",
+                Site ? Site->Function : "?");
+        printTime(Out, S->WaitNs);
+        fprintf(Out, " waited, %llu of %llu acquisitions contended",
+                (unsigned long long)S->Contended, (unsigned long long)S->Acquired);
+        if (S->Contended) {
+            fprintf(Out, ", max ");
+            printTime(Out, S->MaxWaitNs);
+        }
+        if (S->Holds) {
+            fprintf(Out, ", held ");
+            printTime(Out, S->HoldNs / S->Holds);
+            fprintf(Out, " on average");
+        }
+        if (S->CondWaitNs) {
+            fprintf(Out, ", ");
+            printTime(Out, S->CondWaitNs);
+            fprintf(Out, " in condition waits");
+        }
+        fprintf(Out, "\n");
+        if (!S->Contended)
+            continue;
+        fprintf(Out, "    waits of at least:");
+        for (unsigned B = 0; B < SR_LOCK_BUCKETS; ++B)
+            if (S->Waits[B]) {
+                fprintf(Out, " ");
+                printTime(Out, 1ull << B);
+                fprintf(Out, ":%llu", (unsigned long long)S->Waits[B]);
+            }
+        fprintf(Out, "\n");
+    }
+    fclose(Out);
+    free(Total);
+    free(Order);
+
+    appendOutput("SR_LOCK_FILE", "sr-locks.txt", "sr-locks", Buf, Len);
+    free(Buf);
+}
+
+void __sr_lock_register(struct sr_lock_site *Sites, uint32_t N) {
+    struct sr_lock_table *T = malloc(sizeof(*T));
+    if (!T || !N) {
+        free(T);
+        return;
+    }
+    if (!Tables)
+        atexit(writeReport);
+    uint32_t First = __atomic_fetch_add(&NumSites, N, __ATOMIC_RELAXED);
+    for (uint32_t I = 0; I < N; ++I)
+        Sites[I].Id = First + I;
+    T->Sites = Sites;
+    T->N = N;
+    T->Next = Tables;
+    Tables = T;
+}
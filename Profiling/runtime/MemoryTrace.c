@@ -0,0 +1,414 @@
+//===- MemoryTrace.c - Runtime of the memory access trace -----------------===//
+//
+// Instrumented accesses call __sr_trace_access when the thread-local
+// countdown runs out. Each thread records bursts of SR_TRACE_BURST
+// consecutive accesses, 65536 by default, and then skips about
+// SR_TRACE_PERIOD - SR_TRACE_BURST accesses, the period being 1048576 by
+// default and varied by up to a quarter so that bursts do not lock onto a
+// loop. Records go to a buffer per thread, which is appended as one chunk
+// to the file named by SR_TRACE_FILE, "sr-trace.bin" by default, in a
+// single write when it is full and when the thread exits. At exit, the
+// sites of the process are appended as a chunk too.
+//
+// With SR_TRACE_MODE=reuse, the accesses of each burst are not written but
+// go through a stack distance computation, in cache lines of SR_REUSE_LINE
+// bytes, 64 by default: the reuse distance of an access is the number of
+// distinct lines accessed since the last access to its line in the burst,
+// counted in a Fenwick tree over the times of the latest access to each
+// line, in O(log burst). Each loop counts a histogram of the reuse
+// distances of its accesses, in powers of two. At exit, the histograms of
+// every loop, including those of its inner loops, and the working sets
+// estimated from them are appended to SR_REUSE_FILE, "sr-reuse.txt" by
+// default. Distances are only seen within a burst, so SR_TRACE_BURST
+// bounds the largest working set that can be measured.
+//
+// Threads still running at exit lose the records they have not written.
+//
+//===----------------------------------------------------------------------===//
+
+#define _GNU_SOURCE
+#include "RuntimeUtil.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Must match ReuseBuckets in MemoryTrace.h. Bucket 0 counts the first
+// accesses to a line in a burst, 1 a distance of 0, and B > 1 distances
+// from 2^(B-2) to 2^(B-1) - 1.
+#define SR_REUSE_BUCKETS 40
+
+// Must match MemoryTrace.cpp
+struct sr_trace_loop {
+    const char *Function;
+    const char *Location;
+    struct sr_trace_loop *Parent;
+    uint32_t Depth;
+    uint64_t Reuses[SR_REUSE_BUCKETS];
+};
+
+struct sr_trace_site {
+    const char *Function;
+    const char *Location;
+    const char *Object;
+    struct sr_trace_loop *Loop;
+    uint32_t Size;
+    uint32_t IsStore;
+    uint32_t Id;
+};
+
+// The file is a sequence of chunks, each a header and Size bytes. Must
+// match tools/CacheSim.cpp.
+enum { SR_TRACE_ACCESSES = 0, SR_TRACE_SITES = 1 };
+
+struct sr_trace_chunk {
+    char Magic[4]; // "SRTR"
+    uint32_t Kind;
+    uint32_t Pid;
+    uint32_t Tid;
+    uint64_t Size;
+};
+
+struct sr_trace_record {
+    uint64_t Address;
+    uint32_t Site;
+    uint32_t Flags;
+};
+
+// Set on the first record of a burst
+#define SR_TRACE_BURST_START 1u
+
+#define SR_TRACE_BUFFER 65536
+
+struct sr_trace_table {
+    struct sr_trace_site *Sites;
+    uint32_t N;
+    struct sr_trace_loop *Loops;
+    uint32_t NumLoops;
+    struct sr_trace_table *Next;
+};
+
+// Stack distances within the current burst of a thread
+struct sr_reuse_state {
+    // Fenwick tree over the times 1..Burst of the burst, counting 1 at the
+    // time of the latest access to each line
+    uint32_t *Tree;
+    // Open addressing from line + 1 to the time of its latest access
+    uint64_t *Lines;
+    uint32_t *Times;
+    uint64_t Mask;
+    uint32_t Now;
+};
+
+struct sr_trace_thread {
+    struct sr_trace_chunk Header;
+    struct sr_trace_record Records[SR_TRACE_BUFFER];
+    uint32_t Len;
+    uint32_t Tid;
+    uint64_t BurstLeft;
+    uint64_t Random;
+    struct sr_reuse_state *Reuse;
+};
+
+__thread int64_t __sr_trace_countdown;
+static __thread struct sr_trace_thread *Thread;
+
+static struct sr_trace_table *Tables;
+static uint32_t NumSites;
+static int Fd = -1;
+static uint64_t Burst = 65536, Period = 1048576;
+static int ReuseMode;
+static uint64_t LineSize = 64, L1Size = 32768, L2Size = 1048576;
+static pthread_key_t ThreadKey;
+static pthread_once_t Once = PTHREAD_ONCE_INIT;
+
+static void flush(struct sr_trace_thread *T) {
+    if (!T->Len || Fd < 0)
+        return;
+    memcpy(T->Header.Magic, "SRTR", 4);
+    T->Header.Kind = SR_TRACE_ACCESSES;
+    T->Header.Pid = (uint32_t)getpid();
+    T->Header.Tid = T->Tid;
+    T->Header.Size = (uint64_t)T->Len * sizeof(struct sr_trace_record);
+    // The header sits right before the records, so that both go in one
+    // write and chunks of several threads do not interleave
+    writeAll(Fd, &T->Header, sizeof(T->Header) + T->Header.Size);
+    T->Len = 0;
+}
+
+static void freeReuse(struct sr_reuse_state *R) {
+    if (!R)
+        return;
+    free(R->Tree);
+    free(R->Lines);
+    free(R->Times);
+    free(R);
+}
+
+static void threadExit(void *T) {
+    flush(T);
+    freeReuse(((struct sr_trace_thread *)T)->Reuse);
+    free(T);
+    Thread = NULL;
+}
+
+static void writeSites(void) {
+    if (Thread)
+        flush(Thread);
+    char *Buf = NULL;
+    size_t Len = 0;
+    FILE *Out = Fd >= 0 ? open_memstream(&Buf, &Len) : NULL;
+    if (!Out)
+        return;
+    struct sr_trace_chunk Header = {{'S', 'R', 'T', 'R'}, SR_TRACE_SITES, (uint32_t)getpid(),
+                                    0, 0};
+    fwrite(&Header, sizeof(Header), 1, Out);
+    for (struct sr_trace_table *T = Tables; T; T = T->Next)
+        for (uint32_t I = 0; I < T->N; ++I) {
+            struct sr_trace_site *S = &T->Sites[I];
+            fprintf(Out, "%u\t%s\t%s\t%s\t%u\t%s\n", S->Id, S->Function, S->Location, S->Object,
+                    S->Size, S->IsStore ? "store" : "load");
+        }
+    fclose(Out);
+    ((struct sr_trace_chunk *)Buf)->Size = Len - sizeof(Header);
+    writeAll(Fd, Buf, Len);
+    free(Buf);
+}
+
+static struct sr_reuse_state *reuseState(struct sr_trace_thread *T) {
+    if (T->Reuse)
+        return T->Reuse;
+    struct sr_reuse_state *R = calloc(1, sizeof(*R));
+    uint64_t Capacity = 1;
+    while (Capacity < 2 * Burst)
+        Capacity <<= 1;
+    if (R) {
+        R->Tree = calloc(Burst + 1, sizeof(*R->Tree));
+        R->Lines = calloc(Capacity, sizeof(*R->Lines));
+        R->Times = calloc(Capacity, sizeof(*R->Times));
+        R->Mask = Capacity - 1;
+    }
+    if (!R || !R->Tree || !R->Lines || !R->Times) {
+        freeReuse(R);
+        return NULL;
+    }
+    T->Reuse = R;
+    return R;
+}
+
+static void treeAdd(struct sr_reuse_state *R, uint32_t Time, int32_t Delta) {
+    for (; Time <= Burst; Time += Time & -Time)
+        R->Tree[Time] += (uint32_t)Delta;
+}
+
+// Number of lines whose latest access was at a time up to Time
+static uint32_t treeCount(struct sr_reuse_state *R, uint32_t Time) {
+    uint32_t Count = 0;
+    for (; Time; Time -= Time & -Time)
+        Count += R->Tree[Time];
+    return Count;
+}
+
+static void reuseAccess(struct sr_trace_thread *T, struct sr_trace_site *Site, uint64_t Address,
+                        int NewBurst) {
+    struct sr_reuse_state *R = reuseState(T);
+    if (!R)
+        return;
+    if (NewBurst) {
+        memset(R->Tree, 0, (Burst + 1) * sizeof(*R->Tree));
+        memset(R->Lines, 0, (R->Mask + 1) * sizeof(*R->Lines));
+        R->Now = 0;
+    }
+    uint64_t Line = Address / LineSize + 1;
+    uint64_t Slot = (Line * 0x9e3779b97f4a7c15ull >> 20) & R->Mask;
+    while (R->Lines[Slot] && R->Lines[Slot] != Line)
+        Slot = (Slot + 1) & R->Mask;
+    uint32_t Now = ++R->Now;
+    unsigned Bucket = 0;
+    if (R->Lines[Slot]) {
+        uint32_t Last = R->Times[Slot];
+        uint32_t Distance = treeCount(R, Now - 1) - treeCount(R, Last);
+        Bucket = Distance ? 2 + (63 - __builtin_clzll(Distance)) : 1;
+        treeAdd(R, Last, -1);
+    }
+    treeAdd(R, Now, 1);
+    R->Lines[Slot] = Line;
+    R->Times[Slot] = Now;
+    if (Site->Loop)
+        __atomic_fetch_add(&Site->Loop->Reuses[Bucket], 1, __ATOMIC_RELAXED);
+}
+
+// Smallest reuse distance of bucket B
+static uint64_t bucketStart(unsigned B) { return B < 2 ? 0 : 1ull << (B - 2); }
+
+static void printBytes(FILE *Out, uint64_t Bytes) {
+    if (Bytes >= (1u << 20))
+        fprintf(Out, "%7.1f MiB", Bytes / 1048576.0);
+    else
+        fprintf(Out, "%7.1f KiB", Bytes / 1024.0);
+}
+
+// Per loop, its reuses and those of its inner loops: the fraction beyond
+// the L1 and the L2, which a fully associative LRU cache of that size would
+// miss, up to the rounding of the distances to powers of two, and the
+// working set, the distance in which 90% of the reuses fall
+static void writeReuse(void) {
+    char *Buf = NULL;
+    size_t Len = 0;
+    FILE *Out = open_memstream(&Buf, &Len);
+    if (!Out)
+        return;
+    fprintf(Out,
+            "reuse-distance: pid %d: distances in %llu B lines, within bursts of %llu accesses\n"
+            "      Reuses   First%%  >L1%%  >L2%%   Working set  Loop\n",
+            (int)getpid(), (unsigned long long)LineSize, (unsigned long long)Burst);
+    for (struct sr_trace_table *T = Tables; T; T = T->Next) {
+        uint64_t(*Incl)[SR_REUSE_BUCKETS] = calloc(T->NumLoops + 1, sizeof(*Incl));
+        if (!Incl)
+            break;
+        // Loops come in preorder: inner loops after their parents
+        for (uint32_t I = T->NumLoops; I-- > 0;) {
+            struct sr_trace_loop *L = &T->Loops[I];
+            for (unsigned B = 0; B < SR_REUSE_BUCKETS; ++B) {
+                Incl[I][B] += L->Reuses[B];
+                if (L->Parent)
+                    Incl[L->Parent - T->Loops][B] += Incl[I][B];
+            }
+        }
+        for (uint32_t I = 0; I < T->NumLoops; ++I) {
+            struct sr_trace_loop *L = &T->Loops[I];
+            uint64_t First = Incl[I][0], Reuses = 0, BeyondL1 = 0, BeyondL2 = 0;
+            for (unsigned B = 1; B < SR_REUSE_BUCKETS; ++B) {
+                Reuses += Incl[I][B];
+                BeyondL1 += bucketStart(B) >= L1Size / LineSize ? Incl[I][B] : 0;
+                BeyondL2 += bucketStart(B) >= L2Size / LineSize ? Incl[I][B] : 0;
+            }
+            if (!Reuses && !First)
+                continue;
+            uint64_t Covered = 0, WorkingSet = 0;
+            for (unsigned B = 1; B < SR_REUSE_BUCKETS && Reuses; ++B) {
+                Covered += Incl[I][B];
+                if (Covered * 10 >= Reuses * 9) {
+                    WorkingSet = (B < 2 ? 1 : 2 * bucketStart(B)) * LineSize;
+                    break;
+                }
+            }
+            fprintf(Out, "  %10llu  %6.2f %6.2f %6.2f  ", (unsigned long long)Reuses,
+                    100.0 * First / (First + Reuses), Reuses ? 100.0 * BeyondL1 / Reuses : 0.0,
+                    Reuses ? 100.0 * BeyondL2 / Reuses : 0.0);
+            printBytes(Out, WorkingSet);
+            fprintf(Out, "  %*s%s %s (depth %u)\n    distances:", 2 * (L->Depth - 1), "",
+                    L->Function, L->Location, L->Depth);
+            for (unsigned B = 1; B < SR_REUSE_BUCKETS; ++B)
+                if (Incl[I][B])
+                    fprintf(Out, " %llu:%llu", (unsigned long long)bucketStart(B),
+                            (unsigned long long)Incl[I][B]);
+            fprintf(Out, "\n");
+        }
+        free(Incl);
+    }
+    fclose(Out);
+
+    appendOutput("SR_REUSE_FILE", "sr-reuse.txt", "sr-reuse", Buf, Len);
+    free(Buf);
+}
+
+static uint64_t envValue(const char *Name, uint64_t Default) {
+    const char *Value = getenv(Name);
+    return Value && *Value ? strtoull(Value, NULL, 0) : Default;
+}
+
+static void init(void) {
+    Burst = envValue("SR_TRACE_BURST", Burst);
+    Period = envValue("SR_TRACE_PERIOD", Period);
+    if (!Burst)
+        Burst = 1;
+    // Times in a burst are 32 bits
+    if (Burst > UINT32_MAX - 1)
+        Burst = UINT32_MAX - 1;
+    if (Period < Burst)
+        Period = Burst;
+    const char *Mode = getenv("SR_TRACE_MODE");
+    ReuseMode = Mode && !strcmp(Mode, "reuse");
+    LineSize = envValue("SR_REUSE_LINE", LineSize);
+    if (!LineSize)
+        LineSize = 64;
+    L1Size = envValue("SR_REUSE_L1", L1Size);
+    L2Size = envValue("SR_REUSE_L2", L2Size);
+    pthread_key_create(&ThreadKey, threadExit);
+    if (ReuseMode)
+        return;
+    Fd = openOutput("SR_TRACE_FILE", "sr-trace.bin");
+    if (Fd < 0)
+        perror("sr-trace");
+}
+
+void __sr_trace_register(struct sr_trace_site *Sites, uint32_t N, struct sr_trace_loop *Loops,
+                         uint32_t NumLoops) {
+    struct sr_trace_table *T = malloc(sizeof(*T));
+    if (!T)
+        return;
+    pthread_once(&Once, init);
+    if (!Tables)
+        atexit(ReuseMode ? writeReuse : writeSites);
+    uint32_t First = __atomic_fetch_add(&NumSites, N, __ATOMIC_RELAXED);
+    for (uint32_t I = 0; I < N; ++I)
+        Sites[I].Id = First + I;
+    T->Sites = Sites;
+    T->N = N;
+    T->Loops = Loops;
+    T->NumLoops = NumLoops;
+    T->Next = Tables;
+    Tables = T;
+}
+
+static struct sr_trace_thread *threadState(void) {
+    if (Thread)
+        return Thread;
+    pthread_once(&Once, init);
+    Thread = calloc(1, sizeof(*Thread));
+    if (!Thread)
+        return NULL;
+    Thread->Tid = (uint32_t)syscall(SYS_gettid);
+    Thread->Random = 0x9e3779b97f4a7c15ull ^ Thread->Tid;
+    pthread_setspecific(ThreadKey, Thread);
+    return Thread;
+}
+
+// Between Period * 3/4 and Period * 5/4
+static uint64_t nextPeriod(struct sr_trace_thread *T) {
+    T->Random ^= T->Random << 13;
+    T->Random ^= T->Random >> 7;
+    T->Random ^= T->Random << 17;
+    return Period - Period / 4 + T->Random % (Period / 2 + 1);
+}
+
+void __sr_trace_access(struct sr_trace_site *Site, void *Address) {
+    struct sr_trace_thread *T = threadState();
+    if (!T) {
+        __sr_trace_countdown = INT64_MAX;
+        return;
+    }
+    uint32_t Flags = 0;
+    if (!T->BurstLeft) {
+        T->BurstLeft = Burst;
+        Flags = SR_TRACE_BURST_START;
+    }
+    if (ReuseMode) {
+        reuseAccess(T, Site, (uint64_t)Address, Flags & SR_TRACE_BURST_START);
+    } else {
+        T->Records[T->Len++] = (struct sr_trace_record){(uint64_t)Address, Site->Id, Flags};
+        if (T->Len == SR_TRACE_BUFFER)
+            flush(T);
+    }
+    if (--T->BurstLeft) {
+        __sr_trace_countdown = 1;
+    } else {
+        uint64_t Gap = nextPeriod(T);
+        __sr_trace_countdown = Gap > Burst ? (int64_t)(Gap - Burst) : 1;
+    }
+}
@@ -0,0 +1,242 @@
+//===- ProfileRuntime.c - Runtime of instrumented programs ----------------===//
+//
+// Instrumented modules register their tables of site counters, of indirect
+// call targets and of memory operation lengths, from a constructor. At
+// exit, the non-zero counters are appended to the file named by
+// SR_PROFILE_FILE, "sr-profile.txt" by default, in a single write, so that
+// the runs of several processes can share one file.
+//
+//===----------------------------------------------------------------------===//
+
+#define _GNU_SOURCE
+#include "RuntimeUtil.h"
+
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Must match siteCounterType() in Instrumentation.h
+struct sr_site_counter {
+    const char *Function;
+    const char *Value;
+    uint32_t Site;
+    uint64_t Count;
+};
+
+struct sr_table {
+    const char *Kind;
+    struct sr_site_counter *Sites;
+    uint32_t N;
+    struct sr_table *Next;
+};
+
+static struct sr_table *Tables;
+
+// Must match IndirectCallProfile.cpp
+#define SR_ICALL_TOP_K 4
+
+struct sr_icall_site {
+    const char *Function;
+    uint32_t Site;
+    uint64_t Other;
+    struct {
+        void *Target;
+        uint64_t Count;
+    } Top[SR_ICALL_TOP_K];
+};
+
+struct sr_function_name {
+    void *Address;
+    const char *Name;
+};
+
+struct sr_icall_table {
+    struct sr_icall_site *Sites;
+    uint32_t N;
+    struct sr_function_name *Names;
+    uint32_t NumNames;
+    struct sr_icall_table *Next;
+};
+
+static struct sr_icall_table *ICallTables;
+
+// Must match MemSizeProfile.cpp
+#define SR_MEMSIZE_TOP_K 4
+
+// A slot holds its length plus one, so that an empty slot is zero and a
+// length of zero can still be counted
+struct sr_memsize_site {
+    const char *Function;
+    uint32_t Site;
+    uint64_t Other;
+    struct {
+        uint64_t Size;
+        uint64_t Count;
+    } Top[SR_MEMSIZE_TOP_K];
+};
+
+struct sr_memsize_table {
+    struct sr_memsize_site *Sites;
+    uint32_t N;
+    struct sr_memsize_table *Next;
+};
+
+static struct sr_memsize_table *MemSizeTables;
+
+static void writeProfile(void);
+
+static void registerExitHandler(void) {
+    if (!Tables && !ICallTables && !MemSizeTables)
+        atexit(writeProfile);
+}
+
+// Name of an indirect call target, from the tables of the instrumented
+// modules or else from the dynamic symbol table
+static const char *targetName(void *Target) {
+    for (struct sr_icall_table *T = ICallTables; T; T = T->Next)
+        for (uint32_t I = 0; I < T->NumNames; ++I)
+            if (T->Names[I].Address == Target)
+                return T->Names[I].Name;
+    Dl_info Info;
+    if (dladdr(Target, &Info) && Info.dli_sname && Info.dli_saddr == Target)
+        return Info.dli_sname;
+    return NULL;
+}
+
+static void writeProfile(void) {
+    char *Buf = NULL;
+    size_t Len = 0;
+    FILE *Out = open_memstream(&Buf, &Len);
+    if (!Out)
+        return;
+    for (struct sr_table *T = Tables; T; T = T->Next)
+        for (uint32_t I = 0; I < T->N; ++I)
+            if (T->Sites[I].Count)
+                fprintf(Out, "%s\t%s\t%u\t%s\t%llu\n", T->Kind, T->Sites[I].Function,
+                        T->Sites[I].Site, T->Sites[I].Value,
+                        (unsigned long long)T->Sites[I].Count);
+    for (struct sr_icall_table *T = ICallTables; T; T = T->Next) {
+        for (uint32_t I = 0; I < T->N; ++I) {
+            struct sr_icall_site *S = &T->Sites[I];
+            uint64_t Other = S->Other;
+            for (unsigned K = 0; K < SR_ICALL_TOP_K && S->Top[K].Target; ++K) {
+                const char *Name = targetName(S->Top[K].Target);
+                if (!Name) {
+                    Other += S->Top[K].Count;
+                    continue;
+                }
+                fprintf(Out, "icall\t%s\t%u\t%s\t%llu\n", S->Function, S->Site, Name,
+                        (unsigned long long)S->Top[K].Count);
+            }
+            if (Other)
+                fprintf(Out, "icall\t%s\t%u\t*\t%llu\n", S->Function, S->Site,
+                        (unsigned long long)Other);
+        }
+    }
+    for (struct sr_memsize_table *T = MemSizeTables; T; T = T->Next) {
+        for (uint32_t I = 0; I < T->N; ++I) {
+            struct sr_memsize_site *S = &T->Sites[I];
+            for (unsigned K = 0; K < SR_MEMSIZE_TOP_K && S->Top[K].Size; ++K)
+                fprintf(Out, "memsize\t%s\t%u\t%llu\t%llu\n", S->Function, S->Site,
+                        (unsigned long long)(S->Top[K].Size - 1),
+                        (unsigned long long)S->Top[K].Count);
+            if (S->Other)
+                fprintf(Out, "memsize\t%s\t%u\t*\t%llu\n", S->Function, S->Site,
+                        (unsigned long long)S->Other);
+        }
+    }
+    fclose(Out);
+
+    appendOutput("SR_PROFILE_FILE", "sr-profile.txt", "sr-profile", Buf, Len);
+    free(Buf);
+}
+
+void __sr_profile_register(const char *Kind, struct sr_site_counter *Sites, uint32_t N) {
+    struct sr_table *T = malloc(sizeof(*T));
+    if (!T)
+        return;
+    registerExitHandler();
+    T->Kind = Kind;
+    T->Sites = Sites;
+    T->N = N;
+    T->Next = Tables;
+    Tables = T;
+}
+
+void __sr_profile_register_icalls(struct sr_icall_site *Sites, uint32_t N,
+                                  struct sr_function_name *Names, uint32_t NumNames) {
+    struct sr_icall_table *T = malloc(sizeof(*T));
+    if (!T)
+        return;
+    registerExitHandler();
+    T->Sites = Sites;
+    T->N = N;
+    T->Names = Names;
+    T->NumNames = NumNames;
+    T->Next = ICallTables;
+    ICallTables = T;
+}
+
+void __sr_profile_register_memsizes(struct sr_memsize_site *Sites, uint32_t N) {
+    struct sr_memsize_table *T = malloc(sizeof(*T));
+    if (!T)
+        return;
+    registerExitHandler();
+    T->Sites = Sites;
+    T->N = N;
+    T->Next = MemSizeTables;
+    MemSizeTables = T;
+}
+
+// Called before every instrumented indirect call. A slot is claimed for a
+// new target with a compare-and-swap; once all are taken, further targets
+// are only counted together.
+void __sr_profile_icall(struct sr_icall_site *Site, void *Target) {
+    for (unsigned K = 0; K < SR_ICALL_TOP_K; ++K) {
+        void *Slot = __atomic_load_n(&Site->Top[K].Target, __ATOMIC_RELAXED);
+        if (!Slot && __atomic_compare_exchange_n(&Site->Top[K].Target, &Slot, Target, 0,
+                                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            Slot = Target;
+        if (Slot == Target) {
+            __atomic_fetch_add(&Site->Top[K].Count, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    __atomic_fetch_add(&Site->Other, 1, __ATOMIC_RELAXED);
+}
+
+// Called before every instrumented memcpy, memmove and memset of variable
+// length, with the slots claimed as for indirect call targets
+void __sr_profile_memsize(struct sr_memsize_site *Site, uint64_t Size) {
+    for (unsigned K = 0; K < SR_MEMSIZE_TOP_K; ++K) {
+        uint64_t Slot = __atomic_load_n(&Site->Top[K].Size, __ATOMIC_RELAXED);
+        if (!Slot && __atomic_compare_exchange_n(&Site->Top[K].Size, &Slot, Size + 1, 0,
+                                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            Slot = Size + 1;
+        if (Slot == Size + 1) {
+            __atomic_fetch_add(&Site->Top[K].Count, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    __atomic_fetch_add(&Site->Other, 1, __ATOMIC_RELAXED);
+}
+
+// Called before every instrumented conditional branch, with the state of
+// its predictor: the last 4 directions in the low bits, which select one of
+// 16 two-bit saturating counters above them. Returns 1 if the predictor
+// guessed wrong. Must match BranchBiasProfile.cpp.
+uint64_t __sr_profile_branch(uint64_t *State, uint32_t Taken) {
+    uint64_t S = *State;
+    unsigned History = S & 0xf, Shift = 4 + 2 * History;
+    unsigned Counter = (S >> Shift) & 3;
+    uint64_t Miss = (Counter >= 2) != (Taken != 0);
+    if (Taken && Counter < 3)
+        ++Counter;
+    else if (!Taken && Counter > 0)
+        --Counter;
+    S = (S & ~(3ull << Shift)) | ((uint64_t)Counter << Shift);
+    *State = (S & ~0xfull) | (((History << 1) | (Taken != 0)) & 0xf);
+    return Miss;
+}
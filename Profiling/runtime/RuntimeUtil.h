@@ -0,0 +1,59 @@
+//===- RuntimeUtil.h - Helpers shared by the profiling runtimes -----------===//
+//
+// Each runtime formats its report in memory at exit and appends it to a file
+// named by an environment variable in a single write, so that the processes
+// of one run can share the file. These are the helpers they have in common;
+// the header is internal to the ProfileRuntime library.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TUTORIAL_LLVM_PASS_RUNTIMEUTIL_H
+#define TUTORIAL_LLVM_PASS_RUNTIMEUTIL_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Opens the file named by Env, or Default, for appending; -1 on failure
+static inline int openOutput(const char *Env, const char *Default) {
+    const char *Path = getenv(Env);
+    return open(Path && *Path ? Path : Default, O_WRONLY | O_CREAT | O_APPEND, 0644);
+}
+
+static inline void writeAll(int Fd, const void *Buf, size_t Len) {
+    for (const char *P = (const char *)Buf; Len;) {
+        ssize_t Written = write(Fd, P, Len);
+        if (Written <= 0)
+            return;
+        P += Written;
+        Len -= (size_t)Written;
+    }
+}
+
+// Appends Buf to the file named by Env, or Default, reporting a failure to
+// open it under Tag
+static inline void appendOutput(const char *Env, const char *Default, const char *Tag,
+                                const char *Buf, size_t Len) {
+    int Fd = openOutput(Env, Default);
+    if (Fd < 0) {
+        perror(Tag);
+        return;
+    }
+    writeAll(Fd, Buf, Len);
+    close(Fd);
+}
+
+static inline void printTime(FILE *Out, uint64_t Ns) {
+    if (Ns >= 1000000000u)
+        fprintf(Out, "%.1fs", Ns / 1e9);
+    else if (Ns >= 1000000u)
+        fprintf(Out, "%.1fms", Ns / 1e6);
+    else if (Ns >= 1000u)
+        fprintf(Out, "%.1fus", Ns / 1e3);
+    else
+        fprintf(Out, "%lluns", (unsigned long long)Ns);
+}
+
+#endif // TUTORIAL_LLVM_PASS_RUNTIMEUTIL_H
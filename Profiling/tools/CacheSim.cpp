@@ -0,0 +1,321 @@
+//===- CacheSim.cpp - Replay memory traces through simulated caches -------===//
+//
+// Reads the traces that programs instrumented with -sr-memory-trace write
+// (see runtime/MemoryTrace.c), and replays every recorded access through a
+// set-associative, least-recently-used cache hierarchy: an L1 and an L2 for
+// each thread, and an LLC shared by the threads of a process. A line missing
+// from a level is brought into every level above it too. The first
+// -warmup accesses of each burst only refill caches that went stale while
+// the program ran untraced, and are not counted.
+//
+// It reports the misses of each source site and of each data structure,
+// ranked by the cycles they are estimated to cost:
+//
+//   $ sr-cachesim sr-trace.bin
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <vector>
+
+using namespace llvm;
+
+static cl::list<std::string> Inputs(cl::Positional, cl::OneOrMore,
+                                    cl::desc("<trace files>"));
+
+static cl::opt<unsigned> LineSize("line-size", cl::init(64), cl::desc("Cache line size in bytes"));
+
+static cl::opt<uint64_t> L1Size("l1-size", cl::init(32 << 10), cl::desc("L1 size in bytes"));
+static cl::opt<unsigned> L1Ways("l1-ways", cl::init(8), cl::desc("L1 associativity"));
+static cl::opt<uint64_t> L2Size("l2-size", cl::init(1 << 20), cl::desc("L2 size in bytes"));
+static cl::opt<unsigned> L2Ways("l2-ways", cl::init(16), cl::desc("L2 associativity"));
+static cl::opt<uint64_t> LLCSize("llc-size", cl::init(32 << 20),
+                                 cl::desc("Size in bytes of the LLC shared by a process"));
+static cl::opt<unsigned> LLCWays("llc-ways", cl::init(16), cl::desc("LLC associativity"));
+
+static cl::opt<unsigned> L2Latency("l2-latency", cl::init(14),
+                                   cl::desc("Cycles an L1 miss costs when the L2 has the line"));
+static cl::opt<unsigned> LLCLatency("llc-latency", cl::init(40),
+                                    cl::desc("Cycles an L1 miss costs when the LLC has the line"));
+static cl::opt<unsigned> MemoryLatency("memory-latency", cl::init(200),
+                                       cl::desc("Cycles an LLC miss costs"));
+
+static cl::opt<unsigned> Warmup("warmup", cl::init(4096),
+                                cl::desc("Accesses at the start of each burst that only warm "
+                                         "up the caches"));
+
+static cl::opt<unsigned> Top("top", cl::init(20),
+                             cl::desc("Sites and data structures to report, 0 for all"));
+
+namespace {
+
+// Must match runtime/MemoryTrace.c
+struct ChunkHeader {
+    char Magic[4];
+    uint32_t Kind;
+    uint32_t Pid;
+    uint32_t Tid;
+    uint64_t Size;
+};
+
+struct TraceRecord {
+    uint64_t Address;
+    uint32_t Site;
+    uint32_t Flags;
+};
+
+enum ChunkKind : uint32_t { Accesses = 0, Sites = 1 };
+constexpr uint32_t BurstStart = 1;
+
+class Cache {
+    uint64_t Sets;
+    unsigned Ways;
+    // Per way of each set, the line it holds plus one, or 0, and when it
+    // was used last
+    std::vector<uint64_t> Tags, LastUse;
+    uint64_t Clock = 0;
+
+public:
+    Cache(uint64_t Size, unsigned Ways, unsigned LineSize)
+        : Sets(std::max<uint64_t>(Size / LineSize / std::max(Ways, 1u), 1)),
+          Ways(std::max(Ways, 1u)), Tags(Sets * this->Ways), LastUse(Sets * this->Ways) {}
+
+    // Whether Line was cached; it is afterwards, in place of the least
+    // recently used line of its set
+    bool access(uint64_t Line) {
+        uint64_t *Set = &Tags[Line % Sets * Ways], *Use = &LastUse[Line % Sets * Ways];
+        unsigned Victim = 0;
+        for (unsigned Way = 0; Way < Ways; ++Way) {
+            if (Set[Way] == Line + 1) {
+                Use[Way] = ++Clock;
+                return true;
+            }
+            if (Use[Way] < Use[Victim])
+                Victim = Way;
+        }
+        Set[Victim] = Line + 1;
+        Use[Victim] = ++Clock;
+        return false;
+    }
+};
+
+struct Counts {
+    uint64_t Accesses = 0, L1Misses = 0, L2Misses = 0, LLCMisses = 0;
+
+    void add(const Counts &C) {
+        Accesses += C.Accesses;
+        L1Misses += C.L1Misses;
+        L2Misses += C.L2Misses;
+        LLCMisses += C.LLCMisses;
+    }
+
+    uint64_t cycles() const {
+        return (L1Misses - L2Misses) * L2Latency + (L2Misses - LLCMisses) * LLCLatency +
+               LLCMisses * MemoryLatency;
+    }
+};
+
+struct Site {
+    std::string Label, Object;
+};
+
+struct ThreadCaches {
+    Cache L1{L1Size, L1Ways, LineSize}, L2{L2Size, L2Ways, LineSize};
+    unsigned WarmupLeft = 0;
+};
+
+class Simulator {
+    // Indexed by process and thread, or by process and site
+    static uint64_t key(uint32_t Pid, uint32_t Id) { return uint64_t(Pid) << 32 | Id; }
+
+    std::map<uint64_t, std::unique_ptr<ThreadCaches>> Threads;
+    std::map<uint32_t, std::unique_ptr<Cache>> LLCs;
+    DenseMap<uint64_t, Counts> SiteCounts;
+    DenseMap<uint64_t, Site> SiteNames;
+    DenseMap<uint64_t, unsigned> SiteSizes;
+
+public:
+    uint64_t Counted = 0, WarmupAccesses = 0;
+
+    void access(const ChunkHeader &H, const TraceRecord &R) {
+        unsigned Size = SiteSizes.lookup(key(H.Pid, R.Site));
+        auto &T = Threads[key(H.Pid, H.Tid)];
+        if (!T)
+            T = std::make_unique<ThreadCaches>();
+        auto &LLC = LLCs[H.Pid];
+        if (!LLC)
+            LLC = std::make_unique<Cache>(LLCSize, LLCWays, LineSize);
+        if (R.Flags & BurstStart)
+            T->WarmupLeft = Warmup;
+
+        // An access that straddles lines misses if any of them does
+        bool L1Miss = false, L2Miss = false, LLCMiss = false;
+        uint64_t First = R.Address / LineSize;
+        uint64_t Last = (R.Address + std::max(Size, 1u) - 1) / LineSize;
+        for (uint64_t Line = First; Line <= Last; ++Line) {
+            if (T->L1.access(Line))
+                continue;
+            L1Miss = true;
+            if (T->L2.access(Line))
+                continue;
+            L2Miss = true;
+            LLCMiss |= !LLC->access(Line);
+        }
+        if (T->WarmupLeft) {
+            --T->WarmupLeft;
+            ++WarmupAccesses;
+            return;
+        }
+        Counts &C = SiteCounts[key(H.Pid, R.Site)];
+        ++C.Accesses;
+        C.L1Misses += L1Miss;
+        C.L2Misses += L2Miss;
+        C.LLCMisses += LLCMiss;
+        ++Counted;
+    }
+
+    // Lines "id function location object size load|store"
+    void addSites(const ChunkHeader &H, StringRef Text) {
+        SmallVector<StringRef, 0> Lines;
+        Text.split(Lines, '\n', -1, /*KeepEmpty=*/false);
+        for (StringRef Line : Lines) {
+            SmallVector<StringRef, 6> Fields;
+            Line.split(Fields, '\t');
+            uint32_t Id;
+            if (Fields.size() != 6 || Fields[0].getAsInteger(10, Id))
+                continue;
+            SiteNames[key(H.Pid, Id)] = {(Fields[2] + " " + Fields[5] + " in " + Fields[1]).str(),
+                                      Fields[3].str()};
+            unsigned Size = 1;
+            Fields[4].getAsInteger(10, Size);
+            SiteSizes[key(H.Pid, Id)] = Size;
+        }
+    }
+
+    void report(raw_ostream &OS) const;
+};
+
+void printTable(raw_ostream &OS, StringRef Title, const StringMap<Counts> &Table) {
+    std::vector<std::pair<StringRef, Counts>> Rows;
+    for (const auto &Entry : Table)
+        Rows.push_back({Entry.getKey(), Entry.getValue()});
+    std::sort(Rows.begin(), Rows.end(), [](const auto &A, const auto &B) {
+        if (A.second.cycles() != B.second.cycles())
+            return A.second.cycles() > B.second.cycles();
+        return A.first < B.first;
+    });
+    if (Top && Rows.size() > Top)
+        Rows.resize(Top);
+
+    auto Percent = [](uint64_t Part, uint64_t Whole) {
+        return Whole ? 100.0 * double(Part) / double(Whole) : 0.0;
+    };
+    OS << "\n  " << Title << "\n"
+       << "      Accesses   L1 miss%   L2 miss%  LLC miss%   Miss cycles  Name\n";
+    for (const auto &[Name, C] : Rows)
+        OS << format("  %12llu  %9.2f  %9.2f  %9.2f  %12llu  ", (unsigned long long)C.Accesses,
+                     Percent(C.L1Misses, C.Accesses), Percent(C.L2Misses, C.Accesses),
+                     Percent(C.LLCMisses, C.Accesses), (unsigned long long)C.cycles())
+           << Name << "\n";
+}
+
+void Simulator::report(raw_ostream &OS) const {
+    // The same site in several processes, or several runs, is merged
+    StringMap<Counts> BySite, ByObject;
+    Counts Total;
+    for (const auto &[Key, C] : SiteCounts) {
+        auto It = SiteNames.find(Key);
+        StringRef Label = It != SiteNames.end() ? StringRef(It->second.Label) : "<unnamed site>";
+        StringRef Object = It != SiteNames.end() ? StringRef(It->second.Object) : "<unknown>";
+        BySite[Label].add(C);
+        ByObject[Object].add(C);
+        Total.add(C);
+    }
+
+    OS << "===" << std::string(73, '-') << "===\n"
+       << "  Cache simulation: " << Counted << " accesses counted, " << WarmupAccesses
+       << " warm-up, " << Threads.size() << " threads\n"
+       << format("  L1 %llu KiB %u-way, L2 %llu KiB %u-way, LLC %llu KiB %u-way, %u B lines\n",
+                 (unsigned long long)(L1Size >> 10), unsigned(L1Ways),
+                 (unsigned long long)(L2Size >> 10), unsigned(L2Ways),
+                 (unsigned long long)(LLCSize >> 10), unsigned(LLCWays), unsigned(LineSize))
+       << "  Miss rates are per access; miss cycles rank the rows\n"
+       << "===" << std::string(73, '-') << "===\n";
+    StringMap<Counts> Totals;
+    Totals["total"] = Total;
+    printTable(OS, "Total", Totals);
+    printTable(OS, "Sites", BySite);
+    printTable(OS, "Data structures", ByObject);
+}
+
+// Calls Handle with the header and payload of each chunk of Data, in order
+template <typename HandlerT>
+void forEachChunk(StringRef Path, StringRef Data, HandlerT Handle) {
+    while (!Data.empty()) {
+        ChunkHeader H;
+        if (Data.size() < sizeof(H)) {
+            errs() << "sr-cachesim: " << Path << ": truncated chunk header\n";
+            return;
+        }
+        std::memcpy(&H, Data.data(), sizeof(H));
+        Data = Data.drop_front(sizeof(H));
+        if (std::memcmp(H.Magic, "SRTR", 4) || H.Size > Data.size()) {
+            errs() << "sr-cachesim: " << Path << ": malformed chunk\n";
+            return;
+        }
+        Handle(H, Data.take_front(H.Size));
+        Data = Data.drop_front(H.Size);
+    }
+}
+
+bool readTrace(StringRef Path, Simulator &Sim) {
+    auto Buffer = MemoryBuffer::getFile(Path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!Buffer) {
+        errs() << "sr-cachesim: cannot read " << Path << ": " << Buffer.getError().message()
+               << "\n";
+        return false;
+    }
+    // A process writes its sites at exit, after its accesses, so they are
+    // read first
+    StringRef Data = (*Buffer)->getBuffer();
+    forEachChunk(Path, Data, [&](const ChunkHeader &H, StringRef Payload) {
+        if (H.Kind == Sites)
+            Sim.addSites(H, Payload);
+    });
+    forEachChunk(Path, Data, [&](const ChunkHeader &H, StringRef Payload) {
+        if (H.Kind != Accesses)
+            return;
+        for (size_t Offset = 0; Offset + sizeof(TraceRecord) <= Payload.size();
+             Offset += sizeof(TraceRecord)) {
+            TraceRecord R;
+            std::memcpy(&R, Payload.data() + Offset, sizeof(R));
+            Sim.access(H, R);
+        }
+    });
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv, "Cache simulator for sr-memory-trace traces\n");
+    Simulator Sim;
+    bool OK = true;
+    for (const std::string &Path : Inputs)
+        OK &= readTrace(Path, Sim);
+    Sim.report(outs());
+    return OK ? 0 : 1;
+}
@@ -0,0 +1,257 @@
+#include "LoopBlocking.h"
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicsX86.h"
+#include "llvm/IR/PatternMatch.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/TargetParser/Triple.h"
+
+using namespace llvm;
+using namespace llvm::PatternMatch;
+
+namespace {
+
+enum class ReductionKind { SAD, Dot };
+
+// acc += abs(zext(a[i]) - zext(b[i]))  or  acc += ext(a[i]) * ext(b[i])
+struct ReductionIdiom {
+    ReductionKind Kind;
+    PHINode *Acc = nullptr;
+    LoadInst *A = nullptr, *B = nullptr;
+    const SCEV *BaseA = nullptr, *BaseB = nullptr;
+    // Dot only: extensions of the loads, the multiply type and an optional
+    // extension of the product to the accumulator type
+    Instruction::CastOps ExtA, ExtB;
+    Type *ProdTy = nullptr;
+    std::optional<Instruction::CastOps> ProdExt;
+};
+
+// What the target offers for the vector body
+struct TargetSupport {
+    bool SSE2 = false;
+    bool VNNI = false;
+
+    explicit TargetSupport(const Function &F) {
+        Triple T(F.getParent()->getTargetTriple());
+        if (!T.isX86())
+            return;
+        StringRef Features = F.getFnAttribute("target-features").getValueAsString();
+        SSE2 = T.getArch() == Triple::x86_64 || Features.contains("+sse2");
+        VNNI = Features.contains("+avxvnni") ||
+               (Features.contains("+avx512vnni") && Features.contains("+avx512vl"));
+    }
+};
+
+bool matchExtLoad(Value *V, Loop &L, ScalarEvolution &SE,
+                  LoadInst *&Load, const SCEV *&Base, Instruction::CastOps &Ext) {
+    auto *Cast = dyn_cast<CastInst>(V);
+    if (!Cast || (!isa<ZExtInst>(Cast) && !isa<SExtInst>(Cast)))
+        return false;
+    Ext = Cast->getOpcode();
+    return matchUnitStrideLoad(Cast->getOperand(0), L, SE, Load, Base);
+}
+
+// Match the loop-carried accumulator and the term added to it every iteration
+bool matchReduction(PHINode &Phi, Loop &L, ScalarEvolution &SE, ReductionIdiom &R) {
+    if (!Phi.getType()->isIntegerTy() || !Phi.hasOneUse())
+        return false;
+    Value *Term;
+    Value *Update = Phi.getIncomingValueForBlock(L.getLoopLatch());
+    if (!match(Update, m_c_Add(m_Specific(&Phi), m_Value(Term))))
+        return false;
+    R.Acc = &Phi;
+
+    // The term may be computed on a narrower type and extended to the accumulator
+    std::optional<Instruction::CastOps> TermExt;
+    if (auto *Cast = dyn_cast<CastInst>(Term)) {
+        if (isa<ZExtInst>(Cast) || isa<SExtInst>(Cast)) {
+            TermExt = Cast->getOpcode();
+            Term = Cast->getOperand(0);
+        }
+    }
+
+    Value *X, *Y;
+    if (match(Term, m_Intrinsic<Intrinsic::abs>(m_Sub(m_ZExt(m_Value(X)),
+                                                      m_ZExt(m_Value(Y))),
+                                                m_Value()))) {
+        // |a - b| of bytes needs at least 9 bits to be computed exactly
+        R.Kind = ReductionKind::SAD;
+        return Term->getType()->getScalarSizeInBits() > 8 &&
+               matchUnitStrideLoad(X, L, SE, R.A, R.BaseA) &&
+               matchUnitStrideLoad(Y, L, SE, R.B, R.BaseB) &&
+               R.A->getType()->isIntegerTy(8) && R.B->getType()->isIntegerTy(8);
+    }
+    if (match(Term, m_Mul(m_Value(X), m_Value(Y)))) {
+        R.Kind = ReductionKind::Dot;
+        R.ProdTy = Term->getType();
+        R.ProdExt = TermExt;
+        if (!matchExtLoad(X, L, SE, R.A, R.BaseA, R.ExtA) ||
+            !matchExtLoad(Y, L, SE, R.B, R.BaseB, R.ExtB))
+            return false;
+        Type *SrcTy = R.A->getType();
+        return SrcTy == R.B->getType() &&
+               (SrcTy->isIntegerTy(8) || SrcTy->isIntegerTy(16));
+    }
+    return false;
+}
+
+// pmaddwd multiplies signed words: bytes of either signedness and signed
+// words fit, and the pairwise sums wrap exactly like the scalar i32 adds.
+bool canUsePMAddWD(const ReductionIdiom &R) {
+    if (!R.ProdTy->isIntegerTy(32) || R.ProdExt || !R.Acc->getType()->isIntegerTy(32))
+        return false;
+    if (R.A->getType()->isIntegerTy(16))
+        return R.ExtA == Instruction::SExt && R.ExtB == Instruction::SExt;
+    return true;
+}
+
+// Emits the body of the blocked loop for one reduction: Step consumes one
+// vector of Block elements from each array, and the result is accumulated
+// into a vector or scalar accumulator reduced by Finish in the middle block.
+struct VectorBody {
+    unsigned Block;
+    Type *AccTy;
+    std::function<Value *(IRBuilder<> &, Value *Acc, Value *VA, Value *VB)> Step;
+    std::function<Value *(IRBuilder<> &, Value *Acc)> Finish;
+};
+
+VectorBody buildVectorBody(const ReductionIdiom &R, const TargetSupport &TS, Module &M) {
+    LLVMContext &Ctx = M.getContext();
+    Type *AccTy = R.Acc->getType();
+    auto Reduce = [AccTy](IRBuilder<> &B, Value *Acc) {
+        return B.CreateZExtOrTrunc(B.CreateAddReduce(Acc), AccTy);
+    };
+
+    if (R.Kind == ReductionKind::SAD) {
+        if (TS.SSE2) {
+            // psadbw sums each half of the absolute byte differences into an i64
+            Type *VAccTy = FixedVectorType::get(Type::getInt64Ty(Ctx), 2);
+            return {16, VAccTy,
+                    [&M](IRBuilder<> &B, Value *Acc, Value *VA, Value *VB) {
+                        Function *PSAD = Intrinsic::getDeclaration(&M, Intrinsic::x86_sse2_psad_bw);
+                        return B.CreateAdd(Acc, B.CreateCall(PSAD, {VA, VB}));
+                    },
+                    Reduce};
+        }
+        // Partial reduction of each block: the absolute difference is
+        // computed on bytes and only widened for the horizontal add
+        return {16, AccTy,
+                [AccTy](IRBuilder<> &B, Value *Acc, Value *VA, Value *VB) {
+                    Value *Max = B.CreateBinaryIntrinsic(Intrinsic::umax, VA, VB);
+                    Value *Min = B.CreateBinaryIntrinsic(Intrinsic::umin, VA, VB);
+                    Value *Diff = B.CreateZExt(B.CreateSub(Max, Min),
+                                               FixedVectorType::get(AccTy, 16));
+                    return B.CreateAdd(Acc, B.CreateAddReduce(Diff));
+                },
+                [](IRBuilder<> &, Value *Acc) { return Acc; }};
+    }
+
+    if (TS.SSE2 && canUsePMAddWD(R)) {
+        Type *WordsTy = FixedVectorType::get(Type::getInt16Ty(Ctx), 8);
+        Type *VAccTy = FixedVectorType::get(Type::getInt32Ty(Ctx), 4);
+        auto ExtA = R.ExtA, ExtB = R.ExtB;
+        return {8, VAccTy,
+                [&M, WordsTy, VAccTy, ExtA, ExtB, VNNI = TS.VNNI](IRBuilder<> &B, Value *Acc,
+                                                                 Value *VA, Value *VB) -> Value * {
+                    VA = B.CreateCast(ExtA, VA, WordsTy);
+                    VB = B.CreateCast(ExtB, VB, WordsTy);
+                    if (VNNI) {
+                        // vpdpwssd folds the accumulation into the multiply-add
+                        Function *DP = Intrinsic::getDeclaration(&M, Intrinsic::x86_avx512_vpdpwssd_128);
+                        return B.CreateCall(DP, {Acc, B.CreateBitCast(VA, VAccTy),
+                                                 B.CreateBitCast(VB, VAccTy)});
+                    }
+                    Function *PMAdd = Intrinsic::getDeclaration(&M, Intrinsic::x86_sse2_pmadd_wd);
+                    return B.CreateAdd(Acc, B.CreateCall(PMAdd, {VA, VB}));
+                },
+                Reduce};
+    }
+
+    // Partial reduction of each block with the scalar loop's own arithmetic
+    Type *ProdVecTy = FixedVectorType::get(R.ProdTy, 16);
+    auto ExtA = R.ExtA, ExtB = R.ExtB;
+    auto ProdExt = R.ProdExt;
+    return {16, AccTy,
+            [=](IRBuilder<> &B, Value *Acc, Value *VA, Value *VB) {
+                Value *Prod = B.CreateMul(B.CreateCast(ExtA, VA, ProdVecTy),
+                                          B.CreateCast(ExtB, VB, ProdVecTy));
+                if (ProdExt)
+                    Prod = B.CreateCast(*ProdExt, Prod, FixedVectorType::get(AccTy, 16));
+                return B.CreateAdd(Acc, B.CreateAddReduce(Prod));
+            },
+            [](IRBuilder<> &, Value *Acc) { return Acc; }};
+}
+
+bool transformLoop(Loop &L, ScalarEvolution &SE, const TargetSupport &TS) {
+    BlockableLoop BL;
+    ReductionIdiom R;
+    if (!analyzeBlockableLoop(L, SE, BL) || !matchReduction(*BL.Acc, L, SE, R))
+        return false;
+
+    VectorBody Body = buildVectorBody(R, TS, *L.getHeader()->getModule());
+    Type *VecTyA = FixedVectorType::get(R.A->getType(), Body.Block);
+    Type *VecTyB = FixedVectorType::get(R.B->getType(), Body.Block);
+    LoopBlockBody LB{
+        Body.Block, Body.AccTy, {R.BaseA, R.BaseB},
+        [&](IRBuilder<> &, Value *) { return Constant::getNullValue(Body.AccTy); },
+        [&](IRBuilder<> &B, Value *Acc, Value *Idx, ArrayRef<Value *> Bases) {
+            return Body.Step(B, Acc, loadBlock(B, VecTyA, R.A, Bases[0], Idx),
+                             loadBlock(B, VecTyB, R.B, Bases[1], Idx));
+        },
+        [&](IRBuilder<> &B, Value *Acc, Value *Init) {
+            return B.CreateAdd(Init, Body.Finish(B, Acc));
+        }};
+    blockLoop(BL, SE, LB, "red.vec");
+    return true;
+}
+
+// Rewrites sum(abs(a[i] - b[i])) over bytes and sum(a[i] * b[i]) over bytes
+// and words into a blocked loop using psadbw and pmaddwd/vpdpwssd, or a
+// per-block partial reduction on other targets, followed by the original
+// loop for the remaining iterations.
+struct ReductionIdioms : public PassInfoMixin<ReductionIdioms> {
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        auto &LI = FAM.getResult<LoopAnalysis>(F);
+        auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+        TargetSupport TS(F);
+        bool Changed = false;
+        for (Loop *L : LI.getLoopsInPreorder())
+            Changed |= transformLoop(*L, SE, TS);
+        return Changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+    }
+};
+}
+
+// Register the pass as a plugin
+PassPluginLibraryInfo getReductionIdiomsPluginInfo() {
+    return {LLVM_PLUGIN_API_VERSION, "ReductionIdioms", LLVM_VERSION_STRING,
+            [](PassBuilder &PB) {
+                PB.registerPipelineParsingCallback(
+                    [](StringRef Name, FunctionPassManager &FPM,
+                       ArrayRef<PassBuilder::PipelineElement>) {
+                      if (Name == "reduction-idioms") {
+                        FPM.addPass(ReductionIdioms());
+                        return true;
+                      }
+                      return false;
+                    });
+                // The loops must be rotated and simplified, and the pass must
+                // claim them before the loop vectorizer does
+                PB.registerVectorizerStartEPCallback([](FunctionPassManager &FPM,
+                                                        OptimizationLevel Level) {
+                    FPM.addPass(ReductionIdioms());
+                });
+            }};
+}
+
+// Entry point for the pass plugin
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+    return getReductionIdiomsPluginInfo();
+}
@@ -0,0 +1,244 @@
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/PatternMatch.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+using namespace llvm;
+using namespace llvm::PatternMatch;
+
+namespace {
+
+// A value clamped to the signed range [Lo, Hi] by a chain of min/max
+struct Clamp {
+    Value *Inner;
+    APInt Lo, Hi;
+};
+
+// Peel min/max-with-constant operations off V, outermost first.
+// umin/umax are only accepted on operands known to be non-negative, where
+// they behave like their signed counterparts.
+bool matchClamp(Value *V, const DataLayout &DL, Clamp &C) {
+    unsigned Bits = V->getType()->getScalarSizeInBits();
+    C.Lo = APInt::getSignedMinValue(Bits);
+    C.Hi = APInt::getSignedMaxValue(Bits);
+    bool Peeled = false;
+    while (true) {
+        Value *X;
+        const APInt *K;
+        if (match(V, m_SMin(m_Value(X), m_APInt(K)))) {
+            C.Hi = APIntOps::smin(C.Hi, *K);
+        } else if (match(V, m_SMax(m_Value(X), m_APInt(K)))) {
+            C.Lo = APIntOps::smax(C.Lo, *K);
+        } else if (match(V, m_UMin(m_Value(X), m_APInt(K))) &&
+                   K->isNonNegative() && isKnownNonNegative(X, DL)) {
+            C.Hi = APIntOps::smin(C.Hi, *K);
+        } else {
+            break;
+        }
+        V = X;
+        Peeled = true;
+    }
+    C.Inner = V;
+    return Peeled;
+}
+
+// Match an operand of the wide arithmetic that is an extension from the
+// narrow type; constants that fit in it are left to narrowConstant.
+Value *matchNarrowOperand(Value *V, Type *&NarrowTy, bool Signed) {
+    Value *X;
+    if (Signed ? match(V, m_SExt(m_Value(X))) : match(V, m_ZExt(m_Value(X)))) {
+        if (NarrowTy && X->getType() != NarrowTy)
+            return nullptr;
+        NarrowTy = X->getType();
+        return X;
+    }
+    return nullptr;
+}
+
+Value *narrowConstant(Value *V, Type *NarrowTy, bool Signed) {
+    auto *C = dyn_cast<ConstantInt>(V);
+    if (!C)
+        return nullptr;
+    unsigned Bits = NarrowTy->getScalarSizeInBits();
+    const APInt &Val = C->getValue();
+    if (Signed ? !Val.isSignedIntN(Bits) : !Val.isIntN(Bits))
+        return nullptr;
+    return ConstantInt::get(NarrowTy, Val.trunc(Bits));
+}
+
+// Try to rewrite clamp(ext(x) op ext(y)) into ext(op.sat(x, y))
+Value *rewriteSaturating(Instruction &I, const DataLayout &DL) {
+    if (!I.getType()->isIntOrIntVectorTy())
+        return nullptr;
+    Clamp C;
+    if (!matchClamp(&I, DL, C))
+        return nullptr;
+
+    auto *Op = dyn_cast<BinaryOperator>(C.Inner);
+    if (!Op || (Op->getOpcode() != Instruction::Add &&
+                Op->getOpcode() != Instruction::Sub))
+        return nullptr;
+    bool IsAdd = Op->getOpcode() == Instruction::Add;
+
+    for (bool Signed : {false, true}) {
+        Type *NarrowTy = nullptr;
+        Value *X = matchNarrowOperand(Op->getOperand(0), NarrowTy, Signed);
+        Value *Y = matchNarrowOperand(Op->getOperand(1), NarrowTy, Signed);
+        if (!NarrowTy)
+            continue;
+        if (!X)
+            X = narrowConstant(Op->getOperand(0), NarrowTy, Signed);
+        if (!Y)
+            Y = narrowConstant(Op->getOperand(1), NarrowTy, Signed);
+        if (!X || !Y)
+            continue;
+
+        // The wide operation must not wrap for the ranges below to hold
+        unsigned N = NarrowTy->getScalarSizeInBits();
+        unsigned W = I.getType()->getScalarSizeInBits();
+        if (W < N + 2)
+            continue;
+
+        // Range of the narrow saturating result and of the unclamped wide value
+        APInt NLo = Signed ? APInt::getSignedMinValue(N).sext(W) : APInt(W, 0);
+        APInt NHi = Signed ? APInt::getSignedMaxValue(N).sext(W)
+                           : APInt::getMaxValue(N).zext(W);
+        APInt RLo = IsAdd ? NLo + NLo : NLo - NHi;
+        APInt RHi = IsAdd ? NHi + NHi : NHi - NLo;
+
+        // The clamp must be equivalent to saturating at the narrow bounds
+        // once the bounds that can never be reached are ignored.
+        auto EffLo = [&](const APInt &Lo) { return APIntOps::smax(Lo, RLo); };
+        auto EffHi = [&](const APInt &Hi) { return APIntOps::smin(Hi, RHi); };
+        if (EffLo(C.Lo) != EffLo(NLo) || EffHi(C.Hi) != EffHi(NHi))
+            continue;
+
+        Intrinsic::ID ID = IsAdd ? (Signed ? Intrinsic::sadd_sat : Intrinsic::uadd_sat)
+                                 : (Signed ? Intrinsic::ssub_sat : Intrinsic::usub_sat);
+        IRBuilder<> Builder(&I);
+        Value *Sat = Builder.CreateBinaryIntrinsic(ID, X, Y);
+        return Signed ? Builder.CreateSExt(Sat, I.getType())
+                      : Builder.CreateZExt(Sat, I.getType());
+    }
+    return nullptr;
+}
+
+// Try to rewrite (zext(a) + zext(b) [+ 1]) >> 1 on a type much wider than
+// a and b into the same average computed at twice the narrow width. This is
+// the form the x86 backend lowers to pavgb/pavgw, and it lets the vectorizer
+// pack twice as many lanes as the i32 arithmetic C integer promotion gives.
+Value *rewriteAverage(Instruction &I) {
+    Value *Sum;
+    if (!match(&I, m_LShr(m_Value(Sum), m_One())))
+        return nullptr;
+
+    // Flatten the add tree into its leaves
+    SmallVector<Value *, 4> Worklist{Sum}, Leaves;
+    while (!Worklist.empty()) {
+        Value *V = Worklist.pop_back_val();
+        Value *A, *B;
+        if (Leaves.size() + Worklist.size() < 2 &&
+            match(V, m_OneUse(m_Add(m_Value(A), m_Value(B))))) {
+            Worklist.push_back(A);
+            Worklist.push_back(B);
+        } else {
+            Leaves.push_back(V);
+        }
+    }
+
+    Type *NarrowTy = nullptr;
+    SmallVector<Value *, 2> Ops;
+    bool RoundUp = false;
+    for (Value *Leaf : Leaves) {
+        if (!RoundUp && match(Leaf, m_One()))
+            RoundUp = true;
+        else if (Value *X = matchNarrowOperand(Leaf, NarrowTy, /*Signed=*/false))
+            Ops.push_back(X);
+        else
+            return nullptr;
+    }
+    if (Ops.size() != 2)
+        return nullptr;
+
+    unsigned N = NarrowTy->getScalarSizeInBits();
+    unsigned W = I.getType()->getScalarSizeInBits();
+    if (W <= 2 * N)
+        return nullptr;
+
+    IRBuilder<> Builder(&I);
+    Type *MidTy = NarrowTy->getWithNewBitWidth(2 * N);
+    Value *A = Builder.CreateZExt(Ops[0], MidTy);
+    Value *B = Builder.CreateZExt(Ops[1], MidTy);
+    // At most 2^(N+1) - 1: no unsigned wrap, but a signed one for i1
+    Value *Add = Builder.CreateAdd(A, B, "", /*HasNUW=*/true);
+    if (RoundUp)
+        Add = Builder.CreateAdd(Add, ConstantInt::get(MidTy, 1), "", /*HasNUW=*/true);
+    Value *Avg = Builder.CreateTrunc(Builder.CreateLShr(Add, 1), NarrowTy);
+    return Builder.CreateZExt(Avg, I.getType());
+}
+
+// Recognizes clamp-after-add/sub and rounding averages written on widened
+// integer types and rewrites them to narrow saturating intrinsics and
+// narrow averages, which the vectorizer can map to paddus/psubs/pavg.
+struct SaturatingArithmetic : public PassInfoMixin<SaturatingArithmetic> {
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &) {
+        const DataLayout &DL = F.getParent()->getDataLayout();
+        // Replaced chains are deleted at the end so iteration stays valid
+        SmallVector<WeakTrackingVH, 8> Dead;
+        for (auto &BB : F) {
+            for (Instruction &Inst : BB) {
+                if (Inst.use_empty())
+                    continue;
+                Value *New = rewriteSaturating(Inst, DL);
+                if (!New)
+                    New = rewriteAverage(Inst);
+                if (!New)
+                    continue;
+                New->takeName(&Inst);
+                Inst.replaceAllUsesWith(New);
+                Dead.push_back(&Inst);
+            }
+        }
+        if (Dead.empty())
+            return PreservedAnalyses::all();
+        RecursivelyDeleteTriviallyDeadInstructions(Dead);
+        PreservedAnalyses PA;
+        PA.preserveSet<CFGAnalyses>();
+        return PA;
+    }
+};
+}
+
+// Register the pass as a plugin
+PassPluginLibraryInfo getSaturatingArithmeticPluginInfo() {
+    return {LLVM_PLUGIN_API_VERSION, "SaturatingArithmetic", LLVM_VERSION_STRING,
+            [](PassBuilder &PB) {
+                PB.registerPipelineParsingCallback(
+                    [](StringRef Name, FunctionPassManager &FPM,
+                       ArrayRef<PassBuilder::PipelineElement>) {
+                      if (Name == "saturating-arithmetic") {
+                        FPM.addPass(SaturatingArithmetic());
+                        return true;
+                      }
+                      return false;
+                    });
+                // Run right before the vectorizers, once InstCombine has put
+                // the clamps into their canonical min/max form
+                PB.registerVectorizerStartEPCallback([](FunctionPassManager &FPM,
+                                                        OptimizationLevel Level) {
+                    FPM.addPass(SaturatingArithmetic());
+                });
+            }};
+}
+
+// Entry point for the pass plugin
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+    return getSaturatingArithmeticPluginInfo();
+}
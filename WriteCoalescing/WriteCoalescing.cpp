@@ -0,0 +1,243 @@
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/TargetParser/Triple.h"
+
+using namespace llvm;
+
+static cl::opt<bool> CoalesceWrites(
+    "coalesce-writes", cl::init(false),
+    cl::desc("Run write-coalescing in the optimization pipeline; it changes what the "
+             "calls return when the gathered call fails or writes short"));
+
+namespace {
+
+// Calls gathered into one; well below IOV_MAX (1024 on Linux)
+const unsigned MaxPieces = 64;
+
+enum class WriteKind { None, Write, Send };
+
+// One write(fd, buf, n) or send(fd, buf, n, flags) call of a sequence
+struct Piece {
+    CallInst *Call;
+    Value *Fd, *Buf, *Len;
+};
+
+// Whether Call is a call of write, or of send where sendmsg has the Linux
+// struct msghdr layout
+WriteKind writeKind(const CallInst &Call, const TargetLibraryInfo &TLI) {
+    const Function *Callee = Call.getCalledFunction();
+    if (!Callee || Call.isNoBuiltin())
+        return WriteKind::None;
+    LibFunc LF;
+    if (TLI.getLibFunc(*Callee, LF) && LF == LibFunc_write && TLI.has(LF))
+        return WriteKind::Write;
+    const Module &M = *Call.getModule();
+    Triple T(M.getTargetTriple());
+    if (Callee->getName() != "send" || !Callee->isDeclaration() || !T.isOSLinux() ||
+        !TLI.has(LibFunc_write))
+        return WriteKind::None;
+    // ssize_t send(int, const void *, size_t, int)
+    FunctionType *Ty = Call.getFunctionType();
+    Type *SizeTy = M.getDataLayout().getIntPtrType(M.getContext());
+    if (Ty->getNumParams() != 4 || Ty->isVarArg() || Ty->getReturnType() != SizeTy ||
+        !Ty->getParamType(0)->isIntegerTy(32) || !Ty->getParamType(1)->isPointerTy() ||
+        Ty->getParamType(2) != SizeTy || !Ty->getParamType(3)->isIntegerTy(32))
+        return WriteKind::None;
+    return WriteKind::Send;
+}
+
+// Whether A and B are the same descriptor: the same value, or the same
+// field loaded again with nothing but the calls of the sequence, which only
+// write errno, in between
+bool sameDescriptor(Value *A, Value *B, ArrayRef<Piece> Run) {
+    if (A == B)
+        return true;
+    auto *LA = dyn_cast<LoadInst>(A);
+    auto *LB = dyn_cast<LoadInst>(B);
+    if (!LA || !LB || !LA->isSimple() || !LB->isSimple() ||
+        LA->getPointerOperand() != LB->getPointerOperand() || LA->getType() != LB->getType() ||
+        LA->getParent() != LB->getParent() || !LA->comesBefore(LB))
+        return false;
+    for (Instruction *I = LA->getNextNode(); I != LB; I = I->getNextNode())
+        if (I->mayWriteToMemory() &&
+            none_of(Run, [&](const Piece &P) { return P.Call == I; }))
+            return false;
+    return true;
+}
+
+// Replaces the calls of Run by one writev or sendmsg where the last one
+// was, with the iovec array on the stack
+void coalesce(ArrayRef<Piece> Run, WriteKind Kind) {
+    CallInst *Last = Run.back().Call;
+    Function &F = *Last->getFunction();
+    Module &M = *F.getParent();
+    LLVMContext &Ctx = M.getContext();
+    const DataLayout &DL = M.getDataLayout();
+    Type *SizeTy = DL.getIntPtrType(Ctx);
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    auto *I32 = Type::getInt32Ty(Ctx);
+    // struct iovec { void *iov_base; size_t iov_len; }
+    auto *IovecTy = StructType::get(Ptr, SizeTy);
+    auto *IovTy = ArrayType::get(IovecTy, Run.size());
+
+    IRBuilder<> Entry(&F.getEntryBlock(), F.getEntryBlock().getFirstInsertionPt());
+    AllocaInst *Iov = Entry.CreateAlloca(IovTy, nullptr, "iov");
+    IRBuilder<> Builder(Last);
+    auto Size = [&](Type *Ty) { return Builder.getInt64(DL.getTypeAllocSize(Ty)); };
+    Builder.CreateLifetimeStart(Iov, Size(IovTy));
+    for (auto [Index, P] : enumerate(Run)) {
+        Value *Base = Builder.CreateConstInBoundsGEP2_32(IovTy, Iov, 0, Index);
+        Builder.CreateStore(P.Buf, Base);
+        Builder.CreateStore(P.Len, Builder.CreateStructGEP(IovecTy, Base, 1));
+    }
+
+    Value *Fd = Run.front().Fd;
+    Type *RetTy = Last->getType();
+    CallInst *Total;
+    AllocaInst *Msg = nullptr;
+    if (Kind == WriteKind::Write) {
+        FunctionCallee Writev =
+            M.getOrInsertFunction("writev", RetTy, Fd->getType(), Ptr, I32);
+        Total = Builder.CreateCall(Writev, {Fd, Iov, Builder.getInt32(Run.size())});
+    } else {
+        // struct msghdr { void *msg_name; socklen_t msg_namelen;
+        //                 struct iovec *msg_iov; size_t msg_iovlen;
+        //                 void *msg_control; size_t msg_controllen; int msg_flags; }
+        auto *MsgTy = StructType::get(Ptr, I32, Ptr, SizeTy, Ptr, SizeTy, I32);
+        Msg = Entry.CreateAlloca(MsgTy, nullptr, "msg");
+        Builder.CreateLifetimeStart(Msg, Size(MsgTy));
+        Builder.CreateStore(Constant::getNullValue(MsgTy), Msg);
+        Builder.CreateStore(Iov, Builder.CreateStructGEP(MsgTy, Msg, 2));
+        Builder.CreateStore(ConstantInt::get(SizeTy, Run.size()),
+                            Builder.CreateStructGEP(MsgTy, Msg, 3));
+        FunctionCallee Sendmsg =
+            M.getOrInsertFunction("sendmsg", RetTy, Fd->getType(), Ptr, I32);
+        Total = Builder.CreateCall(Sendmsg, {Fd, Msg, Last->getArgOperand(3)});
+    }
+    Total->setDebugLoc(Last->getDebugLoc());
+    if (Msg)
+        Builder.CreateLifetimeEnd(Msg, Size(Msg->getAllocatedType()));
+    Builder.CreateLifetimeEnd(Iov, Size(IovTy));
+
+    // Each call returns its share of the bytes written: all of its own
+    // before a short write, what the short write reached into it, nothing
+    // after; or -1 when the whole call failed
+    Value *Failed = nullptr, *Offset = nullptr;
+    for (const Piece &P : Run) {
+        if (!P.Call->use_empty()) {
+            if (!Failed)
+                Failed = Builder.CreateICmpSLT(Total, ConstantInt::get(RetTy, 0));
+            Value *Rest = Offset ? Builder.CreateSub(Total, Offset) : Total;
+            Value *Done = Builder.CreateBinaryIntrinsic(
+                Intrinsic::smax, Rest, ConstantInt::get(RetTy, 0));
+            Done = Builder.CreateBinaryIntrinsic(Intrinsic::smin, Done, P.Len);
+            Value *Result = Builder.CreateSelect(Failed, Total, Done);
+            Result->takeName(P.Call);
+            P.Call->replaceAllUsesWith(Result);
+        }
+        if (P.Call != Last)
+            Offset = Offset ? Builder.CreateAdd(Offset, P.Len) : P.Len;
+    }
+    for (const Piece &P : Run)
+        P.Call->eraseFromParent();
+}
+
+// Gathers sequences of write calls on the same descriptor within a basic
+// block, with nothing in between that writes memory or has other side
+// effects, into one writev: a system call per sequence instead of one per
+// call. send calls with the same flags become one sendmsg on Linux.
+//
+// The data reaches the descriptor in the same order, in one system call.
+// What differs is how a failure shows: if the gathered call fails, every
+// call of the sequence returns -1, where the first calls may have
+// succeeded; and after a short write, the later calls return 0 instead of
+// writing their data after the gap. Code that checks each result before the
+// next call branches on it, which ends the sequence.
+struct WriteCoalescing : public PassInfoMixin<WriteCoalescing> {
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        auto &TLI = FAM.getResult<TargetLibraryAnalysis>(F);
+        SmallVector<SmallVector<Piece, 4>, 4> Runs;
+        SmallVector<WriteKind, 4> Kinds;
+        for (BasicBlock &BB : F) {
+            SmallVector<Piece, 4> Run;
+            WriteKind RunKind = WriteKind::None;
+            auto Flush = [&] {
+                if (Run.size() >= 2) {
+                    Runs.push_back(Run);
+                    Kinds.push_back(RunKind);
+                }
+                Run.clear();
+            };
+            for (Instruction &I : BB) {
+                // Results are only known once the sequence is written
+                if (any_of(I.operands(), [&](const Use &U) {
+                        return any_of(Run, [&](const Piece &P) { return U.get() == P.Call; });
+                    }))
+                    Flush();
+                auto *Call = dyn_cast<CallInst>(&I);
+                WriteKind Kind = Call ? writeKind(*Call, TLI) : WriteKind::None;
+                if (Kind != WriteKind::None) {
+                    Piece P{Call, Call->getArgOperand(0), Call->getArgOperand(1),
+                            Call->getArgOperand(2)};
+                    if (Run.empty() || Kind != RunKind || Run.size() == MaxPieces ||
+                        !sameDescriptor(Run.front().Fd, P.Fd, Run) ||
+                        (Kind == WriteKind::Send &&
+                         Call->getArgOperand(3) != Run.front().Call->getArgOperand(3))) {
+                        Flush();
+                        RunKind = Kind;
+                    }
+                    Run.push_back(P);
+                } else if (I.mayHaveSideEffects()) {
+                    Flush();
+                }
+            }
+            Flush();
+        }
+        for (auto [Run, Kind] : zip(Runs, Kinds))
+            coalesce(Run, Kind);
+
+        if (Runs.empty())
+            return PreservedAnalyses::all();
+        PreservedAnalyses PA;
+        PA.preserveSet<CFGAnalyses>();
+        return PA;
+    }
+};
+}
+
+// Register the pass as a plugin
+PassPluginLibraryInfo getWriteCoalescingPluginInfo() {
+    return {LLVM_PLUGIN_API_VERSION, "WriteCoalescing", LLVM_VERSION_STRING,
+            [](PassBuilder &PB) {
+                PB.registerPipelineParsingCallback(
+                    [](StringRef Name, FunctionPassManager &FPM,
+                       ArrayRef<PassBuilder::PipelineElement>) {
+                      if (Name == "write-coalescing") {
+                        FPM.addPass(WriteCoalescing());
+                        return true;
+                      }
+                      return false;
+                    });
+                // Once the helpers that write each part of a message have
+                // been inlined into the function that sends it; only on
+                // request, since the results of the calls change on errors
+                PB.registerScalarOptimizerLateEPCallback([](FunctionPassManager &FPM,
+                                                            OptimizationLevel Level) {
+                    if (CoalesceWrites)
+                        FPM.addPass(WriteCoalescing());
+                });
+            }};
+}
+
+// Entry point for the pass plugin
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+    return getWriteCoalescingPluginInfo();
+}
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define N 1000
+
+// Kernels for the ReductionIdioms pass. Build with -O2 so the loops are
+// rotated and the abs() calls become llvm.abs, then compare the output with
+// and without the plugin.
+
+int sad_u8(const uint8_t *a, const uint8_t *b, int n) {
+    int sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += abs(a[i] - b[i]);
+    return sum;
+}
+
+long sad_u8_long(const uint8_t *a, const uint8_t *b, long n) {
+    long sum = 0;
+    for (long i = 0; i < n; i++)
+        sum += abs(a[i] - b[i]);
+    return sum;
+}
+
+int dot_i16(const int16_t *a, const int16_t *b, int n) {
+    int sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+int dot_i8(const int8_t *a, const int8_t *b, int n) {
+    int sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+int dot_u8(const uint8_t *a, const uint8_t *b, int n) {
+    int sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+long dot_i16_long(const int16_t *a, const int16_t *b, int n) {
+    long sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += (long)a[i] * b[i];
+    return sum;
+}
+
+int main() {
+    static uint8_t u1[N], u2[N];
+    static int16_t w1[N], w2[N];
+    srand(42);
+    for (int i = 0; i < N; i++) {
+        u1[i] = rand();
+        u2[i] = rand();
+        w1[i] = rand();
+        w2[i] = rand();
+    }
+
+    // Odd lengths exercise the scalar remainder loop
+    int lengths[] = {1, 15, 16, 17, 999, N};
+    for (int i = 0; i < 6; i++) {
+        int n = lengths[i];
+        printf("n=%d sad=%d/%ld dot16=%d/%ld dot8=%d/%d\n", n,
+               sad_u8(u1, u2, n), sad_u8_long(u1, u2, n),
+               dot_i16(w1, w2, n), dot_i16_long(w1, w2, n),
+               dot_i8((int8_t *)u1, (int8_t *)u2, n), dot_u8(u1, u2, n));
+    }
+    return 0;
+}